@@ -73,13 +73,46 @@ typedef enum
     SPCO_LIST_MAX_SCAN_TIME  = (1<<12),
     SPCO_TAG_TRANSFER_TIME   = (1<<13),
     SPCO_LIST_TIME           = (1<<14),
-    SPCO_INVALID             = (1<<15)
+    SPCO_INVALID             = (1<<15),
+    SPCO_PLC_WRITES_SENT     = (1<<16),
+    SPCO_PLC_WRITES_COALESCED= (1<<17),
+    SPCO_STATISTIC           = (1<<18)  /* see SpecialStatistic */
 } SpecialOptions;
 
+/* Driver statistics that also pick special values,
+ * kept apart from the flags to leave their bits for options
+ */
+typedef enum
+{
+    STAT_NONE = 0,
+    /* Histograms, read by waveforms */
+    STAT_LIST_SCAN_TIME_HIST,
+    STAT_LIST_RTT_HIST,
+    STAT_LIST_LATENESS_HIST,
+    STAT_PLC_SCAN_TIME_HIST,
+    STAT_PLC_RTT_HIST,
+    STAT_PLC_LATENESS_HIST,
+    /* Times, read by ai */
+    STAT_LIST_PLAN_TIME,
+    STAT_LIST_ENCODE_TIME,
+    STAT_LIST_SEND_TIME,
+    STAT_LIST_WAIT_TIME,
+    STAT_LIST_DECODE_TIME,
+    STAT_LIST_CALLBACK_TIME,
+    STAT_PLC_LOCK_TIME
+} SpecialStatistic;
+
+#define STAT_IS_HISTOGRAM(stat) \
+    ((stat) >= STAT_LIST_SCAN_TIME_HIST  &&  (stat) <= STAT_PLC_LATENESS_HIST)
+
+/* Options are matched by prefix,
+ * so an option must be listed before those that are its prefix
+ */
 static struct
 {
     const char *text;
     SpecialOptions mask;
+    SpecialStatistic statistic;
 } special_options[] =
 {
   { "E",                  SPCO_READ_SINGLE_ELEMENT }, /* Force a SCAN for a single element */
@@ -90,12 +123,28 @@ static struct
   { "PLC_TASK_SLOW",      SPCO_PLC_TASK_SLOW      }, /* How often scan task had no time to wait */
   { "LIST_ERRORS",        SPCO_LIST_ERRORS        }, /* Error count for tag's list */
   { "LIST_TICKS",         SPCO_LIST_TICKS         }, /* 3.13-Ticktime when tag's list was checked */
+  { "LIST_SCAN_TIME_HIST",SPCO_STATISTIC, STAT_LIST_SCAN_TIME_HIST }, /* Histogram of scan times, must precede LIST_SCAN_TIME */
   { "LIST_SCAN_TIME",     SPCO_LIST_SCAN_TIME     }, /* Time for handling scanlist */
   { "LIST_MIN_SCAN_TIME", SPCO_LIST_MIN_SCAN_TIME }, /* min. of '' */
   { "LIST_MAX_SCAN_TIME", SPCO_LIST_MAX_SCAN_TIME }, /* max. of '' */
   { "TAG_TRANSFER_TIME",  SPCO_TAG_TRANSFER_TIME  }, /* Time for last round-trip data request */
   { "LIST_TIME",          SPCO_LIST_TIME          }, /* 3.14-# of seconds since 0000 Jan 1, 1990 */
-  { "",                   0                       }, /*      when tag's list was checked */
+                                                     /*      when tag's list was checked */
+  { "PLC_WRITES_SENT",    SPCO_PLC_WRITES_SENT    }, /* Tag writes sent to PLC */
+  { "PLC_WRITES_COALESCED",SPCO_PLC_WRITES_COALESCED}, /* Writes replaced by a newer value */
+  { "LIST_RTT_HIST",      SPCO_STATISTIC, STAT_LIST_RTT_HIST      }, /* Histogram of list's round trip times */
+  { "LIST_LATENESS_HIST", SPCO_STATISTIC, STAT_LIST_LATENESS_HIST }, /* Histogram of late list starts */
+  { "PLC_SCAN_TIME_HIST", SPCO_STATISTIC, STAT_PLC_SCAN_TIME_HIST }, /* Histograms for all lists of PLC */
+  { "PLC_RTT_HIST",       SPCO_STATISTIC, STAT_PLC_RTT_HIST       },
+  { "PLC_LATENESS_HIST",  SPCO_STATISTIC, STAT_PLC_LATENESS_HIST  },
+  { "LIST_PLAN_TIME",     SPCO_STATISTIC, STAT_LIST_PLAN_TIME     }, /* Total time per scan phase of list */
+  { "LIST_ENCODE_TIME",   SPCO_STATISTIC, STAT_LIST_ENCODE_TIME   },
+  { "LIST_SEND_TIME",     SPCO_STATISTIC, STAT_LIST_SEND_TIME     },
+  { "LIST_WAIT_TIME",     SPCO_STATISTIC, STAT_LIST_WAIT_TIME     },
+  { "LIST_DECODE_TIME",   SPCO_STATISTIC, STAT_LIST_DECODE_TIME   },
+  { "LIST_CALLBACK_TIME", SPCO_STATISTIC, STAT_LIST_CALLBACK_TIME },
+  { "PLC_LOCK_TIME",      SPCO_STATISTIC, STAT_PLC_LOCK_TIME      }, /* Total time scan task held PLC lock */
+  { "",                   0                       },
 };
 
 /* Device Private:
@@ -117,6 +166,7 @@ typedef struct
     size_t         element;     /* array element parsed from that: 0, 1,... */
     CN_UDINT       mask;        /* For binaries: first bit of interest */
     SpecialOptions special;
+    SpecialStatistic statistic; /* with SPCO_STATISTIC */
     PLC            *plc;
     TagInfo        *tag;
     IOSCANPVT      ioscanpvt;
@@ -135,8 +185,8 @@ static void dump_DevicePrivate(const dbCommon *rec)
     printf("   PLC_name   : '%s'\n",  pvt->PLC_name);
     printf("   string_tag : '%s', element %d\n",
            pvt->string_tag, (int)pvt->element);
-    printf("   mask       : 0x%08X    spec. opts.: %d\n",
-           pvt->mask, pvt->special);
+    printf("   mask       : 0x%08X    spec. opts.: %d, statistic %d\n",
+           pvt->mask, pvt->special, pvt->statistic);
     printf("   plc        : 0x%lX    tag        : 0x%lX\n",
            (unsigned long)pvt->plc, (unsigned long)pvt->tag);
 }
@@ -288,6 +338,42 @@ static eip_bool put_bits(dbCommon *rec, size_t bits, epicsUInt32 rval)
     return true;
 }
 
+/* After put_bits, request write of those bits.
+ * Bits within one element are sent via read-modify-write,
+ * leaving other bits in the PLC alone.
+ * Bits across elements and the 'plain BOOL' case
+ * fall back to writing the tag.
+ */
+static void request_bits_write(dbCommon *rec, size_t bits, epicsUInt32 rval)
+{
+    DevicePrivate  *pvt = (DevicePrivate *)rec->dpvt;
+    size_t         i;
+    CN_UDINT       mask = pvt->mask, set_bits = 0, clear_bits = 0;
+
+    if (pvt->mask == 255)
+    {
+        drvEtherIP_request_element_write(pvt->plc, pvt->tag, pvt->element, 1);
+        return;
+    }
+    for (i=0; i<bits; ++i)
+    {
+        if (mask == 0) /* end of current UDINT ? */
+        {   /* Write all UDINTs that put_bits touched */
+            drvEtherIP_request_element_write(pvt->plc, pvt->tag, pvt->element,
+                                             1 + (bits - i + 31)/32);
+            return;
+        }
+        if (rval & 1)
+            set_bits |= mask;
+        else
+            clear_bits |= mask;
+        rval >>= 1;
+        mask <<= 1;
+    }
+    drvEtherIP_request_bit_write(pvt->plc, pvt->tag, pvt->element,
+                                 set_bits, clear_bits);
+}
+
 /* Callback, registered with drvEtherIP, for input records.
  * Used _IF_ scan="I/O Event":
  * Driver has new value (or no value because of error), process record
@@ -962,6 +1048,7 @@ static long analyze_link(dbCommon *rec,
 
     /* Check for more flags */
     pvt->special = 0;  /* Init special options */
+    pvt->statistic = STAT_NONE;
     while ((p = find_token(end, &end)))
     {
         for (i=0;
@@ -973,7 +1060,9 @@ static long analyze_link(dbCommon *rec,
                         strlen(special_options[i].text) ) == 0)
             {
                 pvt->special |= special_options[i].mask;
-                if (special_options[i].mask==SPCO_READ_SINGLE_ELEMENT)
+                if (special_options[i].mask==SPCO_STATISTIC)
+                    pvt->statistic = special_options[i].statistic;
+                else if (special_options[i].mask==SPCO_READ_SINGLE_ELEMENT)
                 {
                     if (count != 1)
                     {
@@ -1111,6 +1200,9 @@ static long analyze_link(dbCommon *rec,
         pvt->mask = 1U << bit;
     }
 
+    /* Histogram waveforms use the tag only to pick the scanlist */
+    if (STAT_IS_HISTOGRAM(pvt->statistic))
+        count = 1;
     /* tell driver to read up to this record's elements */
     pvt->tag = drvEtherIP_add_tag(pvt->plc, period,
                                   pvt->string_tag,
@@ -1684,6 +1776,24 @@ static long ai_read(aiRecord *rec)
                 rec->val = pvt->tag->scanlist->max_scan_time;
             else if (pvt->special & SPCO_TAG_TRANSFER_TIME)
                 rec->val = pvt->tag->transfer_time;
+            else if (pvt->special & SPCO_PLC_WRITES_SENT)
+                rec->val = (double) pvt->plc->writes_sent;
+            else if (pvt->special & SPCO_PLC_WRITES_COALESCED)
+                rec->val = (double) pvt->plc->writes_coalesced;
+            else if (pvt->statistic == STAT_LIST_PLAN_TIME)
+                rec->val = pvt->tag->scanlist->phases.plan;
+            else if (pvt->statistic == STAT_LIST_ENCODE_TIME)
+                rec->val = pvt->tag->scanlist->phases.encode;
+            else if (pvt->statistic == STAT_LIST_SEND_TIME)
+                rec->val = pvt->tag->scanlist->phases.send;
+            else if (pvt->statistic == STAT_LIST_WAIT_TIME)
+                rec->val = pvt->tag->scanlist->phases.wait;
+            else if (pvt->statistic == STAT_LIST_DECODE_TIME)
+                rec->val = pvt->tag->scanlist->phases.decode;
+            else if (pvt->statistic == STAT_LIST_CALLBACK_TIME)
+                rec->val = pvt->tag->scanlist->phases.callbacks;
+            else if (pvt->statistic == STAT_PLC_LOCK_TIME)
+                rec->val = pvt->plc->lock_time;
             else
                 ok = false;
         }
@@ -1835,31 +1945,66 @@ static long si_read(stringinRecord *rec)
     return 0;
 }
 
+/* Copy histogram selected by statistic into waveform.
+ * Called with data_lock.
+ */
+static eip_bool wf_read_histogram(waveformRecord *rec)
+{
+    DevicePrivate   *pvt = (DevicePrivate *)rec->dpvt;
+    const ScanList  *list = pvt->tag->scanlist;
+    const Histogram *hist;
+    size_t          i, bins;
+
+    switch (pvt->statistic)
+    {
+    case STAT_LIST_SCAN_TIME_HIST: hist = &list->scan_time_hist;     break;
+    case STAT_LIST_RTT_HIST:       hist = &list->rtt_hist;           break;
+    case STAT_LIST_LATENESS_HIST:  hist = &list->late_hist;          break;
+    case STAT_PLC_SCAN_TIME_HIST:  hist = &pvt->plc->scan_time_hist; break;
+    case STAT_PLC_RTT_HIST:        hist = &pvt->plc->rtt_hist;       break;
+    default:                       hist = &pvt->plc->late_hist;
+    }
+    bins = rec->nelm < EIP_HISTOGRAM_BINS ? rec->nelm : EIP_HISTOGRAM_BINS;
+    if (rec->ftvl == menuFtypeDOUBLE)
+        for (i=0; i<bins; ++i)
+            ((double *)rec->bptr)[i] = (double) hist->count[i];
+    else if (rec->ftvl == menuFtypeLONG)
+        for (i=0; i<bins; ++i)
+            ((CN_DINT *)rec->bptr)[i] = (CN_DINT) hist->count[i];
+    else
+    {
+        recGblRecordError(S_db_badField, (void *)rec,
+                          "EtherIP: histogram requires "
+                          "waveform FTVL==DOUBLE or LONG");
+        return false;
+    }
+    rec->nord = bins;
+    return true;
+}
+
 static long wf_read(waveformRecord *rec)
 {
     DevicePrivate *pvt = (DevicePrivate *)rec->dpvt;
     eip_bool ok;
-    CN_DINT *dint;
     CN_DINT dint_val;
     char    *s;
-    double  *dbl;
-    char    *c;
     size_t i;
 
     if (rec->tpro)
         dump_DevicePrivate((dbCommon *)rec);
     if ((ok = lock_data((dbCommon *)rec)))
     {
-        if (pvt->tag->valid_data_size > 0 &&  pvt->tag->elements >= rec->nelm)
+        if (STAT_IS_HISTOGRAM(pvt->statistic))
+            ok = wf_read_histogram(rec);
+        else if (pvt->tag->valid_data_size > 0 &&  pvt->tag->elements >= rec->nelm)
         {
             if (get_CIP_typecode(pvt->tag->data) == T_CIP_REAL  ||
                 get_CIP_typecode(pvt->tag->data) == T_CIP_LREAL)
             {
                 if (rec->ftvl == menuFtypeDOUBLE)
                 {
-                    dbl = (double *)rec->bptr;
-                    for (i=0; ok && i<rec->nelm; ++i, ++dbl)
-                        ok = get_CIP_double(pvt->tag->data, i, dbl);
+                    ok = get_CIP_double_array(pvt->tag->data, 0, rec->nelm,
+                                              (double *)rec->bptr);
                     if (ok)
                         rec->nord = rec->nelm;
                 }
@@ -1875,9 +2020,8 @@ static long wf_read(waveformRecord *rec)
             {
                 if (rec->ftvl == menuFtypeCHAR || rec->ftvl == menuFtypeUCHAR)
                 {
-                    c = (char *)rec->bptr;
-                    for (i=0; ok && i<rec->nelm; ++i, ++c)
-                        ok = get_CIP_USINT(pvt->tag->data, i, (CN_USINT*)c);
+                    ok = get_CIP_USINT_array(pvt->tag->data, 0, rec->nelm,
+                                             (CN_USINT *)rec->bptr);
                     if (ok)
                         rec->nord = rec->nelm;
                 }
@@ -1893,9 +2037,8 @@ static long wf_read(waveformRecord *rec)
             {   /* CIP data is something other than REAL and SINT */
                 if (rec->ftvl == menuFtypeLONG)
                 {
-                    dint = (CN_DINT *)rec->bptr;
-                    for (i=0; ok && i<rec->nelm; ++i, ++dint)
-                        ok = get_CIP_DINT(pvt->tag->data, i, dint);
+                    ok = get_CIP_DINT_array(pvt->tag->data, 0, rec->nelm,
+                                            (CN_DINT *)rec->bptr);
                     if (ok)
                         rec->nord = rec->nelm;
                 }
@@ -1960,10 +2103,8 @@ static long ao_write(aoRecord *rec)
                 if (rec->tpro)
                     printf("'%s': write %g!\n", rec->name, rec->val);
                 ok = put_CIP_double(pvt->tag->data, pvt->element, rec->val);
-                if (pvt->tag->do_write)
-                    EIP_printf(6,"'%s': already writing\n", rec->name);
-                else
-                    pvt->tag->do_write = true;
+                drvEtherIP_request_element_write(pvt->plc, pvt->tag,
+                                                 pvt->element, 1);
                 rec->pact=TRUE;
             }
         }
@@ -1976,10 +2117,8 @@ static long ao_write(aoRecord *rec)
                     printf("'%s': write %ld (0x%lX)!\n",
                            rec->name, (long)rec->rval, (long)rec->rval);
                 ok = put_CIP_DINT(pvt->tag->data, pvt->element, rec->rval);
-                if (pvt->tag->do_write)
-                    EIP_printf(6,"'%s': already writing\n", rec->name);
-                else
-                    pvt->tag->do_write = true;
+                drvEtherIP_request_element_write(pvt->plc, pvt->tag,
+                                                 pvt->element, 1);
                 rec->pact=TRUE;
             }
         }
@@ -2018,10 +2157,8 @@ static long int64out_write(int64outRecord *rec)
             if (rec->tpro)
                 printf("'%s': write %lld!\n", rec->name, rec->val);
             ok = put_CIP_LINT(pvt->tag->data, pvt->element, rec->val);
-            if (pvt->tag->do_write)
-                EIP_printf(6,"'%s': already writing\n", rec->name);
-            else
-                pvt->tag->do_write = true;
+            drvEtherIP_request_element_write(pvt->plc, pvt->tag,
+                                             pvt->element, 1);
             rec->pact=TRUE;
         }
         epicsMutexUnlock(pvt->tag->data_lock);
@@ -2060,10 +2197,7 @@ static long bo_write(boRecord *rec)
                 if (rec->tpro)
                     printf("'%s': write %u\n", rec->name, (unsigned int) rec->rval);
                 ok = put_bits((dbCommon *)rec, 1, rec->rval);
-                if (pvt->tag->do_write)
-                    EIP_printf(6,"'%s': already writing\n", rec->name);
-                else
-                    pvt->tag->do_write = true;
+                request_bits_write((dbCommon *)rec, 1, rec->rval);
                 rec->pact=TRUE;
             }
         }
@@ -2114,10 +2248,7 @@ static long lso_write(lsoRecord *rec)
             if (rec->tpro)
                 printf("'%s': write %s!\n", rec->name, rec->val);
             ok = put_CIP_STRING(pvt->tag->data, rec->val, pvt->tag->data_size);
-            if (pvt->tag->do_write)
-                EIP_printf(6,"'%s': already writing\n", rec->name);
-            else
-                pvt->tag->do_write = true;
+            drvEtherIP_request_write(pvt->plc, pvt->tag);
             rec->pact=TRUE;
         }
         dbmfFree(data);
@@ -2155,10 +2286,7 @@ static long mbbo_write (mbboRecord *rec)
             if (rec->tpro)
                 printf("'%s': write %u\n", rec->name, (unsigned int) rec->rval);
             ok = put_bits((dbCommon *)rec, rec->nobt, rec->rval);
-            if (pvt->tag->do_write)
-                EIP_printf(6,"'%s': already writing\n", rec->name);
-            else
-                pvt->tag->do_write = true;
+            request_bits_write((dbCommon *)rec, rec->nobt, rec->rval);
             rec->pact=TRUE;
         }
         epicsMutexUnlock(pvt->tag->data_lock);
@@ -2194,10 +2322,7 @@ static long mbbo_direct_write (mbboDirectRecord *rec)
             if (rec->tpro)
                 printf("'%s': write %u\n", rec->name, (unsigned int) rec->rval);
             ok = put_bits((dbCommon *)rec, rec->nobt, rec->rval);
-            if (pvt->tag->do_write)
-                EIP_printf(6,"'%s': already writing\n", rec->name);
-            else
-                pvt->tag->do_write = true;
+            request_bits_write((dbCommon *)rec, rec->nobt, rec->rval);
             rec->pact=TRUE;
         }
         epicsMutexUnlock(pvt->tag->data_lock);
@@ -2241,10 +2366,7 @@ static long so_write(stringoutRecord *rec)
             if (rec->tpro)
                 printf("'%s': write %s!\n", rec->name, rec->val);
             ok = put_CIP_STRING(pvt->tag->data, rec->val, pvt->tag->data_size);
-            if (pvt->tag->do_write)
-                EIP_printf(6,"'%s': already writing\n", rec->name);
-            else
-                pvt->tag->do_write = true;
+            drvEtherIP_request_write(pvt->plc, pvt->tag);
             rec->pact=TRUE;
         }
         epicsMutexUnlock(pvt->tag->data_lock);
@@ -10,10 +10,17 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <limits.h>
+#include <math.h>
 /* Base */
 #include <drvSup.h>
 #include <errlog.h>
+#include <epicsVersion.h>
+#if defined(VERSION_INT)  &&  EPICS_VERSION_INT >= VERSION_INT(3,15,0,1)
+#include <epicsAtomic.h>
+#define EIP_TRACE_ATOMIC
+#endif
 /* Local */
 #include "drvEtherIP.h"
 /* Base */
@@ -25,6 +32,10 @@ static int databaseIsReady = false;
 
 int EIP_TIMEOUT = 5000;
 
+int EIP_TIMEOUT_FLOOR = 1000;
+
+int EIP_WRITE_HOLDOFF = 0;
+
 double drvEtherIP_default_rate = 0.0;
 
 DrvEtherIP_Private drvEtherIP_private = { {NULL, NULL}, 0 };
@@ -38,31 +49,50 @@ DrvEtherIP_Private drvEtherIP_private = { {NULL, NULL}, 0 };
  * b) Data:       driver and device read/write tag's data
  *                and change the update flag
  *
- * The following 3 locks are used between threads.
+ * The following locks are used between threads.
  * To avoid deadlocks, they have to be taken in the listed order
  * by any code that uses more than one of the locks.
  *
  * 1) drvEtherIP_private.lock is for PLCs
  *    Everything that accesses >1 PLC takes this lock.
  *
- * 2) PLC.lock is per-PLC
+ * 2) Session.lock is per session of a PLC
+ *    and guards the session's connection.
+ *    The session's PLC_scan_task holds it for each run
+ *    down the session's scanlists.
+ *    PLCs in several slots behind one IP address share
+ *    the sessions of the first PLC defined for that address.
+ *    Disconnecting a session only holds the Session.lock,
+ *    taking the PLC.lock of each PLC that shares it in turn.
+ *    Connecting releases the Session.lock while talking to the PLC,
+ *    so that shell commands and restarts don't wait for an unreachable
+ *    PLC. Meanwhile the session is SESSION_CONNECTING, and only its
+ *    scan task may use the connection.
+ *
+ * 3) PLC.lock is per-PLC
  *    All structural changes to a PLC take this lock
  *    Currently PLCs are added, never removed,
  *    so the global lock is not affected by this.
  *    PLC.lock is for all data structures for this PLC:
- *    scanlists, tags, callbacks.
+ *    scanlists, tags, callbacks, statistics.
  *
- *    PLC_scan_task needs access to connection & scanlists,
+ *    PLC_scan_task needs access to scanlists,
  *    so it takes lock for each run down the scanlist.
+ *    While waiting for the response to a MultiRequest,
+ *    it releases the lock so that the scan tasks of other sessions
+ *    can proceed. Scanlists and tags are never deleted,
+ *    and a scanlist is only scanned by its own session,
+ *    so the tags of the pending MultiRequest remain valid.
+ *    The scan task never holds more than one PLC.lock.
  *
- * 3) TagInfo.data_lock is the Data lock.
+ * 4) TagInfo.data_lock is the Data lock.
  *    The scan task runs over the Tags in a scanlist three times:
  *    a) see how much can be handled in one network transfer,
  *       determine size of request/response
  *    b) setup the requests
  *    c) handle the response
  *
- *    The list of tags cannot change because of the PLC.lock.
+ *    The tags of a transfer are fixed in a).
  *    But the device might want to switch from read to write.
  *    In the protocol, the "CIP Read Data" and "CIP Write Data"
  *    request/response are different in length.
@@ -84,6 +114,46 @@ DrvEtherIP_Private drvEtherIP_private = { {NULL, NULL}, 0 };
  *    0           1       -> Driver noticed the write request,
  *    0           1       -> sends it
  *    0           0       -> Driver received write result from PLC
+ *
+ * 5) PLC.write_lock protects the write_queue of the PLC's sessions
+ *    and the write_queued/next_write members of its TagInfos.
+ *    A tag is queued on the session of its scanlist.
+ *    Device support can't take the PLC.lock to read that session,
+ *    and the scanlist may move to another session meanwhile,
+ *    so the scan task checks it again under the PLC.lock
+ *    and re-queues tags that another session now scans.
+ *    PLCs that share sessions also share the write_lock,
+ *    which also guards their shared RateLimit.
+ *    Device support sets do_write via drvEtherIP_request_write
+ *    while holding the data_lock, so write_lock is taken last
+ *    and never held while taking any other lock.
+ *
+ *    The scan task detaches the whole queue, sends the writes
+ *    in their own MultiRequest(s) and only then clears write_queued.
+ *    Since device support updates the tag's data in place,
+ *    setting do_write again before the driver picked up the
+ *    previous request simply replaces the value to write.
+ *    Those coalesced writes are counted under the write_lock.
+ *    A tag that device support wants to write again while
+ *    it is still on the detached queue remains flagged as do_write
+ *    and is re-queued once the current write completes.
+ *
+ *    do_rmw/is_rmw follow the same pattern as do_write/is_writing
+ *    for read-modify-write requests that only change some bits.
+ *    The OR/AND masks are copied into the request under the data_lock
+ *    and then reset, so bits changed while the request is on its way
+ *    are collected for the next one.
+ *    A copy of the sent masks is kept until the reply arrives.
+ *    Without a reply, is_rmw remains set and the copy is merged
+ *    back in front of the collected bits, see retry_ReadModifyWrite.
+ *    A pending full write includes all bits and replaces do_rmw.
+ *
+ *    Device support marks the elements it changed in dirty_first/last.
+ *    When the driver picks up do_write, it moves that range
+ *    into write_first/count, so only changed elements of an array
+ *    are written. Overlapping or separate ranges are merged into
+ *    one covering range since each tag is one request in
+ *    the MultiRequest.
  */
 
 /* ------------------------------------------------------------
@@ -116,6 +186,17 @@ static void dump_TagInfo(const TagInfo *info, int level)
             printf("  do_write/is_writing : %s / %s\n",
                    (info->do_write ? "yes" : "no"),
                    (info->is_writing ? "yes" : "no"));
+            if (info->is_writing)
+                printf("  writing elements    : %u..%u\n",
+                       (unsigned)info->write_first,
+                       (unsigned)(info->write_first + info->write_count - 1));
+            printf("  do_rmw/is_rmw       : %s / %s%s\n",
+                   (info->do_rmw ? "yes" : "no"),
+                   (info->is_rmw ? "yes" : "no"),
+                   (info->no_rmw ? " (not supported)" : ""));
+            if (info->read_errors > 0)
+                printf("  failed reads        : %u, skipped for %g secs\n",
+                       (unsigned)info->read_errors, info->quarantine_delay);
             EIP_printf(0, "  data                : ");
         }
         if (info->valid_data_size > 0)
@@ -130,12 +211,69 @@ static void dump_TagInfo(const TagInfo *info, int level)
         printf("  transfer time       : %g secs\n", info->transfer_time);
 }
 
-static TagInfo *new_TagInfo(const char *string_tag, size_t elements)
+/* ------------------------------------------------------------
+ * Arena
+ * ------------------------------------------------------------ */
+
+#define ARENA_CHUNK_SIZE 16384
+
+struct __ArenaChunk
+{
+    ArenaChunk *prev;
+    size_t     size;        /* usable bytes in data */
+    double     data[1];     /* start of memory, aligned for any type */
+};
+
+/* Get zeroed memory from arena.
+ * Without arena, this is simply calloc.
+ */
+static void *arena_alloc(Arena *arena, size_t size)
+{
+    ArenaChunk *chunk;
+    size_t     chunk_size;
+    void       *mem;
+
+    if (! arena)
+        return calloc(1, size);
+    /* Keep following allocations aligned */
+    size = (size + sizeof(double) - 1) & ~(sizeof(double) - 1);
+    if (! arena->chunk  ||  arena->used + size > arena->chunk->size)
+    {
+        chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = (ArenaChunk *) calloc(1, offsetof(ArenaChunk, data)
+                                         + chunk_size);
+        if (! chunk)
+            return 0;
+        chunk->prev = arena->chunk;
+        chunk->size = chunk_size;
+        arena->chunk = chunk;
+        arena->used = 0;
+        arena->size += chunk_size;
+    }
+    mem = (char *)arena->chunk->data + arena->used;
+    arena->used += size;
+    return mem;
+}
+
+static char *arena_strdup(Arena *arena, const char *text)
 {
-    TagInfo *info = (TagInfo *) calloc(sizeof(TagInfo), 1);
+    char *copy;
+
+    if (! arena)
+        return EIP_strdup(text);
+    copy = (char *) arena_alloc(arena, strlen(text) + 1);
+    if (copy)
+        strcpy(copy, text);
+    return copy;
+}
+
+static TagInfo *new_TagInfo(Arena *arena,
+                            const char *string_tag, size_t elements)
+{
+    TagInfo *info = (TagInfo *) arena_alloc(arena, sizeof(TagInfo));
     if (!info)
     	return 0;
-    info->string_tag = EIP_strdup(string_tag);
+    info->string_tag = arena_strdup(arena, string_tag);
     if (! info->string_tag)
         return 0;
     info->tag = EIP_parse_tag(string_tag);
@@ -146,6 +284,8 @@ static TagInfo *new_TagInfo(const char *string_tag, size_t elements)
         return 0;
     }
     info->elements = elements;
+    info->rmw_and_mask = ~(CN_UDINT)0;
+    info->rmw_sent_and_mask = ~(CN_UDINT)0;
     info->data_lock = epicsMutexCreate();
     if (! info->data_lock)
     {
@@ -157,11 +297,15 @@ static TagInfo *new_TagInfo(const char *string_tag, size_t elements)
     return info;
 }
 
-/** Reserve buffer for TagInfo.data
+/** Reserve buffer for TagInfo.data.
+ *  Scalars use the inline_data of the TagInfo,
+ *  larger buffers come from the arena.
  *  @return true when OK
  */
-eip_bool reserve_tag_data(TagInfo *info, size_t requested_size)
+eip_bool reserve_tag_data(Arena *arena, TagInfo *info, size_t requested_size)
 {
+    CN_USINT *data;
+
 	if (info->data_size >= requested_size)
 		return true;
 	if (requested_size >= EIP_BUFFER_SIZE)
@@ -170,20 +314,31 @@ eip_bool reserve_tag_data(TagInfo *info, size_t requested_size)
                    info->string_tag, requested_size);
 		return false;
 	}
-	if (info->data_size != 0  &&  info->data != 0)
-	{
-        EIP_printf(2, "EIP reserve_tag_data: tag '%s' value buffer grows from %d to %d bytes\n",
-                   info->string_tag, info->data_size, requested_size);
-        free(info->data);
-	}
-	info->data = (CN_USINT *) calloc(1, requested_size);
-	if (! info->data)
+    if (requested_size <= sizeof(info->inline_data))
+    {
+        info->data = info->inline_data;
+        info->data_size = sizeof(info->inline_data);
+        return true;
+    }
+	data = (CN_USINT *) arena_alloc(arena, requested_size);
+	if (! data)
 	{
         EIP_printf(2, "EIP reserve_tag_data: tag '%s' failed to allocate buffer for %d bytes\n",
                    info->string_tag, requested_size);
 		return false;
 	}
+	if (info->data_size != 0  &&  info->data != 0)
+	{
+        EIP_printf(2, "EIP reserve_tag_data: tag '%s' value buffer grows from %d to %d bytes\n",
+                   info->string_tag, info->data_size, requested_size);
+        if (info->data_on_heap)
+            free(info->data);
+        else if (info->data != info->inline_data  &&  arena)
+            arena->replaced += info->data_size;
+	}
+	info->data = data;
 	info->data_size = requested_size;
+	info->data_on_heap = arena == 0;
 	return true;
 }
 
@@ -192,17 +347,215 @@ eip_bool reserve_tag_data(TagInfo *info, size_t requested_size)
 static void free_TagInfo(TagInfo *info)
 {
     EIP_free_ParsedTag(info->tag);
-    free(info->string_tag);
-    if (info->data_size > 0)
+    if (info->data_on_heap)
     {
         free(info->data);
         info->data_size = 0;
         info->data = 0;
     }
     epicsMutexDestroy(info->data_lock);
-    free (info);
+    /* string_tag and info itself are in the PLC's arena */
+}
+#endif
+
+/* ------------------------------------------------------------
+ * Statistics
+ * ------------------------------------------------------------ */
+
+void drvEtherIP_histogram_add(Histogram *hist, double seconds)
+{
+    int bin;
+
+    /* seconds/MIN = mantissa * 2^bin, mantissa 0.5 .. 1 */
+    frexp(seconds / EIP_HISTOGRAM_MIN, &bin);
+    if (bin < 0)
+        bin = 0;
+    else if (bin >= EIP_HISTOGRAM_BINS)
+        bin = EIP_HISTOGRAM_BINS - 1;
+    ++hist->count[bin];
+}
+
+double drvEtherIP_histogram_percentile(const Histogram *hist,
+                                       double fraction)
+{
+    size_t i, total = 0, sum = 0;
+
+    for (i=0; i<EIP_HISTOGRAM_BINS; ++i)
+        total += hist->count[i];
+    if (total <= 0)
+        return 0.0;
+    for (i=0; i<EIP_HISTOGRAM_BINS-1; ++i)
+    {
+        sum += hist->count[i];
+        if (sum >= fraction * total)
+            break;
+    }
+    return ldexp(EIP_HISTOGRAM_MIN, (int)i);
 }
+
+static void dump_Histogram(const char *label, const Histogram *hist)
+{
+    size_t i, total = 0;
+
+    for (i=0; i<EIP_HISTOGRAM_BINS; ++i)
+        total += hist->count[i];
+    printf("  %s: %lu, p50 %g, p90 %g, p99 %g secs\n",
+           label, (unsigned long) total,
+           drvEtherIP_histogram_percentile(hist, 0.50),
+           drvEtherIP_histogram_percentile(hist, 0.90),
+           drvEtherIP_histogram_percentile(hist, 0.99));
+}
+
+/* Seconds for timing the scan phases.
+ * Only differences matter, so use the monotonic clock where available.
+ */
+static double phase_clock()
+{
+#if defined(VERSION_INT)  &&  EPICS_VERSION_INT >= VERSION_INT(3,16,1,0)
+    return epicsMonotonicGet() * 1e-9;
+#else
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    return now.secPastEpoch + now.nsec * 1e-9;
 #endif
+}
+
+static void add_ScanPhases(ScanPhases *sum, const ScanPhases *add)
+{
+    sum->transfers += add->transfers;
+    sum->plan      += add->plan;
+    sum->encode    += add->encode;
+    sum->send      += add->send;
+    sum->wait      += add->wait;
+    sum->decode    += add->decode;
+    sum->callbacks += add->callbacks;
+}
+
+static void dump_ScanPhases(const char *label, const ScanPhases *phases)
+{
+    printf("  %s: %lu transfers, plan %g, encode %g, send %g, wait %g, "
+           "decode %g, callbacks %g secs\n",
+           label, (unsigned long) phases->transfers,
+           phases->plan, phases->encode, phases->send, phases->wait,
+           phases->decode, phases->callbacks);
+}
+
+/* ------------------------------------------------------------
+ * Trace
+ * ------------------------------------------------------------ */
+
+static const char *trace_type_name(TraceType type)
+{
+    switch (type)
+    {
+    case TRACE_SEND:       return "send";
+    case TRACE_RECEIVE:    return "receive";
+    case TRACE_TIMEOUT:    return "timeout";
+    case TRACE_ERROR:      return "error";
+    case TRACE_CONNECT:    return "connect";
+    case TRACE_DISCONNECT: return "disconnect";
+    }
+    return "?";
+}
+
+#ifndef EIP_TRACE_ATOMIC
+/* Before R3.15, there's no epicsAtomic,
+ * so the traces of all PLCs share this lock */
+static epicsMutexId trace_lock = 0;
+#endif
+
+/* Add event to trace. Called by the scan tasks of the PLC's sessions
+ * and by drvEtherIP_restart, each of which reserves its own slot.
+ * 'seq' of the event is cleared while it's updated,
+ * so a reader can tell when it copied a partial event.
+ */
+static void trace_event(Trace *trace, size_t session, TraceType type,
+                        size_t items, size_t size, const TransactionID *tid)
+{
+    size_t     seq;
+    TraceEvent *event;
+
+#ifdef EIP_TRACE_ATOMIC
+    seq = epicsAtomicIncrSizeT(&trace->head);
+    event = &trace->events[(seq-1) % EIP_TRACE_SIZE];
+    epicsAtomicSetSizeT(&event->seq, 0);
+    epicsAtomicWriteMemoryBarrier();
+#else
+    epicsMutexLock(trace_lock);
+    seq = ++trace->head;
+    event = &trace->events[(seq-1) % EIP_TRACE_SIZE];
+#endif
+    epicsTimeGetCurrent(&event->time);
+    event->type  = type;
+    event->session = session;
+    event->items = items;
+    event->size  = size;
+    if (tid)
+        event->tid = *tid;
+    else
+        memset(&event->tid, 0, sizeof(TransactionID));
+#ifdef EIP_TRACE_ATOMIC
+    epicsAtomicWriteMemoryBarrier();
+    epicsAtomicSetSizeT(&event->seq, seq);
+#else
+    event->seq = seq;
+    epicsMutexUnlock(trace_lock);
+#endif
+}
+
+/* Print the last 'count' events of the trace,
+ * with the session of each event when 'sessions'
+ */
+static void dump_Trace(const Trace *trace, size_t count, eip_bool sessions)
+{
+    TraceEvent event;
+    size_t     head, n;
+    char       tsString[50], tidText[TRANS_ID_LEN+1];
+
+#ifdef EIP_TRACE_ATOMIC
+    head = epicsAtomicGetSizeT(&trace->head);
+#else
+    epicsMutexLock(trace_lock);
+    head = trace->head;
+    epicsMutexUnlock(trace_lock);
+#endif
+    if (count > EIP_TRACE_SIZE)
+        count = EIP_TRACE_SIZE;
+    n = head > count ? head - count : 0;
+    for (/**/; n < head; ++n)
+    {
+#ifdef EIP_TRACE_ATOMIC
+        event = trace->events[n % EIP_TRACE_SIZE];
+        epicsAtomicReadMemoryBarrier();
+        if (event.seq != n+1  ||
+            epicsAtomicGetSizeT(&trace->events[n % EIP_TRACE_SIZE].seq) != n+1)
+#else
+        epicsMutexLock(trace_lock);
+        event = trace->events[n % EIP_TRACE_SIZE];
+        epicsMutexUnlock(trace_lock);
+        if (event.seq != n+1)
+#endif
+        {
+            printf("  %8lu - overwritten or in progress -\n",
+                   (unsigned long) (n+1));
+            continue;
+        }
+        epicsTimeToStrftime(tsString, sizeof(tsString),
+                            "%Y/%m/%d %H:%M:%S.%06f", &event.time);
+        transactionIdString(&event.tid, tidText, sizeof(tidText));
+        if (sessions)
+            printf("  %8lu %s session %2lu %-10s tid '%s', %3lu items, %4lu bytes\n",
+                   (unsigned long) event.seq, tsString,
+                   (unsigned long) event.session,
+                   trace_type_name(event.type), tidText,
+                   (unsigned long) event.items, (unsigned long) event.size);
+        else
+            printf("  %8lu %s %-10s tid '%s', %3lu items, %4lu bytes\n",
+                   (unsigned long) event.seq, tsString,
+                   trace_type_name(event.type), tidText,
+                   (unsigned long) event.items, (unsigned long) event.size);
+    }
+}
 
 /* ------------------------------------------------------------
  * ScanList
@@ -220,6 +573,7 @@ static void dump_ScanList(const ScanList *list, int level)
            list->period, (unsigned long)list);
     printf("  Status        : %s\n",
            (list->enabled ? "enabled" : "DISABLED"));
+    printf("  Session       : %u\n", (unsigned)list->session->index);
     epicsTimeToStrftime(tsString, sizeof(tsString),
                         "%Y/%m/%d %H:%M:%S.%04f", &list->scan_time);
     printf("  Last scan     : %s\n", tsString);
@@ -236,6 +590,10 @@ static void dump_ScanList(const ScanList *list, int level)
                list->max_scan_time);
         printf("  Last scan time: %g secs\n",
                list->last_scan_time);
+        dump_Histogram("Scan times    ", &list->scan_time_hist);
+        dump_Histogram("Round trips   ", &list->rtt_hist);
+        dump_Histogram("Late starts   ", &list->late_hist);
+        dump_ScanPhases("Phases        ", &list->phases);
     }
     if (level > 5)
     {
@@ -256,15 +614,106 @@ static void reset_ScanList(ScanList *scanlist)
     scanlist->min_scan_time  = 0.0;
     scanlist->max_scan_time  = 0.0;
     scanlist->last_scan_time = 0.0;
+    memset(&scanlist->scan_time_hist, 0, sizeof(Histogram));
+    memset(&scanlist->rtt_hist,       0, sizeof(Histogram));
+    memset(&scanlist->late_hist,      0, sizeof(Histogram));
+    memset(&scanlist->phases,         0, sizeof(ScanPhases));
+}
+
+/* Tags read per second, to balance the PLC's sessions */
+static double ScanList_load(const ScanList *list)
+{
+    const TagInfo *info;
+    size_t        count = 0;
+
+    for (info=DLL_first(TagInfo, &list->taginfos); info;
+         info=DLL_next(TagInfo, info))
+        ++count;
+    return list->period > 0.0 ? count / list->period : (double) count;
+}
+
+/* Add load of the PLC's scanlists to that of their sessions */
+static void add_Session_loads(const PLC *plc, double load[])
+{
+    const ScanList *list;
+
+    for (list=DLL_first(ScanList, &plc->scanlists); list;
+         list=DLL_next(ScanList, list))
+        if (list->session)
+            load[list->session->index] += ScanList_load(list);
+}
+
+/* Session of the PLC with the least load */
+static Session *least_loaded_Session(PLC *plc, const double load[])
+{
+    size_t i, least = 0;
+
+    for (i=1; i<plc->session_count; ++i)
+        if (load[i] < load[least])
+            least = i;
+    return &plc->sessions[least];
 }
 
+/* Distribute the scanlists of the PLC and of those that
+ * share its sessions across the sessions:
+ * Scanlists with the highest load go first, each to the session
+ * with the least load so far, so that a large list does not
+ * share its session with the faster lists.
+ * Only called while the PLC's scan tasks are not running.
+ */
+static void assign_ScanList_Sessions(PLC *plc)
+{
+    PLC      *shared;
+    ScanList *list, *next;
+    double   load, max_load, session_load[EIP_MAX_SESSIONS];
+
+    for (shared = plc;  shared;  shared = shared->next_shared)
+        for (list=DLL_first(ScanList, &shared->scanlists); list;
+             list=DLL_next(ScanList, list))
+            list->session = 0;
+    while (true)
+    {
+        next = 0;
+        max_load = 0.0;
+        memset(session_load, 0, sizeof(session_load));
+        for (shared = plc;  shared;  shared = shared->next_shared)
+        {
+            add_Session_loads(shared, session_load);
+            for (list=DLL_first(ScanList, &shared->scanlists); list;
+                 list=DLL_next(ScanList, list))
+            {
+                if (list->session)
+                    continue;
+                load = ScanList_load(list);
+                if (!next  ||  load > max_load)
+                {
+                    next = list;
+                    max_load = load;
+                }
+            }
+        }
+        if (!next)
+            break;
+        next->session = least_loaded_Session(plc, session_load);
+    }
+}
+
+/* New scanlist goes to the session with the least load
+ * from the PLC's scanlists.
+ * Caller holds PLC.lock, so the load that other PLCs
+ * sharing the session add is not considered.
+ */
 static ScanList *new_ScanList(PLC *plc, double period)
 {
+    double   load[EIP_MAX_SESSIONS];
     ScanList *list = (ScanList *) calloc(sizeof(ScanList), 1);
     if (!list)
         return 0;
     DLL_init(&list->taginfos);
     list->plc = plc;
+    memset(load, 0, sizeof(load));
+    add_Session_loads(plc, load);
+    list->session = least_loaded_Session(plc, load);
     list->period = period;
     reset_ScanList (list);
     return list;
@@ -277,6 +726,9 @@ static void free_ScanList(ScanList *scanlist)
     TagInfo *info;
     while ((info = DLL_decap(&scanlist->taginfos)) != 0)
         free_TagInfo(info);
+    free(scanlist->view.tags);
+    free(scanlist->view.r_request_size);
+    free(scanlist->view.r_response_size);
     free(scanlist);
 }
 #endif
@@ -300,12 +752,14 @@ static void remove_ScanList_TagInfo(ScanList *scanlist, TagInfo *info)
 {
     info->scanlist = 0;
     DLL_unlink(&scanlist->taginfos, info);
+    scanlist->view.valid = false;
 }
 
 static void add_ScanList_TagInfo(ScanList *scanlist, TagInfo *info)
 {
     DLL_append(&scanlist->taginfos, info);
     info->scanlist = scanlist;
+    scanlist->view.valid = false;
 }
 
 /* Add new tag to taglist, compile tag
@@ -314,7 +768,7 @@ static TagInfo *add_ScanList_Tag(ScanList *scanlist,
                                  const char *string_tag,
                                  size_t elements)
 {
-    TagInfo *info = new_TagInfo(string_tag, elements);
+    TagInfo *info = new_TagInfo(&scanlist->plc->arena, string_tag, elements);
     if (info)
         add_ScanList_TagInfo(scanlist, info);
     return info;
@@ -324,9 +778,15 @@ static TagInfo *add_ScanList_Tag(ScanList *scanlist,
  * PLC
  * ------------------------------------------------------------ */
 
-static PLC *new_PLC(const char *name)
+/* Create PLC with session_count new sessions,
+ * or one that shares the sessions of 'owner'
+ */
+static PLC *new_PLC(const char *name, size_t session_count, PLC *owner)
 {
-    PLC *plc = (PLC *) calloc(1, sizeof(PLC));
+    Session *session;
+    size_t  i;
+    epicsTimeStamp now;
+    PLC     *plc = (PLC *) calloc(1, sizeof(PLC));
     if (! plc)
     	return 0;
     plc->name = EIP_strdup(name);
@@ -339,24 +799,83 @@ static PLC *new_PLC(const char *name)
         EIP_printf (0, "new_PLC (%s): Cannot create mutex\n", name);
         return 0;
     }
-    plc->connection = EIP_init();
-    if (! plc->connection)
+    if (owner)
+    {
+        plc->write_lock = owner->write_lock;
+        plc->rate = owner->rate;
+        plc->sessions = owner->sessions;
+        plc->session_count = owner->session_count;
+        while (owner->next_shared)
+            owner = owner->next_shared;
+        owner->next_shared = plc;
+        return plc;
+    }
+    plc->write_lock = epicsMutexCreate();
+    if (! plc->write_lock)
     {
-        EIP_printf (0, "new_PLC (%s): EIP_init failed\n", name);
+        EIP_printf (0, "new_PLC (%s): Cannot create write queue\n", name);
         return 0;
     }
+    plc->rate = (RateLimit *) calloc(1, sizeof(RateLimit));
+    if (! plc->rate)
+    {
+        EIP_printf (0, "new_PLC (%s): Cannot allocate rate limit\n", name);
+        return 0;
+    }
+    plc->rate->factor = 1.0;
+    plc->sessions = (Session *) calloc(session_count, sizeof(Session));
+    if (! plc->sessions)
+    {
+        EIP_printf (0, "new_PLC (%s): Cannot allocate sessions\n", name);
+        return 0;
+    }
+    plc->session_count = session_count;
+    for (i=0; i<session_count; ++i)
+    {
+        session = &plc->sessions[i];
+        session->plc = plc;
+        session->index = i;
+        session->lock = epicsMutexCreate();
+        session->write_event = epicsEventCreate(epicsEventEmpty);
+        if (! (session->lock && session->write_event))
+        {
+            EIP_printf (0, "new_PLC (%s): Cannot create session\n", name);
+            return 0;
+        }
+        session->connection = EIP_init();
+        if (! session->connection)
+        {
+            EIP_printf (0, "new_PLC (%s): EIP_init failed\n", name);
+            return 0;
+        }
+        /* Seed differs between IOCs that start at about the same time */
+        epicsTimeGetCurrent(&now);
+        session->random = (now.nsec ^ now.secPastEpoch) * 2654435761u + i;
+        if (session->random == 0)
+            session->random = 1;
+    }
     return plc;
 }
 
 #if 0
 /* We never really remove a PLC from the list,
- * but this is how it could be done. Maybe. */
+ * but this is how it could be done. Maybe.
+ * (Not for PLCs that share sessions) */
 static void free_PLC(PLC *plc)
 {
     ScanList *list;
+    size_t   i;
 
     epicsMutexDestroy(plc->lock);
-    EIP_dispose(plc->connection);
+    epicsMutexDestroy(plc->write_lock);
+    free(plc->rate);
+    for (i=0; i<plc->session_count; ++i)
+    {
+        epicsMutexDestroy(plc->sessions[i].lock);
+        epicsEventDestroy(plc->sessions[i].write_event);
+        EIP_dispose(plc->sessions[i].connection);
+    }
+    free(plc->sessions);
     free(plc->name);
     free(plc->ip_addr);
     while ((list = DLL_decap(&plc->scanlists)) != 0)
@@ -365,88 +884,166 @@ static void free_PLC(PLC *plc)
 }
 #endif
 
+/* Route requests via the session to the PLC's slot,
+ * caller holds session->lock
+ */
+static EIPConnection *route_Session(Session *session, const PLC *plc)
+{
+    EIP_route_slot(session->connection, plc->slot);
+    return session->connection;
+}
+
 /* After TagInfos are defined (tag & elements are set),
- * fill rest of TagInfo: request/response size.
+ * fill rest of TagInfo of the PLC's scanlists for the session:
+ * request/response size.
+ * Counts the tags that were 'tried' and those that 'succeeded'.
  *
- * Returns OK if any TagInfo in the scanlists could be filled,
- * so we believe that scanning this PLC makes some sense.
+ * The tags are collected under the PLC.lock, but read without it,
+ * so adding tags or reports don't wait for the network.
+ * Tags are never deleted, so they remain valid.
  */
-static eip_bool complete_PLC_ScanList_TagInfos(PLC *plc)
+static void complete_PLC_ScanList_TagInfos(Session *session, PLC *plc,
+                                           size_t *tried, size_t *succeeded)
 {
     ScanList       *list;
-    TagInfo        *info;
+    TagInfo        *info, **tags;
+    EIPConnection  *c;
     const CN_USINT *data;
-    size_t         tried = 0, succeeded = 0;
-    size_t         type_and_data_len;
-
-    EIP_printf(5, "complete_PLC_ScanList_TagInfos PLC '%s':\n", plc->name);
+    size_t         i, count = 0;
 
+    EIP_printf(5, "complete_PLC_ScanList_TagInfos PLC '%s' session %u:\n",
+               plc->name, (unsigned)session->index);
+    epicsMutexLock(plc->lock);
     for (list=DLL_first(ScanList, &plc->scanlists);  list;
          list=DLL_next(ScanList, list))
     {
-        EIP_printf(5, "- Scanlist %.2f\n", list->period);
+        if (list->session != session)
+            continue;
         for (info=DLL_first(TagInfo, &list->taginfos);  info;
              info=DLL_next(TagInfo, info))
+            ++count;
+    }
+    tags = (TagInfo **) calloc(count > 0 ? count : 1, sizeof(TagInfo *));
+    if (! tags)
+    {
+        epicsMutexUnlock(plc->lock);
+        EIP_printf(1, "EIP complete_PLC_ScanList_TagInfos: no memory\n");
+        *tried += count;
+        return;
+    }
+    count = 0;
+    for (list=DLL_first(ScanList, &plc->scanlists);  list;
+         list=DLL_next(ScanList, list))
+    {
+        if (list->session != session)
+            continue;
+        for (info=DLL_first(TagInfo, &list->taginfos);  info;
+             info=DLL_next(TagInfo, info))
+            tags[count++] = info;
+    }
+    epicsMutexUnlock(plc->lock);
+
+    c = route_Session(session, plc);
+    for (i=0; i<count; ++i)
+    {
+        info = tags[i];
+        if (epicsMutexLock(info->data_lock) != epicsMutexLockOK)
         {
-            if (epicsMutexLock(info->data_lock) != epicsMutexLockOK)
-            {
-                EIP_printf(1, "EIP complete_PLC_ScanList_TagInfos cannot lock %s\n",
-                           info->string_tag);
-                continue;
-            }
-            /* Need to get the read sizes */
-            ++tried;
-            data = EIP_read_tag(plc->connection,
-                                info->tag, info->elements,
-                                NULL /* data_size */,
-                                &info->cip_r_request_size,
-                                &info->cip_r_response_size);
-            if (data)
+            EIP_printf(1, "EIP complete_PLC_ScanList_TagInfos cannot lock %s\n",
+                       info->string_tag);
+            tags[i] = 0;
+            continue;
+        }
+        /* Need to get the read sizes */
+        ++*tried;
+        data = EIP_read_tag(c,
+                            info->tag, info->elements,
+                            NULL /* data_size */,
+                            &info->cip_r_request_size,
+                            &info->cip_r_response_size);
+        if (data)
+        {
+            EIP_printf(5, "  tag '%s': req %d, resp %d bytes\n",
+                       info->string_tag, info->cip_r_request_size, info->cip_r_response_size);
+            ++*succeeded;
+            /* Estimate write sizes from the request/response for read
+             * because we don't want to issue a 'write' just for the
+             * heck of it.
+             * Nevertheless, the write sizes calculated in here
+             * should be exact since we can determine the write
+             * request package from the read request
+             * (CIP service code, tag name, elements)
+             * plus the raw data size.
+             */
+            if (info->cip_r_response_size <= 4)
             {
-                EIP_printf(5, "  tag '%s': req %d, resp %d bytes\n",
-                           info->string_tag, info->cip_r_request_size, info->cip_r_response_size);
-                ++succeeded;
-                /* Estimate write sizes from the request/response for read
-                 * because we don't want to issue a 'write' just for the
-                 * heck of it.
-                 * Nevertheless, the write sizes calculated in here
-                 * should be exact since we can determine the write
-                 * request package from the read request
-                 * (CIP service code, tag name, elements)
-                 * plus the raw data size.
-                 */
-                if (info->cip_r_response_size <= 4)
-                {
-                    info->cip_w_request_size  = 0;
-                    info->cip_w_response_size = 0;
-                }
-                else
-                {
-                    type_and_data_len = info->cip_r_response_size - 4;
-                    info->cip_w_request_size  = info->cip_r_request_size
-                        + type_and_data_len;
-                    info->cip_w_response_size = 4;
-                }
+                info->cip_w_request_size  = 0;
+                info->cip_w_response_size = 0;
             }
             else
             {
-                EIP_printf(3, "tag '%s': Cannot read!\n", info->string_tag);
-                info->cip_r_request_size  = 0;
-                info->cip_r_response_size = 0;
-                info->cip_w_request_size  = 0;
-                info->cip_w_response_size = 0;
+                info->cip_w_request_size  = info->cip_r_request_size
+                    + info->cip_r_response_size - 4;
+                info->cip_w_response_size = 4;
             }
-            epicsMutexUnlock(info->data_lock);
         }
+        else
+        {
+            EIP_printf(3, "tag '%s': Cannot read!\n", info->string_tag);
+            info->cip_r_request_size  = 0;
+            info->cip_r_response_size = 0;
+            info->cip_w_request_size  = 0;
+            info->cip_w_response_size = 0;
+        }
+        epicsMutexUnlock(info->data_lock);
+    }
+
+    /* Place data buffers in scan order */
+    epicsMutexLock(plc->lock);
+    for (i=0; i<count; ++i)
+    {
+        info = tags[i];
+        if (! info  ||  epicsMutexLock(info->data_lock) != epicsMutexLockOK)
+            continue;
+        if (info->cip_r_response_size > 4)
+            reserve_tag_data(&plc->arena, info, info->cip_r_response_size - 4);
+        epicsMutexUnlock(info->data_lock);
     }
-    EIP_printf(5, "complete_PLC_ScanList_TagInfos PLC '%s': tried %lu tags, got %lu tags\n",
-               plc->name, (unsigned long)tried, (unsigned long)succeeded);
+    for (list=DLL_first(ScanList, &plc->scanlists);  list;
+         list=DLL_next(ScanList, list))
+        if (list->session == session)
+            list->view.valid = false;
+    epicsMutexUnlock(plc->lock);
+    free(tags);
+}
+
+/* Complete the TagInfos of all scanlists of the session,
+ * on its own PLC and those that share it.
+ * Called by the connecting scan task, without session->lock.
+ *
+ * Returns OK if any TagInfo in the scanlists could be filled,
+ * so we believe that scanning via this session makes some sense.
+ */
+static eip_bool complete_Session_ScanList_TagInfos(Session *session)
+{
+    PLC    *plc;
+    size_t tried = 0, succeeded = 0;
+
+    for (plc = session->plc;  plc;  plc = plc->next_shared)
+        complete_PLC_ScanList_TagInfos(session, plc, &tried, &succeeded);
+    EIP_printf(5, "complete_Session_ScanList_TagInfos PLC '%s' session %u: "
+               "tried %lu tags, got %lu tags\n",
+               session->plc->name, (unsigned)session->index,
+               (unsigned long)tried, (unsigned long)succeeded);
     /* OK if we got at least one answer,
      * or we never really tried to get any tag */
     return (succeeded > 0) || (tried == 0);
 }
 
-static void invalidate_PLC_tags(PLC *plc)
+/* Invalidate tags of the PLC's scanlists that use the session,
+ * caller holds PLC.lock
+ */
+static void invalidate_Session_tags(Session *session, PLC *plc)
 {
     ScanList    *list;
     TagInfo     *info;
@@ -455,6 +1052,8 @@ static void invalidate_PLC_tags(PLC *plc)
     for (list=DLL_first(ScanList, &plc->scanlists);  list;
          list=DLL_next(ScanList, list))
     {
+        if (list->session != session)
+            continue;
         for (info = DLL_first(TagInfo, &list->taginfos);  info;
              info = DLL_next(TagInfo, info))
         {
@@ -464,6 +1063,7 @@ static void invalidate_PLC_tags(PLC *plc)
             	 *  writes to prevent writing garbage after a reconnect
             	 */
             	info->is_writing = false;
+            	info->is_rmw = false;
                 info->valid_data_size = 0;
                 epicsMutexUnlock(info->data_lock);
                 /* Call all registered callbacks for this tag
@@ -474,110 +1074,391 @@ static void invalidate_PLC_tags(PLC *plc)
             }
             else
             {
-            	EIP_printf(1, "EIP invalidate_PLC_tags cannot lock %s",
+            	EIP_printf(1, "EIP invalidate_Session_tags cannot lock %s",
             			   info->string_tag);
             }
         }
     }
 }
 
-static void disconnect_PLC(PLC *plc)
+/* Disconnect session, caller holds session->lock.
+ * Takes the PLC.lock of each PLC using the session
+ * to invalidate its tags.
+ */
+static void disconnect_Session(Session *session)
 {
-    if (plc->connection->sock)
+    PLC *plc;
+
+    if (session->connection->sock)
     {
-        EIP_printf_time(4, "EIP disconnecting %s\n", plc->name);
-        EIP_shutdown(plc->connection);
-        invalidate_PLC_tags(plc);
+        EIP_printf_time(4, "EIP disconnecting %s session %u\n",
+                        session->plc->name, (unsigned)session->index);
+        EIP_shutdown(session->connection);
+        session->state = SESSION_DISCONNECTED;
+        for (plc = session->plc;  plc;  plc = plc->next_shared)
+        {
+            trace_event(&plc->trace, session->index, TRACE_DISCONNECT, 0, 0, 0);
+            epicsMutexLock(plc->lock);
+            invalidate_Session_tags(session, plc);
+            epicsMutexUnlock(plc->lock);
+        }
     }
 }
 
-/* Test if we are connected, if not try to connect to PLC */
-static eip_bool assert_PLC_connect(PLC *plc)
+/* Random factor 0.5 ... 1.0 for the reconnect delay (xorshift) */
+static double reconnect_jitter(Session *session)
+{
+    CN_UDINT x = session->random;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    session->random = x;
+    return 0.5 + 0.5 * (x / 4294967296.0);
+}
+
+/* After a failed connection, double the reconnect delay
+ * up to the limit and schedule the next attempt
+ */
+static void backoff_Session(Session *session)
 {
-    if (plc->connection->sock)
+    double delay;
+
+    session->state = SESSION_DISCONNECTED;
+    ++session->connect_failures;
+    if (session->reconnect_delay <= 0.0)
+        session->reconnect_delay = EIP_RECONNECT_DELAY;
+    else
+    {
+        session->reconnect_delay *= 2;
+        if (session->reconnect_delay > EIP_MAX_RECONNECT_DELAY)
+            session->reconnect_delay = EIP_MAX_RECONNECT_DELAY;
+    }
+    delay = session->reconnect_delay * reconnect_jitter(session);
+    epicsTimeGetCurrent(&session->next_connect);
+    epicsTimeAddSeconds(&session->next_connect, delay);
+    EIP_printf_time(4, "EIP reconnecting %s session %u in %.1f secs\n",
+                    session->plc->name, (unsigned)session->index, delay);
+}
+
+/* Disconnect session after a failed transfer.
+ * A PLC that accepts the connection but then fails
+ * is reconnected after the same growing, jittered delay
+ * as one that refuses the connection.
+ * Caller holds session->lock.
+ */
+static void fail_Session(Session *session)
+{
+    disconnect_Session(session);
+    backoff_Session(session);
+}
+
+/* Test if session is connected, if not try to connect to PLC
+ * unless it's too early after the last failed attempt.
+ * Caller holds session->lock, but no PLC.lock.
+ * The session->lock is released while connecting.
+ */
+static eip_bool assert_Session_connect(Session *session)
+{
+    PLC            *plc = session->plc, *shared;
+    epicsTimeStamp now;
+    eip_bool       ok, completed;
+
+    if (session->connection->sock)
         return true;
-    EIP_printf_time(4, "EIP connecting %s\n", plc->name);
-    if (! EIP_startup(plc->connection, plc->ip_addr,
-                      ETHERIP_PORT, plc->slot, EIP_TIMEOUT))
+    epicsTimeGetCurrent(&now);
+    if (epicsTimeLessThan(&now, &session->next_connect))
+        return false;
+    EIP_printf_time(4, "EIP connecting %s session %u\n",
+                    plc->name, (unsigned)session->index);
+    session->state = SESSION_CONNECTING;
+    session->connection->millisec_min_timeout =
+        EIP_TIMEOUT_FLOOR > 0 ? EIP_TIMEOUT_FLOOR : 0;
+    epicsMutexUnlock(session->lock);
+    ok = EIP_startup(session->connection, plc->ip_addr,
+                     ETHERIP_PORT, plc->slot, EIP_TIMEOUT);
+    for (shared = plc;  shared;  shared = shared->next_shared)
+        trace_event(&shared->trace, session->index, TRACE_CONNECT, ok, 0, 0);
+    completed = ok  &&  complete_Session_ScanList_TagInfos(session);
+    epicsMutexLock(session->lock);
+    if (! ok)
     {
-        errlogPrintf("EIP connection failed for %s:%d\n",
-                      plc->ip_addr, ETHERIP_PORT);
+        if (session->connect_failures == 0)
+            errlogPrintf("EIP connection failed for %s:%d\n",
+                         plc->ip_addr, ETHERIP_PORT);
+        backoff_Session(session);
         return false;
     }
-    if (! complete_PLC_ScanList_TagInfos(plc))
+    if (! completed)
     {
         errlogPrintf("EIP error during scan list completion for %s:%d\n",
                       plc->ip_addr, ETHERIP_PORT);
-        disconnect_PLC(plc);
+        disconnect_Session(session);
+        backoff_Session(session);
         return false;
     }
+    if (session->connect_failures > 0)
+        errlogPrintf("EIP connected to %s:%d after %u failed attempts\n",
+                     plc->ip_addr, ETHERIP_PORT,
+                     (unsigned)session->connect_failures);
+    session->state = SESSION_CONNECTED;
+    /* Backoff ends once a scan run worked, see PLC_scan_task */
     return true;
 }
 
+/* The scan task walks TagInfos either along a scanlist
+ * or along the (detached) write queue of the PLC.
+ */
+static TagInfo *next_TagInfo(TagInfo *info, eip_bool writes_only)
+{
+    return writes_only ? info->next_write : DLL_next(TagInfo, info);
+}
+
+/* Make room for 'count' tags in view */
+static eip_bool reserve_TagView(TagView *view, size_t count)
+{
+    TagInfo **tags;
+    size_t  *r_request_size, *r_response_size;
+    size_t  capacity;
+
+    if (count <= view->capacity)
+        return true;
+    capacity = view->capacity > 0 ? view->capacity : 16;
+    while (capacity < count)
+        capacity *= 2;
+    tags = (TagInfo **) realloc(view->tags, capacity * sizeof(TagInfo *));
+    if (tags)
+        view->tags = tags;
+    r_request_size = (size_t *) realloc(view->r_request_size,
+                                        capacity * sizeof(size_t));
+    if (r_request_size)
+        view->r_request_size = r_request_size;
+    r_response_size = (size_t *) realloc(view->r_response_size,
+                                         capacity * sizeof(size_t));
+    if (r_response_size)
+        view->r_response_size = r_response_size;
+    if (!(tags && r_request_size && r_response_size))
+    {
+        EIP_printf(1, "EIP reserve_TagView: no memory for %lu tags\n",
+                   (unsigned long) count);
+        return false;
+    }
+    view->capacity = capacity;
+    return true;
+}
+
+/* Fill view with the tags starting at 'info'
+ * that can be read/written.
+ * Called by scan task, PLC is locked.
+ */
+static eip_bool fill_TagView(TagView *view, TagInfo *info,
+                             eip_bool writes_only)
+{
+    view->count = 0;
+    view->valid = false;
+    for (/**/; info; info = next_TagInfo(info, writes_only))
+    {
+        if (info->cip_r_request_size <= 0  ||  info->cip_w_request_size <= 0)
+            continue;
+        if (!reserve_TagView(view, view->count + 1))
+            return false;
+        view->tags[view->count]            = info;
+        view->r_request_size[view->count]  = info->cip_r_request_size;
+        view->r_response_size[view->count] = info->cip_r_response_size;
+        ++view->count;
+    }
+    view->valid = true;
+    return true;
+}
+
+/* Can the tag's write be limited to some of its elements?
+ * Only for arrays of atomic types.
+ * BOOL arrays are read as UDINTs but their path index
+ * is the bit number, so those are always written as a whole.
+ */
+static eip_bool can_write_range(const TagInfo *info)
+{
+    CIP_Type type = get_CIP_typecode(info->data);
+    return info->elements > 1  &&  info->valid_data_size > 0  &&
+           type != T_CIP_BITS  &&  CIP_Type_size(type) > 0;
+}
+
+/* Move device's dirty range into this cycle's write range,
+ * merged with a range that's still waiting to be written,
+ * and determine the write request size.
+ * Called with data_lock.
+ */
+static void setup_write_range(TagInfo *info)
+{
+    size_t first, last;
+
+    if (info->do_write)
+    {
+        first = info->dirty_first;
+        last  = info->dirty_last;
+        if (info->is_writing)
+        {
+            if (info->write_first < first)
+                first = info->write_first;
+            if (info->write_first + info->write_count - 1 > last)
+                last = info->write_first + info->write_count - 1;
+        }
+        if (info->do_rmw)
+        {   /* Include element with pending bits, replacing the rmw */
+            if (info->rmw_element < first)
+                first = info->rmw_element;
+            if (info->rmw_element > last)
+                last = info->rmw_element;
+        }
+        if (last >= info->elements)
+            last = info->elements - 1;
+        if (first > last)
+            first = 0;
+        info->write_first = first;
+        info->write_count = last - first + 1;
+    }
+    if (info->write_count < info->elements  &&  can_write_range(info))
+        info->cip_w_this_request_size = CIP_WriteData_range_size(
+            info->tag, info->write_first,
+            get_CIP_typecode(info->data), info->write_count);
+    else
+    {
+        info->write_first = 0;
+        info->write_count = info->elements;
+        info->cip_w_this_request_size = info->cip_w_request_size;
+    }
+}
+
+/* A read-modify-write that's still 'is_rmw' got no reply,
+ * because the transfer failed or was dropped for a busy PLC
+ * or too large a buffer.
+ * Put its bits back in front of those requested meanwhile,
+ * unless a full write of the element(s) now includes them.
+ * Caller holds data_lock.
+ */
+static void retry_ReadModifyWrite(TagInfo *info)
+{
+    CN_UDINT or_mask = info->rmw_or_mask;
+
+    info->is_rmw = false;
+    if (! info->do_write)
+    {
+        info->rmw_or_mask = (info->rmw_sent_or_mask & info->rmw_and_mask)
+                          | or_mask;
+        info->rmw_and_mask = (info->rmw_sent_and_mask & info->rmw_and_mask)
+                           | info->rmw_or_mask;
+        info->do_rmw = true;
+    }
+    info->rmw_sent_or_mask = 0;
+    info->rmw_sent_and_mask = ~(CN_UDINT)0;
+}
+
 /* Given a transfer buffer limit,
  * see how many requests/responses can be handled in one transfer,
- * starting with the current TagInfo and using the following ones.
+ * starting with the view's tag at 'position'.
+ * With writes_only, tags that have no pending write are skipped.
+ * Reads of tags in quarantine until after 'now' are skipped.
  *
- * Returns count,
- * fills sizes for total requests/responses as well as
+ * Returns count, adds the tags to 'batch' and
+ * advances 'position' to the first tag not handled.
+ * Fills sizes for total requests/responses as well as
  * size of MultiRequest/Response.
  *
  * Called by scan task, PLC is locked.
  */
 static size_t determine_MultiRequest_count(size_t limit,
-                                           TagInfo *info,
+                                           const TagView *view,
+                                           size_t *position,
+                                           eip_bool writes_only,
+                                           const epicsTimeStamp *now,
+                                           TagInfo *batch[],
                                            size_t *requests_size,
                                            size_t *responses_size,
                                            size_t *multi_request_size,
                                            size_t *multi_response_size)
 {
-    size_t try_req, try_resp, count;
+    TagInfo *info;
+    size_t  try_req, try_resp, count;
 
     /* Sum sizes for requests and responses,
      * determine total for MultiRequest/Response,
      * stop if too big.
-     * Skip entries with empty cip_*_request_size!
+     * The view only holds tags with cip_*_request_size.
      */
     count = *requests_size = *responses_size = 0;
     EIP_printf(8, "EIP determine_MultiRequest_count, limit %lu\n",
                (unsigned long) limit);
-    for (/**/; info; info = DLL_next(TagInfo, info))
+    for (/**/; *position < view->count; ++*position)
     {
-        if (info->cip_r_request_size <= 0  ||  info->cip_w_request_size <= 0)
-            continue;
+        if (count >= CIP_MultiRequest_max_count)
+            return count;
+        info = view->tags[*position];
         if (epicsMutexLock(info->data_lock) != epicsMutexLockOK)
         {
             EIP_printf(1, "EIP determine_MultiRequest_count cannot lock %s\n",
                        info->string_tag);
             return 0;
         }
+        if (writes_only  &&  !(info->do_write || info->is_writing ||
+                               info->do_rmw   || info->is_rmw))
+        {   /* Write was already handled by the tag's scanlist */
+            epicsMutexUnlock(info->data_lock);
+            continue;
+        }
+        if (info->is_rmw)
+            retry_ReadModifyWrite(info);
         /* Did device suppport request a 'write' cycle?
          * Or are we in one that's not completed?
          */
+        if (info->do_write  ||  info->is_writing)
+            setup_write_range(info);
         info->is_writing = info->do_write | info->is_writing;
+        info->is_rmw = !info->is_writing  &&  (info->do_rmw | info->is_rmw);
         if (info->is_writing)
-        {   /* Yes, clear the flag, compute size of write command/reply */
+        {   /* Yes, clear the flag, compute size of write command/reply.
+             * The full write includes any bits for read-modify-write */
             info->do_write = false;
-            try_req  = *requests_size  + info->cip_w_request_size;
+            info->do_rmw = false;
+            info->rmw_or_mask = 0;
+            info->rmw_and_mask = ~(CN_UDINT)0;
+            try_req  = *requests_size  + info->cip_w_this_request_size;
             try_resp = *responses_size + info->cip_w_response_size;
             EIP_printf(5, " tag %lu '%s' (write): %lu (0x%X), %lu (0x%X)\n",
                        (unsigned long)count, info->string_tag,
-                       (unsigned long)info->cip_w_request_size,
-                       (unsigned long)info->cip_w_request_size,
+                       (unsigned long)info->cip_w_this_request_size,
+                       (unsigned long)info->cip_w_this_request_size,
                        (unsigned long)info->cip_w_response_size,
                        (unsigned long)info->cip_w_response_size);
         }
+        else if (info->is_rmw)
+        {   /* Size of read-modify-write for the pending element */
+            info->cip_rmw_request_size = CIP_ReadModifyWrite_size(
+                info->tag, info->rmw_indexed, info->rmw_element,
+                info->rmw_mask_size);
+            try_req  = *requests_size  + info->cip_rmw_request_size;
+            try_resp = *responses_size + info->cip_w_response_size;
+            EIP_printf(5, " tag %lu '%s' (read-modify-write): %lu, %lu\n",
+                       (unsigned long)count, info->string_tag,
+                       (unsigned long)info->cip_rmw_request_size,
+                       (unsigned long)info->cip_w_response_size);
+        }
+        else if (info->quarantine_delay > 0.0  &&
+                 epicsTimeLessThan(now, &info->quarantine_end))
+        {   /* PLC recently refused to read the tag, try again later */
+            epicsMutexUnlock(info->data_lock);
+            continue;
+        }
         else
         {   /* Read cycle. Device support may set 'do_write' between now
              * and when we actually read, but we go by 'is_writing      */
-            try_req  = *requests_size  + info->cip_r_request_size;
-            try_resp = *responses_size + info->cip_r_response_size;
+            try_req  = *requests_size  + view->r_request_size[*position];
+            try_resp = *responses_size + view->r_response_size[*position];
             EIP_printf(8, " tag %lu '%s' (read): %lu (0x%X), %lu (0x%X)\n",
                        (unsigned long)count, info->string_tag,
-                       (unsigned long)info->cip_r_request_size,
-                       (unsigned long)info->cip_r_request_size,
-                       (unsigned long)info->cip_r_response_size,
-                       (unsigned long)info->cip_r_response_size);
+                       (unsigned long)view->r_request_size[*position],
+                       (unsigned long)view->r_request_size[*position],
+                       (unsigned long)view->r_response_size[*position],
+                       (unsigned long)view->r_response_size[*position]);
         }
         epicsMutexUnlock(info->data_lock);
         *multi_request_size  = CIP_MultiRequest_size (count+1, try_req);
@@ -599,54 +1480,232 @@ static size_t determine_MultiRequest_count(size_t limit,
                 EIP_printf(3, " Request   size: %10lu bytes\n", (unsigned long)try_req);
                 EIP_printf(3, " Response  size: %10lu bytes\n", (unsigned long)try_resp);
             }
-            return count;
+            return count;
+        }
+        batch[count++] = info; /* ok, include another request */
+        *requests_size  = try_req;
+        *responses_size = try_resp;
+    }
+    EIP_printf(8, " End of list, total req/resp: %lu, %lu\n",
+               (unsigned long)*multi_request_size,
+               (unsigned long)*multi_response_size);
+    return count;
+}
+
+/* Skip reads of a tag that PLC refused, for a growing delay.
+ * Caller holds PLC.lock and the tag's data_lock.
+ */
+static void quarantine_TagInfo(PLC *plc, TagInfo *info,
+                               const epicsTimeStamp *now)
+{
+    ++plc->tag_errors;
+    ++info->read_errors;
+    if (info->quarantine_delay <= 0.0)
+        info->quarantine_delay = EIP_QUARANTINE_DELAY;
+    else
+    {
+        info->quarantine_delay *= 2;
+        if (info->quarantine_delay > EIP_MAX_QUARANTINE_DELAY)
+            info->quarantine_delay = EIP_MAX_QUARANTINE_DELAY;
+    }
+    info->quarantine_end = *now;
+    epicsTimeAddSeconds(&info->quarantine_end, info->quarantine_delay);
+    EIP_printf_time(info->read_errors > 1 ? 5 : 2,
+                    "EIP '%s': read failed %u times, skipping it for %g secs\n",
+                    info->string_tag, (unsigned)info->read_errors,
+                    info->quarantine_delay);
+}
+
+/* Session's scan task takes the lock of a PLC that it scans */
+static eip_bool lock_scanned_PLC(Session *session, PLC *plc)
+{
+    if (epicsMutexLock(plc->lock) != epicsMutexLockOK)
+    {
+        EIP_printf_time(1, "drvEtherIP scan task for PLC '%s'"
+                        " cannot take plc->lock\n", plc->name);
+        return false;
+    }
+    session->locked = phase_clock();
+    return true;
+}
+
+/* Scan task releases the PLC lock */
+static void unlock_scanned_PLC(Session *session, PLC *plc)
+{
+    plc->lock_time += phase_clock() - session->locked;
+    epicsMutexUnlock(plc->lock);
+}
+
+/* Are transfers to PLC limited or throttled,
+ * so that scanlists should be handled by deadline?
+ * Caller holds PLC.write_lock.
+ */
+static eip_bool rate_is_limited(const RateLimit *rate)
+{
+    return rate->packet_rate > 0.0  ||  rate->byte_rate > 0.0  ||
+           rate->factor < 1.0;
+}
+
+/* Take tokens from one bucket, which may go into debt.
+ * Returns seconds until the debt is paid off
+ */
+static double take_tokens(double *tokens, double rate, double cost,
+                          double elapsed)
+{
+    double depth = rate * EIP_RATE_BURST;
+
+    if (depth < cost)
+        depth = cost;
+    *tokens += elapsed * rate;
+    if (*tokens > depth)
+        *tokens = depth;
+    *tokens -= cost;
+    return *tokens < 0.0 ? -*tokens / rate : 0.0;
+}
+
+/* Reserve a transfer of 'bytes' to PLC.
+ * Returns seconds to wait before sending it.
+ * Without a configured packet rate, throttling
+ * reduces the packet rate measured before.
+ * Caller holds PLC.write_lock.
+ */
+static double rate_delay(RateLimit *rate, size_t bytes, double now)
+{
+    double elapsed = rate->refilled > 0.0 ? now - rate->refilled : 0.0;
+    double delay = 0.0, packet_rate, wait;
+
+    rate->refilled = now;
+    /* Count transfers per second, the base for throttling */
+    ++rate->counted;
+    if (rate->count_start <= 0.0)
+    {
+        rate->count_start = now;
+        rate->counted = 0;
+    }
+    else if (now - rate->count_start >= 1.0)
+    {
+        rate->measured = rate->counted / (now - rate->count_start);
+        rate->count_start = now;
+        rate->counted = 0;
+    }
+    packet_rate = rate->packet_rate;
+    if (packet_rate <= 0.0  &&  rate->factor < 1.0)
+        packet_rate = rate->base_rate;
+    if (packet_rate > 0.0)
+        delay = take_tokens(&rate->packets, packet_rate*rate->factor,
+                            1.0, elapsed);
+    if (rate->byte_rate > 0.0)
+    {
+        wait = take_tokens(&rate->bytes, rate->byte_rate*rate->factor,
+                           (double) bytes, elapsed);
+        if (wait > delay)
+            delay = wait;
+    }
+    if (delay > 0.0)
+    {
+        ++rate->delays;
+        rate->delay_time += delay;
+    }
+    return delay;
+}
+
+/* Adjust throttle factor after a transfer to PLC,
+ * halving it when the PLC was 'busy', slowly recovering otherwise.
+ * PLCs that share sessions share the throttle factor.
+ * Caller holds PLC.lock.
+ */
+static void rate_feedback(PLC *plc, eip_bool busy, double now)
+{
+    RateLimit *rate = plc->rate;
+
+    epicsMutexLock(plc->write_lock);
+    if (! busy)
+    {
+        if (rate->factor < 1.0)
+        {
+            rate->factor += EIP_RATE_RECOVERY;
+            if (rate->factor >= 1.0)
+            {
+                rate->factor = 1.0;
+                rate->base_rate = 0.0;
+                EIP_printf_time(4, "EIP PLC '%s': no longer throttled\n",
+                                plc->name);
+            }
         }
-        ++count; /* ok, include another request */
-        *requests_size  = try_req;
-        *responses_size = try_resp;
     }
-    EIP_printf(8, " End of list, total req/resp: %lu, %lu\n",
-               (unsigned long)*multi_request_size,
-               (unsigned long)*multi_response_size);
-    return count;
+    else if (now - rate->throttled >= EIP_RATE_HOLDOFF  &&
+             rate->factor > EIP_MIN_RATE_FACTOR)
+    {
+        if (rate->base_rate <= 0.0)
+            rate->base_rate = rate->measured;
+        rate->throttled = now;
+        rate->factor /= 2;
+        if (rate->factor < EIP_MIN_RATE_FACTOR)
+            rate->factor = EIP_MIN_RATE_FACTOR;
+        ++rate->throttles;
+        EIP_printf_time(4, "EIP PLC '%s' is busy, throttled to %.0f%% rate\n",
+                        plc->name, rate->factor*100.0);
+    }
+    epicsMutexUnlock(plc->write_lock);
 }
 
-/* Read all tags in Scanlist,
+/* Read/write all tags in the view,
  * using MultiRequests for as many as possible.
- * Called by scan task, PLC is locked.
+ * 'list' is the scanlist of the view, or 0 for the write queue
+ * where only tags with pending writes are handled.
+ * Statistics are added to the PLC's and to those of the list.
+ * Called by session's scan task, PLC is locked,
+ * but unlocked while waiting for each response.
+ * Requests are routed to the PLC's slot.
  *
  * Returns OK when the transactions worked out,
  * even if the read requests for the tags
  * returned no data.
  */
-static eip_bool process_ScanList(EIPConnection *c, ScanList *scanlist)
+static eip_bool process_TagInfos(Session *session, PLC *plc,
+                                 const TagView *view, ScanList *list)
 {
-    TagInfo             *info, *info_position;
+    eip_bool            writes_only = list == 0;
+    EIPConnection       *c = route_Session(session, plc);
+    TagInfo             *info;
+    TagInfo             *batch[CIP_MultiRequest_max_count];
+    size_t              position = 0;
     size_t              count, requests_size, responses_size;
     size_t              multi_request_size = 0, multi_response_size = 0;
     size_t              send_size, i, elements;
     CN_USINT            *send_request, *multi_request, *request;
     const CN_USINT      *response, *single_response, *data;
+    const CN_USINT      *replies[CIP_MultiRequest_max_count];
+    size_t              reply_sizes[CIP_MultiRequest_max_count];
     EncapsulationRRData rr_data;
+    TransactionID       rid;
     size_t              single_response_size, data_size;
-    epicsTimeStamp      start_time, end_time;
-    double              transfer_time;
+    ScanPhases          phases;
+    double              start, now, before_callbacks, callbacks;
+    double              transfer_time, delay, srtt;
     TagCallback         *cb;
-    eip_bool            ok;
-
-    EIP_printf_time(10, "EIP process_ScanList %g s\n", scanlist->period);
-    info = DLL_first(TagInfo, &scanlist->taginfos);
-    while (info)
-    {   /* keep position, we'll loop several times:
-         * 0) in determine_MultiRequest_count
+    eip_bool            ok, sent, received = false, too_large, busy;
+    epicsTimeStamp      scan_time;
+
+    epicsTimeGetCurrent(&scan_time);
+    while (position < view->count)
+    {   /* Phases of this transfer are added to the statistics
+         * once it completed */
+        memset(&phases, 0, sizeof(phases));
+        start = phase_clock();
+        /* Collect the tags for one transfer in 'batch',
+         * then loop over those
          * 1) to send out the requests
          * 2) to handle the responses
          */
-        info_position = info;
         count = determine_MultiRequest_count(
-            c->transfer_buffer_limit,
-            info, &requests_size, &responses_size,
+            c->transfer_buffer_limit, view, &position, writes_only,
+            &scan_time, batch,
+            &requests_size, &responses_size,
             &multi_request_size, &multi_response_size);
+        now = phase_clock();
+        phases.plan = now - start;
+        start = now;
         EIP_printf(10, "EIP process_ScanList %lu items\n",
                    (unsigned long)count);
         if (count == 0) /* Empty, or nothing fits in one request. */
@@ -663,15 +1722,14 @@ static eip_bool process_ScanList(EIPConnection *c, ScanList *scanlist)
         if (!(multi_request && prepare_CIP_MultiRequest(multi_request, count)))
             return false;
         /* Add read/write requests to the multi requests */
-        for (i=0;  i<count;  info=DLL_next(TagInfo, info))
+        for (i=0;  i<count;  ++i)
         {
-            if (info->cip_r_request_size <= 0  ||  info->cip_w_request_size <= 0)
-                continue;
+            info = batch[i];
             EIP_printf(10, "Request #%d (%s):\n", i, info->string_tag);
             if (info->is_writing)
             {
                 request = CIP_MultiRequest_item(multi_request,
-                                                i, info->cip_w_request_size);
+                                                i, info->cip_w_this_request_size);
                 if (epicsMutexLock(info->data_lock) != epicsMutexLockOK)
                 {
                     EIP_printf_time(1, "EIP process_ScanList '%s': "
@@ -679,11 +1737,47 @@ static eip_bool process_ScanList(EIPConnection *c, ScanList *scanlist)
                     info->is_writing = false;
                     return false;
                 }
+                if (info->write_count < info->elements)
+                    ok = request &&
+                        make_CIP_WriteData_range(
+                            request, info->tag, info->write_first,
+                            (CIP_Type)get_CIP_typecode(info->data),
+                            info->write_count,
+                            info->data + CIP_Typecode_size +
+                            info->write_first *
+                            CIP_Type_size(get_CIP_typecode(info->data)));
+                else
+                    ok = request &&
+                        make_CIP_WriteData(
+                            request, info->cip_w_request_size, info->tag,
+                            (CIP_Type)get_CIP_typecode(info->data),
+                            info->elements, info->data + CIP_Typecode_size);
+                epicsMutexUnlock(info->data_lock);
+            }
+            else if (info->is_rmw)
+            {
+                request = CIP_MultiRequest_item(multi_request,
+                                                i, info->cip_rmw_request_size);
+                if (epicsMutexLock(info->data_lock) != epicsMutexLockOK)
+                {
+                    EIP_printf_time(1, "EIP process_ScanList '%s': "
+                               "no data lock (read-modify-write)\n",
+                               info->string_tag);
+                    info->is_rmw = false;
+                    return false;
+                }
                 ok = request &&
-                    make_CIP_WriteData(
-                        request, info->cip_w_request_size, info->tag,
-                        (CIP_Type)get_CIP_typecode(info->data),
-                        info->elements, info->data + CIP_Typecode_size);
+                    make_CIP_ReadModifyWrite(
+                        request, info->tag, info->rmw_indexed,
+                        info->rmw_element, info->rmw_mask_size,
+                        info->rmw_or_mask, info->rmw_and_mask);
+                /* Collect bits for the next request,
+                 * keeping these in case there's no reply */
+                info->rmw_sent_or_mask = info->rmw_or_mask;
+                info->rmw_sent_and_mask = info->rmw_and_mask;
+                info->do_rmw = false;
+                info->rmw_or_mask = 0;
+                info->rmw_and_mask = ~(CN_UDINT)0;
                 epicsMutexUnlock(info->data_lock);
             }
             else
@@ -695,30 +1789,85 @@ static eip_bool process_ScanList(EIPConnection *c, ScanList *scanlist)
             }
             if (!ok)
                 return false;
-            ++i; /* increment here, not in for() -> skip empty tags */
         } /* for i=0..count */
-        epicsTimeGetCurrent(&start_time);
-        if (!EIP_send_connection_buffer(c))
+        now = phase_clock();
+        phases.encode = now - start;
+        start = now;
+        epicsMutexLock(plc->write_lock);
+        delay = rate_delay(plc->rate, 2*sizeof_EncapsulationRRData +
+                           send_size + multi_response_size, now);
+        epicsMutexUnlock(plc->write_lock);
+        srtt = c->srtt;
+        /* Other sessions may use the PLC while this one waits */
+        unlock_scanned_PLC(session, plc);
+        if (delay > 0.0)
+        {
+            epicsThreadSleep(delay);
+            start = phase_clock();
+        }
+        sent = EIP_send_connection_buffer(c);
+        if (sent)
+        {
+            trace_event(&plc->trace, session->index, TRACE_SEND, count,
+                        sizeof_EncapsulationRRData + send_size, &tid);
+            now = phase_clock();
+            phases.send = now - start;
+            start = now;
+            /* read response */
+            received = EIP_read_connection_buffer(c);
+            if (! received)
+                trace_event(&plc->trace, session->index, TRACE_TIMEOUT,
+                            count, 0, &tid);
+        }
+        else
+            trace_event(&plc->trace, session->index, TRACE_ERROR,
+                        count, 0, &tid);
+        if (! lock_scanned_PLC(session, plc))
+            return false;
+        if (!sent)
         {
             EIP_printf_time(2, "EIP process_ScanList: Error while sending request\n");
             return false;
         }
-        /* read & disassemble response */
-        if (!EIP_read_connection_buffer(c))
+        now = phase_clock();
+        if (!received)
         {
+            rate_feedback(plc, true, now);
             EIP_printf_time(2, "EIP process_ScanList: No response\n");
             return false;
         }
-        epicsTimeGetCurrent(&end_time);
-        transfer_time = epicsTimeDiffInSeconds(&end_time, &start_time);
+        phases.wait = now - start;
+        start = now;
+        transfer_time = phases.send + phases.wait;
+        /* Round trips much slower than usual mean that PLC is busy */
+        epicsMutexLock(plc->write_lock);
+        if (srtt > 0.0  &&  transfer_time > EIP_SLOW_RTT * srtt)
+            ++plc->rate->slow_transfers;
+        else
+            plc->rate->slow_transfers = 0;
+        busy = plc->rate->slow_transfers >= EIP_SLOW_TRANSFERS;
+        epicsMutexUnlock(plc->write_lock);
+        drvEtherIP_histogram_add(&plc->rtt_hist, transfer_time);
+        if (list)
+            drvEtherIP_histogram_add(&list->rtt_hist, transfer_time);
         response = EIP_unpack_RRData(c->buffer, &rr_data);
+        /* Decode no more than was received */
+        if (rr_data.data_length + sizeof_EncapsulationRRData
+            > sizeof_EncapsulationHeader + rr_data.header.length)
+        {
+            trace_event(&plc->trace, session->index, TRACE_ERROR, count, 0, &tid);
+            EIP_printf_time(2, "EIP process_ScanList: Invalid response length\n");
+            return false;
+        }
 
         /* Verify transmission ID */
-        TransactionID rid;
         extractTransactionId(&rr_data.header,&rid);
+        trace_event(&plc->trace, session->index, TRACE_RECEIVE, count,
+                    sizeof_EncapsulationHeader + rr_data.header.length, &rid);
         if (! compareTransactionIds(&tid, &rid))
         {
             char tidText[32], gidText[32];
+            trace_event(&plc->trace, session->index, TRACE_ERROR, count, 0, &tid);
             transactionIdString(&tid,tidText,sizeof(tidText));
             transactionIdString(&rid,gidText,sizeof(gidText));
             EIP_printf_time(2, "EIP process_ScanList: Mismatch in transaction ID\n");
@@ -728,14 +1877,24 @@ static eip_bool process_ScanList(EIPConnection *c, ScanList *scanlist)
 
         if (! check_CIP_MultiRequest_Response(response, rr_data.data_length))
         {
-            EIP_printf_time(2, "EIP process_ScanList: Error in response\n");
-            for (info=info_position,i=0; i<count; info=DLL_next(TagInfo, info))
-            {
-                if (info->cip_r_request_size <= 0)
-                    continue;
-                EIP_printf(2, "Tag %i: '%s'\n", i, info->string_tag);
-                ++i;
+            trace_event(&plc->trace, session->index, TRACE_ERROR, count, 0, &tid);
+            if (is_CIP_busy_error(response[2]))
+            {   /* Tags of this transfer are handled in the next scan,
+                 * at a lower rate */
+                rate_feedback(plc, true, now);
+                continue;
+            }
+            if (count > 1  &&  is_CIP_buffer_error(response[2]))
+            {   /* Tags of this transfer are handled in the next scan,
+                 * using smaller transfers */
+                EIP_reduce_buffer_limit(c,
+                    multi_request_size > multi_response_size ?
+                    multi_request_size : multi_response_size);
+                continue;
             }
+            EIP_printf_time(2, "EIP process_ScanList: Error in response\n");
+            for (i=0; i<count; ++i)
+                EIP_printf(2, "Tag %i: '%s'\n", i, batch[i]->string_tag);
             if (EIP_verbosity >= 2)
             {
                 dump_CIP_MultiRequest_Response_Error(response,
@@ -745,16 +1904,24 @@ static eip_bool process_ScanList(EIPConnection *c, ScanList *scanlist)
             }
             return false;
         }
+        /* Locate all replies once, checking them against the packet size */
+        if (get_CIP_MultiRequest_Responses(response, rr_data.data_length,
+                                           CIP_MultiRequest_max_count,
+                                           replies, reply_sizes) != count)
+        {
+            trace_event(&plc->trace, session->index, TRACE_ERROR, count, 0, &tid);
+            EIP_printf_time(2, "EIP process_ScanList: Invalid response\n");
+            return false;
+        }
         /* Handle individual read/write responses */
-        for (info=info_position, i=0; i<count; info=DLL_next(TagInfo, info))
+        callbacks = 0.0;
+        too_large = false;
+        for (i=0; i<count; ++i)
         {
-            if (info->cip_r_request_size <= 0 ||  info->cip_w_request_size <= 0)
-                continue;
+            info = batch[i];
             info->transfer_time = transfer_time;
-            single_response = get_CIP_MultiRequest_Response(
-                response, rr_data.data_length, i, &single_response_size);
-            if (! single_response)
-                return false;
+            single_response = replies[i];
+            single_response_size = reply_sizes[i];
             if (EIP_verbosity >= 10)
             {
                 EIP_printf(10, "Response #%d (%s):\n", i, info->string_tag);
@@ -776,12 +1943,43 @@ static eip_bool process_ScanList(EIPConnection *c, ScanList *scanlist)
                     info->valid_data_size = 0;
                 }
                 info->is_writing = false;
+                ++plc->writes_sent;
+            }
+            else if (info->is_rmw)
+            {
+                ok = check_CIP_ReadModifyWrite_Response(single_response,
+                                                        single_response_size);
+                /* Reply that didn't fit or a busy PLC: Leave 'is_rmw'
+                 * so that the bits are sent again */
+                if (!ok  &&  count > 1  &&
+                    is_CIP_buffer_error(single_response[2]))
+                    too_large = true;
+                else if (!ok  &&  is_CIP_busy_error(single_response[2]))
+                    busy = true;
+                else
+                {
+                    if (!ok)
+                    {   /* Cached data has all the bits, so write the element(s).
+                         * If the write also fails, the tag will be invalidated.
+                         * Only a PLC that lacks the service gets no more
+                         * read-modify-writes */
+                        EIP_printf_time(2, "EIP: CIPReadModifyWrite failed for '%s', "
+                                        "using CIPWrite\n", info->string_tag);
+                        if (is_CIP_unsupported_error(single_response[2]))
+                            info->no_rmw = true;
+                        drvEtherIP_request_write(plc, info);
+                    }
+                    info->is_rmw = false;
+                    info->rmw_sent_or_mask = 0;
+                    info->rmw_sent_and_mask = ~(CN_UDINT)0;
+                    ++plc->writes_sent;
+                }
             }
             else /* not writing, reading */
             {
                 data = check_CIP_ReadData_Response(
                     single_response, single_response_size, &data_size);
-                if (info->do_write)
+                if (info->do_write  ||  info->do_rmw)
                 {   /* Possible: Read request ... network delay ... response
                      * and record requested write during the delay.
                      * Ignore the read, because that would replace the data
@@ -789,9 +1987,28 @@ static eip_bool process_ScanList(EIPConnection *c, ScanList *scanlist)
                     EIP_printf(8, "EIP '%s': Device support requested write "
                                "in middle of read cycle.\n", info->string_tag);
                 }
+                else if (! data)
+                {   /* PLC refused this tag, but others may be fine.
+                     * Reply that didn't fit or a busy PLC
+                     * is not the fault of the tag */
+                    info->valid_data_size = 0;
+                    if (count > 1  &&  is_CIP_buffer_error(single_response[2]))
+                        too_large = true;
+                    else if (is_CIP_busy_error(single_response[2]))
+                        busy = true;
+                    else
+                        quarantine_TagInfo(plc, info, &scan_time);
+                }
                 else
                 {
-                    if (data_size > 0  && reserve_tag_data(info, data_size))
+                    if (info->read_errors > 0)
+                    {
+                        EIP_printf_time(4, "EIP '%s': read works again\n",
+                                        info->string_tag);
+                        info->read_errors = 0;
+                        info->quarantine_delay = 0.0;
+                    }
+                    if (data_size > 0  && reserve_tag_data(&plc->arena, info, data_size))
                     {
                         memcpy(info->data, data, data_size);
                         info->valid_data_size = data_size;
@@ -819,55 +2036,309 @@ static eip_bool process_ScanList(EIPConnection *c, ScanList *scanlist)
             epicsMutexUnlock(info->data_lock);
             /* Call all registered callbacks for this tag
              * so that records can show new value */
-            for (cb = DLL_first(TagCallback, &info->callbacks);
-                 cb; cb=DLL_next(TagCallback, cb))
-                (*cb->callback) (cb->arg);
-            ++i;
+            cb = DLL_first(TagCallback, &info->callbacks);
+            if (cb)
+            {
+                before_callbacks = phase_clock();
+                for (/**/; cb; cb=DLL_next(TagCallback, cb))
+                    (*cb->callback) (cb->arg);
+                callbacks += phase_clock() - before_callbacks;
+            }
         }
-        /* "info" now on next unread TagInfo or 0 */
-    } /* while "info" ... */
+        if (too_large)
+            EIP_reduce_buffer_limit(c, multi_response_size);
+        now = phase_clock();
+        rate_feedback(plc, busy, now);
+        phases.callbacks = callbacks;
+        phases.decode = now - start - callbacks;
+        phases.transfers = 1;
+        add_ScanPhases(&plc->phases, &phases);
+        if (list)
+            add_ScanPhases(&list->phases, &phases);
+        /* "position" now on next unread tag of the view */
+    } /* while "position" ... */
     return true;
 }
 
-/* Scan task, one per PLC */
-static void PLC_scan_task(PLC *plc)
+/* Read all tags in Scanlist.
+ * Called by session's scan task, PLC is locked.
+ */
+static eip_bool process_ScanList(Session *session, ScanList *scanlist)
 {
-    ScanList *list;
+    EIP_printf_time(10, "EIP process_ScanList %g s\n", scanlist->period);
+    if (!scanlist->view.valid  &&
+        !fill_TagView(&scanlist->view,
+                      DLL_first(TagInfo, &scanlist->taginfos), false))
+        return false;
+    return process_TagInfos(session, scanlist->plc, &scanlist->view, scanlist);
+}
+
+/* Append tag to write queue of the session that scans the tag,
+ * caller holds plc->write_lock
+ */
+static void enqueue_write(TagInfo *info)
+{
+    Session *session = info->scanlist->session;
+
+    info->write_queued = true;
+    info->next_write = 0;
+    if (session->write_queue_tail)
+        session->write_queue_tail->next_write = info;
+    else
+        session->write_queue = info;
+    session->write_queue_tail = info;
+}
+
+/* Release the tags of a detached write queue.
+ * Writes requested meanwhile, and those of transfers
+ * that got no reply, go back onto the queue,
+ * except for tags that can't be written at all
+ */
+static void release_WriteQueue(PLC *plc, TagInfo *queue)
+{
+    TagInfo *info, *next;
+    Session *requeued[EIP_MAX_SESSIONS];
+    size_t  i, requeued_count = 0;
+
+    for (info = queue;  info;  info = next)
+    {
+        epicsMutexLock(info->data_lock);
+        epicsMutexLock(plc->write_lock);
+        next = info->next_write;
+        info->write_queued = false;
+        if ((info->do_write || info->is_writing ||
+             info->do_rmw   || info->is_rmw)  &&  info->cip_w_request_size > 0)
+        {
+            enqueue_write(info);
+            for (i=0; i<requeued_count; ++i)
+                if (requeued[i] == info->scanlist->session)
+                    break;
+            if (i >= requeued_count)
+                requeued[requeued_count++] = info->scanlist->session;
+        }
+        epicsMutexUnlock(plc->write_lock);
+        epicsMutexUnlock(info->data_lock);
+    }
+    for (i=0; i<requeued_count; ++i)
+        epicsEventSignal(requeued[i]->write_event);
+}
+
+/* Detach the tags of a queue whose scanlist is no longer
+ * scanned by the session, returning those.
+ * Caller holds PLC.lock.
+ */
+static TagInfo *detach_moved_writes(Session *session, TagInfo **queue)
+{
+    TagInfo *moved = 0, **moved_tail = &moved, **link = queue, *info;
+
+    while ((info = *link) != 0)
+    {
+        if (info->scanlist->session == session)
+        {
+            link = &info->next_write;
+            continue;
+        }
+        *link = info->next_write;
+        info->next_write = 0;
+        *moved_tail = info;
+        moved_tail = &info->next_write;
+    }
+    return moved;
+}
+
+/* Send all writes queued for the session.
+ * Called by session's scan task, which holds the session->lock.
+ * The writes for each PLC that uses the session are sent
+ * in their own MultiRequest(s) while holding that PLC's lock.
+ *
+ * Within EIP_WRITE_HOLDOFF of the previous flush, the queue
+ * is left alone to collect more writes, and 'holdoff'
+ * is set to the seconds until it should be sent.
+ */
+static eip_bool process_WriteQueue(Session *session, double *holdoff)
+{
+    PLC            *plc = session->plc;
+    TagInfo        *queue, *mine, *rest, *moved, **mine_tail, **rest_tail;
+    TagInfo        *info, *next;
+    epicsTimeStamp now;
+    eip_bool       ok = true;
+
+    *holdoff = 0.0;
+    epicsMutexLock(plc->write_lock);
+    queue = session->write_queue;
+    if (queue  &&  EIP_WRITE_HOLDOFF > 0)
+    {
+        epicsTimeGetCurrent(&now);
+        *holdoff = EIP_WRITE_HOLDOFF/1000.0
+                 - epicsTimeDiffInSeconds(&now, &session->last_write_flush);
+        if (*holdoff > 0.0)
+        {
+            epicsMutexUnlock(plc->write_lock);
+            return true;
+        }
+        *holdoff = 0.0;
+    }
+    session->write_queue = session->write_queue_tail = 0;
+    epicsMutexUnlock(plc->write_lock);
+    if (! queue)
+        return true;
+    epicsTimeGetCurrent(&session->last_write_flush);
+    while (queue)
+    {   /* Detach the writes to the PLC of the first queued tag,
+         * keeping their order. Only the scan task links
+         * the tags of the detached queue. */
+        plc = queue->scanlist->plc;
+        mine = rest = 0;
+        mine_tail = &mine;
+        rest_tail = &rest;
+        for (info = queue;  info;  info = next)
+        {
+            next = info->next_write;
+            info->next_write = 0;
+            if (info->scanlist->plc == plc)
+            {
+                *mine_tail = info;
+                mine_tail = &info->next_write;
+            }
+            else
+            {
+                *rest_tail = info;
+                rest_tail = &info->next_write;
+            }
+        }
+        queue = rest;
+        if (ok)
+        {
+            EIP_printf_time(10, "EIP process_WriteQueue '%s' session %u\n",
+                            plc->name, (unsigned)session->index);
+            if (! lock_scanned_PLC(session, plc))
+                ok = false;
+            else
+            {
+                moved = detach_moved_writes(session, &mine);
+                ok = fill_TagView(&session->write_view, mine, true)  &&
+                     process_TagInfos(session, plc, &session->write_view, 0);
+                if (! ok)
+                    ++plc->plc_errors;
+                /* Re-queued on the session that now scans them */
+                release_WriteQueue(plc, moved);
+                unlock_scanned_PLC(session, plc);
+            }
+        }
+        release_WriteQueue(plc, mine);
+    }
+    return ok;
+}
+
+/* PLC that the session's scan task handles after 'plc' */
+static PLC *next_scanned_PLC(Session *session, PLC *plc)
+{
+    return plc->next_shared ? plc->next_shared : session->plc;
+}
+
+/* Scanlist of PLC that session should scan next in this run, or 0.
+ * Lists that are due get scanned in list order,
+ * or by their deadline, the end of their period,
+ * while transfers to the PLC are rate limited.
+ * Caller holds PLC.lock.
+ */
+static ScanList *next_due_ScanList(Session *session, PLC *plc,
+                                   const epicsTimeStamp *start_time)
+{
+    eip_bool by_deadline;
+    ScanList *list, *due = 0;
+
+    epicsMutexLock(plc->write_lock);
+    by_deadline = rate_is_limited(plc->rate);
+    epicsMutexUnlock(plc->write_lock);
+
+    for (list = DLL_first(ScanList,&plc->scanlists);
+         list;  list = DLL_next(ScanList,list))
+    {
+        if (! list->enabled  ||  list->session != session  ||
+            list->scan_run == session->scan_runs  ||
+            !epicsTimeLessThanEqual(&list->scheduled_time, start_time))
+            continue;
+        if (! by_deadline)
+            return list;
+        if (!due  ||
+            epicsTimeDiffInSeconds(&list->scheduled_time,
+                                   &due->scheduled_time)
+            + list->period < due->period)
+            due = list;
+    }
+    return due;
+}
+
+/* Scan task, one per session of a PLC.
+ * Also scans the scanlists of PLCs in other slots
+ * that share the session.
+ * Each run starts with the next of those PLCs,
+ * so that no slot always waits for the others.
+ */
+static void PLC_scan_task(Session *session)
+{
+    PLC               *plc, *first;
+    ScanList          *list;
     epicsTimeStamp    next_schedule, start_time, end_time;
-    double            timeout, delay, quantum;
+    double            delay, quantum, holdoff, late;
     eip_bool          transfer_ok, reset_next_schedule;
 
     quantum = epicsThreadSleepQuantum();
-    timeout = (double)EIP_TIMEOUT/1000.0;
-scan_loop: /* --------- The Scan Loop for one PLC -------- */
-    if (epicsMutexLock(plc->lock) != epicsMutexLockOK)
-    {
-        EIP_printf_time(1, "drvEtherIP scan task for PLC '%s'"
-                   " cannot take plc->lock\n", plc->name);
-        return;
+scan_loop: /* --------- The Scan Loop for one session -------- */
+    epicsMutexLock(session->lock);
+    if (!assert_Session_connect(session))
+    {   /* Wait until the next attempt, or until restarted */
+        epicsTimeGetCurrent(&start_time);
+        delay = epicsTimeDiffInSeconds(&session->next_connect, &start_time);
+        epicsMutexUnlock(session->lock);
+        EIP_printf_time(2, "drvEtherIP: PLC '%s' session %u is disconnected\n",
+                        session->plc->name, (unsigned)session->index);
+        if (delay < EIP_MIN_TIMEOUT)
+            delay = EIP_MIN_TIMEOUT;
+        epicsEventWaitWithTimeout(session->write_event, delay);
+        goto scan_loop;
     }
-    if (!assert_PLC_connect(plc))
-    {   /* don't rush since connection takes network bandwidth */
-        epicsMutexUnlock(plc->lock);
-        EIP_printf_time(2, "drvEtherIP: PLC '%s' is disconnected\n", plc->name);
-        epicsThreadSleep(timeout);
+    EIP_printf_time(10, "drvEtherIP scan PLC '%s' session %u\n",
+                    session->plc->name, (unsigned)session->index);
+    if (! process_WriteQueue(session, &holdoff))
+    {
+        fail_Session(session);
+        epicsMutexUnlock(session->lock);
         goto scan_loop;
     }
-    EIP_printf_time(10, "drvEtherIP scan PLC '%s'\n", plc->name);
     reset_next_schedule = true;
+    ++session->scan_runs;
     epicsTimeGetCurrent(&start_time);
-    for (list = DLL_first(ScanList,&plc->scanlists);
-         list;  list = DLL_next(ScanList,list))
+    first = session->next_scanned ? session->next_scanned : session->plc;
+    session->next_scanned = first->next_shared;
+    plc = first;
+    do
     {
-        if (! list->enabled)
-            continue;
-        if (epicsTimeLessThanEqual(&list->scheduled_time, &start_time))
+        if (! lock_scanned_PLC(session, plc))
         {
+            epicsMutexUnlock(session->lock);
+            return;
+        }
+        while ((list = next_due_ScanList(session, plc, &start_time)) != 0)
+        {
+            list->scan_run = session->scan_runs;
             epicsTimeGetCurrent(&list->scan_time);
-            transfer_ok = process_ScanList(plc->connection, list);
+            if (list->scheduled_time.secPastEpoch > 0)
+            {   /* Not the first scan after reset */
+                late = epicsTimeDiffInSeconds(&list->scan_time,
+                                              &list->scheduled_time);
+                drvEtherIP_histogram_add(&list->late_hist, late);
+                drvEtherIP_histogram_add(&plc->late_hist, late);
+            }
+            transfer_ok = process_ScanList(session, list);
             epicsTimeGetCurrent(&end_time);
             list->last_scan_time =
                 epicsTimeDiffInSeconds(&end_time, &list->scan_time);
+            drvEtherIP_histogram_add(&list->scan_time_hist,
+                                     list->last_scan_time);
+            drvEtherIP_histogram_add(&plc->scan_time_hist,
+                                     list->last_scan_time);
             /* update statistics */
             if (list->last_scan_time > list->max_scan_time)
                 list->max_scan_time = list->last_scan_time;
@@ -880,25 +2351,40 @@ scan_loop: /* --------- The Scan Loop for one PLC -------- */
                 epicsTimeAddSeconds(&list->scheduled_time, list->period);
             }
             else
-            {  	/* end_time+fixed delay, ignore extra due to error */
+            {  	/* end_time+fixed delay, ignore extra due to error.
+                 * Not the adaptive read timeout, which may be short,
+                 * to give a PLC that's slow time to recover */
                 list->scheduled_time = end_time;
-                epicsTimeAddSeconds(&list->scheduled_time, timeout);
+                epicsTimeAddSeconds(&list->scheduled_time, EIP_TIMEOUT/1000.0);
                 ++list->list_errors;
                 ++plc->plc_errors;
-                disconnect_PLC(plc);
-                epicsMutexUnlock(plc->lock);
+                unlock_scanned_PLC(session, plc);
+                fail_Session(session);
+                epicsMutexUnlock(session->lock);
                 goto scan_loop;
             }
         }
-        /* Update time for list that's due next */
-        if (reset_next_schedule ||
-            epicsTimeLessThan(&list->scheduled_time, &next_schedule))
+        for (list = DLL_first(ScanList,&plc->scanlists);
+             list;  list = DLL_next(ScanList,list))
         {
-            reset_next_schedule = false;
-            next_schedule = list->scheduled_time;
+            if (! list->enabled  ||  list->session != session)
+                continue;
+            /* Update time for list that's due next */
+            if (reset_next_schedule ||
+                epicsTimeLessThan(&list->scheduled_time, &next_schedule))
+            {
+                reset_next_schedule = false;
+                next_schedule = list->scheduled_time;
+            }
         }
+        unlock_scanned_PLC(session, plc);
+        plc = next_scanned_PLC(session, plc);
     }
-    epicsMutexUnlock(plc->lock);
+    while (plc != first);
+    /* Run without errors: Connection works, reset backoff */
+    session->connect_failures = 0;
+    session->reconnect_delay = 0.0;
+    epicsMutexUnlock(session->lock);
     /* fallback for empty/degenerate scan list */
     if (reset_next_schedule)
         delay = EIP_MIN_TIMEOUT;
@@ -929,19 +2415,22 @@ scan_loop: /* --------- The Scan Loop for one PLC -------- */
             ++list->sched_errors;
         }
     }
-    /* Sleep until next turn. */
+    /* Don't sleep past the end of a write holdoff */
+    if (holdoff > 0.0  &&  holdoff < delay)
+        delay = holdoff;
+    /* Sleep until next turn, or until a write is requested */
     if (delay > 0.0)
-        epicsThreadSleep(delay);
+        epicsEventWaitWithTimeout(session->write_event, delay);
     else if (delay <= -quantum)
     {
         EIP_printf(8, "drvEtherIP scan task slow, %g sec delay\n", delay);
-        ++plc->slow_scans; /* hmm, "plc" not locked... */
+        ++session->plc->slow_scans; /* hmm, "plc" not locked... */
     }
     goto scan_loop;
 }
 
-/* Find PLC entry by name, maybe create a new one if not found */
-static PLC *get_PLC(const char *name, eip_bool create)
+/* Find PLC entry by name */
+static PLC *get_PLC(const char *name)
 {
     PLC *plc;
     for (plc = DLL_first(PLC,&drvEtherIP_private.PLCs);  plc;
@@ -950,12 +2439,21 @@ static PLC *get_PLC(const char *name, eip_bool create)
         if (strcmp(plc->name, name) == 0)
             return plc;
     }
-    if (! create)
-        return 0;
-    plc = new_PLC(name);
-    if (plc)
-        DLL_append(&drvEtherIP_private.PLCs, plc);
-    return plc;
+    return 0;
+}
+
+/* Find PLC that owns the sessions to an IP address */
+static PLC *get_gateway_PLC(const char *ip_addr)
+{
+    PLC *plc;
+    for (plc = DLL_first(PLC,&drvEtherIP_private.PLCs);  plc;
+         plc = DLL_next(PLC,plc))
+    {
+        if (plc->ip_addr  &&  strcmp(plc->ip_addr, ip_addr) == 0  &&
+            plc->sessions->plc == plc)
+            return plc;
+    }
+    return 0;
 }
 
 /* get (or create) ScanList for given rate */
@@ -1013,6 +2511,11 @@ void drvEtherIP_init ()
     drvEtherIP_private.lock = epicsMutexCreate();
     if (! drvEtherIP_private.lock)
         EIP_printf (0, "drvEtherIP_init cannot create mutex!\n");
+#ifndef EIP_TRACE_ATOMIC
+    trace_lock = epicsMutexCreate();
+    if (! trace_lock)
+        EIP_printf (0, "drvEtherIP_init cannot create trace mutex!\n");
+#endif
     DLL_init (&drvEtherIP_private.PLCs);
     drvEtherIP_Register();
 }
@@ -1032,8 +2535,23 @@ void drvEtherIP_help()
     printf("        1: show severe error messages\n");
 	printf("        0: keep quiet\n");
     printf("    EIP_timeout(<milliseconds>)\n");
-    printf("    -  define the default timeout for connecting to PLC and reading responses\n");
+    printf("    -  define the timeout for connecting to PLC, also the limit for reading responses\n");
     printf("       (default: %d ms)\n", EIP_TIMEOUT);
+    printf("    EIP_timeout_floor(<milliseconds>)\n");
+    printf("    -  minimum timeout for reading responses.\n");
+    printf("       Read timeouts follow the measured round trip times,\n");
+    printf("       between this floor and EIP_timeout. 0 to always use EIP_timeout.\n");
+    printf("       (default: 1000 ms, currently %d ms)\n", EIP_TIMEOUT_FLOOR);
+    printf("    EIP_write_holdoff(<milliseconds>)\n");
+    printf("    -  minimum time between sending queued writes.\n");
+    printf("       Writes requested meanwhile are coalesced, only the latest value is sent.\n");
+    printf("       (default: 0 ms, currently %d ms)\n", EIP_WRITE_HOLDOFF);
+    printf("    EIP_capture(<file.pcap>)\n");
+    printf("    -  write all messages to/from PLCs into pcap file,\n");
+    printf("       for example to inspect with Wireshark. \"\" to stop.\n");
+    printf("    EIP_replay(<file.pcap>)\n");
+    printf("    -  PLCs connected from now on use the responses\n");
+    printf("       recorded in pcap file instead of the network. \"\" to stop.\n");
     printf("    drvEtherIP_default_rate(<seconds>)\n");
     printf("    -  define the default scan rate\n");
     printf("       (if neither SCAN nor INP/OUT provide one)\n");
@@ -1042,9 +2560,18 @@ void drvEtherIP_help()
     printf("       Currently %d, default: %d\n", EIP_buffer_limit, EIP_DEFAULT_BUFFER_LIMIT);
     printf("       The actual PLC limit is unknown, it might depend on the PLC or ENET model.\n");
     printf("       Can only be set before driver starts up.\n");
-    printf("    drvEtherIP_define_PLC(<name>, <ip_addr>, <slot>)\n");
+    printf("    EIP_buffer_probe(<0|1>)\n");
+    printf("    -  probe for a larger buffer limit when first connecting to a PLC,\n");
+    printf("       starting from EIP_buffer_limit. Currently %d, default: 1\n", EIP_buffer_probe);
+    printf("    drvEtherIP_define_PLC(<name>, <ip_addr>, <slot>, <sessions>)\n");
     printf("    -  define a PLC name (used by EPICS records) as IP\n");
-    printf("       (DNS name or dot-notation) and slot (0...)\n");
+    printf("       (DNS name or dot-notation), slot (0...)\n");
+    printf("       and number of parallel sessions (default: 1).\n");
+    printf("       PLCs with the same IP share the sessions of the first one.\n");
+    printf("    drvEtherIP_limit_rate(<name>, <packets/s>, <bytes/s>)\n");
+    printf("    -  limit the transfers to a PLC, 0 for no limit (default).\n");
+    printf("       Transfers are also throttled while the PLC appears busy.\n");
+    printf("       PLCs with the same IP share one limit.\n");
     printf("    drvEtherIP_read_tag(<ip>, <slot>, <tag>, <elm.>, <timeout>)\n");
     printf("    -  call to test a round-trip single tag read\n");
     printf("       ip: IP address (numbers or name known by IOC\n");
@@ -1058,8 +2585,11 @@ void drvEtherIP_help()
     printf("    -  list all tags that the PLC publishes\n");
     printf("    drvEtherIP_describe(<type ID>)\n");
     printf("    -  describe the tag type, used to inspect custom structures\n");
+    printf("    drvEtherIP_trace(<PLC>, <count>)\n");
+    printf("    -  show last protocol events (send, receive, timeout, ...)\n");
+    printf("       of PLC, or of all PLCs for \"\". Default count: 20\n");
     printf("    drvEtherIP_reset_statistics\n");
-    printf("    -  reset error counts and min/max scan times\n");
+    printf("    -  reset error counts, min/max scan times and histograms\n");
     printf("    drvEtherIP_restart\n");
     printf("    -  in case of communication errors, driver will restart,\n");
     printf("       so calling this one directly shouldn't be necessary\n");
@@ -1071,6 +2601,8 @@ void drvEtherIP_help()
 long drvEtherIP_report(int level)
 {
     PLC *plc;
+    Session *session;
+    size_t i;
     EIPIdentityInfo *ident;
     ScanList *list;
     epicsTimeStamp now;
@@ -1098,7 +2630,7 @@ long drvEtherIP_report(int level)
         printf ("* PLC '%s', IP '%s'\n", plc->name, plc->ip_addr);
         if (level > 1)
         {
-            ident = &plc->connection->info;
+            ident = &plc->sessions[0].connection->info;
             printf("  Interface name        : %s\n", ident->name);
             printf("  Interface vendor      : 0x%X\n", ident->vendor);
             printf("  Interface type        : 0x%X\n", ident->device_type);
@@ -1106,26 +2638,75 @@ long drvEtherIP_report(int level)
             printf("  Interface serial      : 0x%X\n",
                    (unsigned)ident->serial_number);
 
+            printf("  sessions              : %u\n",
+                   (unsigned)plc->session_count);
+            if (plc->sessions->plc != plc)
+                printf("  sessions shared with  : PLC '%s'\n",
+                       plc->sessions->plc->name);
+            for (i=0; i<plc->session_count; ++i)
+            {
+                session = &plc->sessions[i];
+                if (session->state == SESSION_CONNECTED)
+                    printf("  session %2u            : connected, round trip"
+                           " %.2f ms, read timeout %u ms, buffer limit %u%s\n",
+                           (unsigned) i,
+                           session->connection->srtt*1000.0,
+                           (unsigned) EIP_read_timeout(session->connection),
+                           (unsigned) session->connection->transfer_buffer_limit,
+                           session->connection->probed_buffer_limit ?
+                           " (probed)" : "");
+                else
+                    printf("  session %2u            : %s, %u failed attempts,"
+                           " retry delay %.1f secs\n", (unsigned) i,
+                           session->state == SESSION_CONNECTING ?
+                           "connecting" : "disconnected",
+                           (unsigned) session->connect_failures,
+                           session->reconnect_delay);
+            }
             printf("  scan thread slow count: %u\n", (unsigned)plc->slow_scans);
             printf("  connection errors     : %u\n", (unsigned)plc->plc_errors);
+            printf("  refused tag reads     : %u\n", (unsigned)plc->tag_errors);
+            if (plc->rate->packet_rate > 0.0  ||  plc->rate->byte_rate > 0.0)
+                printf("  rate limit            : %g packets/s, %g bytes/s\n",
+                       plc->rate->packet_rate, plc->rate->byte_rate);
+            printf("  rate factor           : %.2f, throttled %u times\n",
+                   plc->rate->factor, (unsigned)plc->rate->throttles);
+            printf("  rate delays           : %u, %g secs\n",
+                   (unsigned)plc->rate->delays, plc->rate->delay_time);
+            printf("  writes sent/coalesced : %u / %u\n",
+                   (unsigned)plc->writes_sent, (unsigned)plc->writes_coalesced);
+            printf("  tag memory / replaced : %u / %u bytes\n",
+                   (unsigned)plc->arena.size, (unsigned)plc->arena.replaced);
+            dump_Histogram("scan times            ", &plc->scan_time_hist);
+            dump_Histogram("round trips           ", &plc->rtt_hist);
+            dump_Histogram("late starts           ", &plc->late_hist);
+            dump_ScanPhases("scan phases           ", &plc->phases);
+            printf("  scan task held lock   : %g secs\n", plc->lock_time);
         }
         if (level > 2)
         {
             printf("  Mutex lock            : 0x%lX\n",
                    (unsigned long)plc->lock);
-            printf("  scan task ID          : 0x%lX (%s)\n",
-                   (unsigned long) plc->scan_task_id,
-                   (plc->scan_task_id==0 ? "-dead-" :
-                    epicsThreadIsSuspended(plc->scan_task_id)!=0 ? "suspended":
-                    "running"));
+            for (i=0; i<plc->session_count; ++i)
+            {
+                session = &plc->sessions[i];
+                printf("  scan task ID %2u       : 0x%lX (%s)\n",
+                       (unsigned) i, (unsigned long) session->scan_task_id,
+                       (session->scan_task_id==0 ? "-dead-" :
+                        epicsThreadIsSuspended(session->scan_task_id)!=0 ?
+                        "suspended" : "running"));
+            }
             epicsTimeGetCurrent(&now);
             epicsTimeToStrftime(tsString, sizeof(tsString),
                                 "%Y/%m/%d %H:%M:%S.%04f", &now);
             printf("  Now                   : %s\n", tsString);
             if (level > 3)
             {
-                printf("** ");
-                EIP_dump_connection(plc->connection);
+                for (i=0; i<plc->session_count; ++i)
+                {
+                    printf("** Session %u: ", (unsigned) i);
+                    EIP_dump_connection(plc->sessions[i].connection);
+                }
             }
             if (level > 4)
             {
@@ -1183,11 +2764,36 @@ void drvEtherIP_list()
     for (plc = DLL_first(PLC,&drvEtherIP_private.PLCs);
          plc;  plc=DLL_next(PLC,plc))
     {
+        epicsMutexLock(plc->sessions[0].lock);
         epicsMutexLock(plc->lock);
         printf ("Tags on PLC '%s', IP %s, slot %d\n",
                 plc->name, plc->ip_addr, plc->slot);
-        EIP_list_tags(plc->connection);
+        if (plc->sessions[0].state == SESSION_CONNECTED)
+            EIP_list_tags(route_Session(&plc->sessions[0], plc));
+        else
+            printf("  - not connected -\n");
         epicsMutexUnlock(plc->lock);
+        epicsMutexUnlock(plc->sessions[0].lock);
+    }
+    epicsMutexUnlock(drvEtherIP_private.lock);
+}
+
+/* Reads the trace without taking plc->lock,
+ * so it doesn't delay the scan task */
+void drvEtherIP_trace(const char *PLC_name, int count)
+{
+    PLC      *plc;
+
+    if (count <= 0)
+        count = 20;
+    epicsMutexLock(drvEtherIP_private.lock);
+    for (plc = DLL_first(PLC,&drvEtherIP_private.PLCs);
+         plc;  plc=DLL_next(PLC,plc))
+    {
+        if (PLC_name  &&  *PLC_name  &&  strcmp(plc->name, PLC_name))
+            continue;
+        printf ("Trace of PLC '%s', IP %s:\n", plc->name, plc->ip_addr);
+        dump_Trace(&plc->trace, count, plc->session_count > 1);
     }
     epicsMutexUnlock(drvEtherIP_private.lock);
 }
@@ -1200,9 +2806,14 @@ void drvEtherIP_describe(unsigned type_id)
     for (plc = DLL_first(PLC,&drvEtherIP_private.PLCs);
          plc;  plc=DLL_next(PLC,plc))
     {
+        epicsMutexLock(plc->sessions[0].lock);
         epicsMutexLock(plc->lock);
-        EIP_describe_type(plc->connection, type_id);
+        if (plc->sessions[0].state == SESSION_CONNECTED)
+            EIP_describe_type(route_Session(&plc->sessions[0], plc), type_id);
+        else
+            printf("PLC '%s' is not connected\n", plc->name);
         epicsMutexUnlock(plc->lock);
+        epicsMutexUnlock(plc->sessions[0].lock);
     }
     epicsMutexUnlock(drvEtherIP_private.lock);
 }
@@ -1218,7 +2829,20 @@ void drvEtherIP_reset_statistics ()
     {
         epicsMutexLock(plc->lock);
         plc->plc_errors = 0;
+        plc->tag_errors = 0;
         plc->slow_scans = 0;
+        plc->writes_sent = 0;
+        memset(&plc->scan_time_hist, 0, sizeof(Histogram));
+        memset(&plc->rtt_hist,       0, sizeof(Histogram));
+        memset(&plc->late_hist,      0, sizeof(Histogram));
+        memset(&plc->phases,         0, sizeof(ScanPhases));
+        plc->lock_time = 0.0;
+        epicsMutexLock(plc->write_lock);
+        plc->rate->throttles = 0;
+        plc->rate->delays = 0;
+        plc->rate->delay_time = 0.0;
+        plc->writes_coalesced = 0;
+        epicsMutexUnlock(plc->write_lock);
         for (list=DLL_first(ScanList, &plc->scanlists); list;
              list=DLL_next(ScanList, list))
             reset_ScanList (list);
@@ -1230,14 +2854,55 @@ void drvEtherIP_reset_statistics ()
 /* Create a PLC entry:
  * name : identifier
  * ip_address: DNS name or dot-notation
+ * sessions: number of parallel connections, 0 for default of 1
+ *
+ * A PLC in another slot behind an IP address that's already used
+ * by a PLC shares the sessions of that first PLC.
  */
 eip_bool drvEtherIP_define_PLC(const char *PLC_name,
-                               const char *ip_addr, int slot)
+                               const char *ip_addr, int slot, int sessions)
 {
-    PLC *plc;
+    PLC *plc, *gateway;
 
+    if (sessions <= 0)
+        sessions = 1;
+    if (sessions > EIP_MAX_SESSIONS)
+    {
+        EIP_printf(1, "PLC %s: Limiting %d sessions to %d\n",
+                   PLC_name, sessions, EIP_MAX_SESSIONS);
+        sessions = EIP_MAX_SESSIONS;
+    }
     epicsMutexLock(drvEtherIP_private.lock);
-    plc = get_PLC(PLC_name, true);
+    plc = get_PLC(PLC_name);
+    if (plc)
+    {
+        if (plc->next_shared  ||  plc->sessions->plc != plc)
+        {
+            EIP_printf(1, "PLC %s shares its sessions, cannot redefine it\n",
+                       PLC_name);
+            epicsMutexUnlock(drvEtherIP_private.lock);
+            return false;
+        }
+        if (plc->session_count != (size_t) sessions)
+            EIP_printf(1, "PLC %s keeps its %u sessions\n",
+                       PLC_name, (unsigned) plc->session_count);
+    }
+    else
+    {
+        gateway = get_gateway_PLC(ip_addr);
+        if (gateway)
+        {
+            EIP_printf(4, "PLC %s shares the sessions of PLC %s\n",
+                       PLC_name, gateway->name);
+            if (gateway->session_count != (size_t) sessions)
+                EIP_printf(1, "PLC %s uses the %u sessions of PLC %s\n",
+                           PLC_name, (unsigned) gateway->session_count,
+                           gateway->name);
+        }
+        plc = new_PLC(PLC_name, sessions, gateway);
+        if (plc)
+            DLL_append(&drvEtherIP_private.PLCs, plc);
+    }
     if (plc)
     {
     	if (plc->ip_addr)
@@ -1258,11 +2923,33 @@ PLC *drvEtherIP_find_PLC (const char *PLC_name)
     PLC *plc;
 
     epicsMutexLock(drvEtherIP_private.lock);
-    plc = get_PLC(PLC_name, /*create*/ false);
+    plc = get_PLC(PLC_name);
     epicsMutexUnlock (drvEtherIP_private.lock);
     return plc;
 }
 
+/* Limit the transfers to a PLC, 0 for no limit.
+ * PLCs with the same IP share the limit of the first one */
+eip_bool drvEtherIP_limit_rate(const char *PLC_name,
+                               double packets, double bytes)
+{
+    PLC *plc = PLC_name ? drvEtherIP_find_PLC(PLC_name) : 0;
+
+    if (! plc)
+    {
+        EIP_printf(1, "drvEtherIP_limit_rate: Unknown PLC '%s'\n",
+                   PLC_name ? PLC_name : "");
+        return false;
+    }
+    epicsMutexLock(plc->write_lock);
+    plc->rate->packet_rate = packets > 0.0 ? packets : 0.0;
+    plc->rate->byte_rate = bytes > 0.0 ? bytes : 0.0;
+    plc->rate->packets = plc->rate->bytes = 0.0;
+    plc->rate->refilled = 0.0;
+    epicsMutexUnlock(plc->write_lock);
+    return true;
+}
+
 /* After the PLC is defined with drvEtherIP_define_PLC,
  * tags can be added
  */
@@ -1330,6 +3017,105 @@ void  drvEtherIP_add_callback (PLC *plc, TagInfo *info,
     epicsMutexUnlock(plc->lock);
 }
 
+/* Put tag on write queue unless it's already there
+ * and wake scan task.
+ * Caller holds the data_lock, 'coalesced' tells
+ * if a pending write was replaced.
+ */
+static void queue_write(PLC *plc, TagInfo *info, eip_bool coalesced)
+{
+    Session  *session = info->scanlist->session;
+    eip_bool wakeup = false;
+
+    epicsMutexLock(plc->write_lock);
+    if (coalesced)
+    {   /* Driver didn't pick up the previous value, replace it */
+        EIP_printf(6, "'%s': coalescing write\n", info->string_tag);
+        ++plc->writes_coalesced;
+    }
+    if (! info->write_queued)
+    {
+        enqueue_write(info);
+        wakeup = true;
+    }
+    epicsMutexUnlock(plc->write_lock);
+    if (wakeup)
+        epicsEventSignal(session->write_event);
+}
+
+void drvEtherIP_request_write(PLC *plc, TagInfo *info)
+{
+    drvEtherIP_request_element_write(plc, info, 0, info->elements);
+}
+
+void drvEtherIP_request_element_write(PLC *plc, TagInfo *info,
+                                      size_t element, size_t count)
+{
+    eip_bool coalesced = info->do_write || info->do_rmw;
+    size_t   last = element + (count > 0 ? count-1 : 0);
+
+    if (! info->do_write)
+    {
+        info->dirty_first = element;
+        info->dirty_last  = last;
+    }
+    else
+    {   /* Merge with pending range */
+        if (element < info->dirty_first)
+            info->dirty_first = element;
+        if (last > info->dirty_last)
+            info->dirty_last = last;
+    }
+    info->do_write = true;
+    /* Full write includes all bits */
+    info->do_rmw = false;
+    info->rmw_or_mask = 0;
+    info->rmw_and_mask = ~(CN_UDINT)0;
+    queue_write(plc, info, coalesced);
+}
+
+void drvEtherIP_request_bit_write(PLC *plc, TagInfo *info, size_t element,
+                                  CN_UDINT set_bits, CN_UDINT clear_bits)
+{
+    size_t   mask_size, index = element;
+    eip_bool coalesced;
+
+    /* BOOL arrays are read as UDINTs, but the path
+     * addresses bits, so the index is the first bit of the UDINT */
+    if (get_CIP_typecode(info->data) == T_CIP_BITS)
+        index = 32*element;
+    switch (get_CIP_typecode(info->data))
+    {
+    case T_CIP_SINT:
+    case T_CIP_INT:
+    case T_CIP_DINT:
+    case T_CIP_BITS:
+        mask_size = CIP_Type_size(get_CIP_typecode(info->data));
+        break;
+    default: /* BOOL, LINT, ...: write the element(s) */
+        mask_size = 0;
+    }
+    if ((info->do_rmw || info->is_rmw)  &&  info->rmw_element != index)
+    {   /* Pending bits in other element: write all */
+        drvEtherIP_request_write(plc, info);
+        return;
+    }
+    if (info->no_rmw  ||  info->do_write  ||  mask_size == 0)
+    {   /* Can't handle as read-modify-write, write the element */
+        drvEtherIP_request_element_write(plc, info, element, 1);
+        return;
+    }
+    coalesced = info->do_rmw;
+    info->rmw_element   = index;
+    info->rmw_indexed   = element > 0  ||  info->elements > 1  ||
+                          get_CIP_typecode(info->data) == T_CIP_BITS;
+    info->rmw_mask_size = mask_size;
+    info->rmw_or_mask   = (info->rmw_or_mask  | set_bits) & ~clear_bits;
+    info->rmw_and_mask  = (info->rmw_and_mask | set_bits) & ~clear_bits;
+    info->do_rmw = true;
+    queue_write(plc, info, coalesced);
+}
+
 void drvEtherIP_remove_callback (PLC *plc, TagInfo *info,
                                  EIPCallback callback, void *arg)
 {
@@ -1350,15 +3136,16 @@ void drvEtherIP_remove_callback (PLC *plc, TagInfo *info,
 
 
 /* (Re-)connect to IOC,
- * (Re-)start scan tasks, one per PLC.
+ * (Re-)start scan tasks, one per PLC session.
  * Returns number of tasks spawned.
  */
 int drvEtherIP_restart()
 {
-    PLC    *plc;
-    char   taskname[20];
-    int    tasks = 0;
-    size_t len;
+    PLC     *plc;
+    Session *session;
+    char    taskname[20];
+    int     tasks = 0;
+    size_t  i, running;
 
     if (drvEtherIP_private.lock == 0) return 0;
     epicsMutexLock(drvEtherIP_private.lock);
@@ -1380,33 +3167,50 @@ int drvEtherIP_restart()
     for (plc = DLL_first(PLC,&drvEtherIP_private.PLCs);
          plc;  plc = DLL_next(PLC,plc))
     {
-        /* block scan task (if running): */
-        epicsMutexLock(plc->lock);
-        /* restart the connection:
-         * disconnect, PLC_scan_task will reconnect */
-        disconnect_PLC(plc);
-        /* check the scan task */
-        if (plc->scan_task_id==0)
+        /* PLCs that share the sessions of another one are handled by it */
+        if (plc->sessions->plc != plc)
+            continue;
+        /* Before the first launch, balance scanlists across sessions.
+         * No scan task uses them, yet, and the records
+         * have added their tags during iocInit */
+        running = 0;
+        for (i=0; i<plc->session_count; ++i)
+            if (plc->sessions[i].scan_task_id)
+                ++running;
+        if (running == 0)
+            assign_ScanList_Sessions(plc);
+        for (i=0; i<plc->session_count; ++i)
         {
-            len = strlen(plc->name);
-            if (len > 16)
-                len = 16;
-            taskname[0] = 'E';
-            taskname[1] = 'I';
-            taskname[2] = 'P';
-            memcpy(&taskname[3], plc->name, len);
-            taskname[len+3] = '\0';
-            plc->scan_task_id = epicsThreadCreate(
-              taskname,
-              epicsThreadPriorityHigh,
-              epicsThreadGetStackSize(epicsThreadStackMedium),
-              (EPICSTHREADFUNC)PLC_scan_task,
-              (void *)plc);
-            EIP_printf(5, "drvEtherIP: launch scan task for PLC '%s'\n",
-                       plc->name);
-            ++tasks;
+            session = &plc->sessions[i];
+            /* block scan task (if running): */
+            epicsMutexLock(session->lock);
+            /* restart the connection:
+             * disconnect, PLC_scan_task will reconnect right away.
+             * A session that's connecting is left to its scan task */
+            if (session->state != SESSION_CONNECTING)
+                disconnect_Session(session);
+            session->reconnect_delay = 0.0;
+            epicsTimeGetCurrent(&session->next_connect);
+            epicsEventSignal(session->write_event);
+            /* check the scan task */
+            if (session->scan_task_id==0)
+            {
+                if (plc->session_count > 1)
+                    sprintf(taskname, "EIP%.12s.%u", plc->name, (unsigned) i);
+                else
+                    sprintf(taskname, "EIP%.16s", plc->name);
+                session->scan_task_id = epicsThreadCreate(
+                  taskname,
+                  epicsThreadPriorityHigh,
+                  epicsThreadGetStackSize(epicsThreadStackMedium),
+                  (EPICSTHREADFUNC)PLC_scan_task,
+                  (void *)session);
+                EIP_printf(5, "drvEtherIP: launch scan task for PLC '%s' "
+                           "session %u\n", plc->name, (unsigned) i);
+                ++tasks;
+            }
+            epicsMutexUnlock(session->lock);
         }
-        epicsMutexUnlock(plc->lock);
     }
     epicsMutexUnlock(drvEtherIP_private.lock);
     return tasks;
@@ -17,21 +17,233 @@
 #include "dl_list.h"
 
 #define ETHERIP_MAYOR 3
-#define ETHERIP_MINOR 10
+#define ETHERIP_MINOR 11
 
 /* For timing */
 #define EIP_MIN_TIMEOUT         0.1  /* second */
 #define EIP_MIN_CONN_TIMEOUT    1.0  /* second */
 
+/* Delay before reconnecting after a failed connection
+ * or a failed transfer:
+ * Starts at EIP_RECONNECT_DELAY, doubles with each failure
+ * up to EIP_MAX_RECONNECT_DELAY, and is randomly shortened
+ * by up to half so that IOCs don't reconnect in lockstep */
+#define EIP_RECONNECT_DELAY     1.0  /* second */
+#define EIP_MAX_RECONNECT_DELAY 60.0 /* second */
+
+/* A tag that the PLC refuses to read is skipped by its scanlist
+ * for EIP_QUARANTINE_DELAY, doubling with each failure in a row
+ * up to EIP_MAX_QUARANTINE_DELAY, while other tags are still read */
+#define EIP_QUARANTINE_DELAY     1.0  /* second */
+#define EIP_MAX_QUARANTINE_DELAY 60.0 /* second */
+
+/* Transfers to a PLC may be limited to packets and bytes per second,
+ * allowing bursts of EIP_RATE_BURST worth.
+ * When EIP_SLOW_TRANSFERS round trips in a row take EIP_SLOW_RTT
+ * times longer than usual or the PLC reports that it lacks resources,
+ * the transfers are throttled by halving the rate factor,
+ * at most once per EIP_RATE_HOLDOFF and down to EIP_MIN_RATE_FACTOR.
+ * Each normal transfer adds EIP_RATE_RECOVERY to the factor */
+#define EIP_RATE_BURST          0.1  /* second */
+#define EIP_RATE_HOLDOFF        0.5  /* second */
+#define EIP_SLOW_RTT            4.0
+#define EIP_SLOW_TRANSFERS      2
+#define EIP_MIN_RATE_FACTOR     (1.0/16)
+#define EIP_RATE_RECOVERY       0.01
+
 /* TCP port */
 #define ETHERIP_PORT 0xAF12
 
 /* TCP timeout in millisec for connection and readback */
 extern int EIP_TIMEOUT;
 
+/* Minimum timeout in millisec for readback.
+ * Read timeouts follow the measured round trip times,
+ * between EIP_TIMEOUT_FLOOR and EIP_TIMEOUT. 0 to always use EIP_TIMEOUT */
+extern int EIP_TIMEOUT_FLOOR;
+
+/* Minimum time in millisec between two flushes of the write queue.
+ * Writes requested meanwhile are coalesced, 0 to write right away */
+extern int EIP_WRITE_HOLDOFF;
+
+/* Maximum number of sessions per PLC */
+#define EIP_MAX_SESSIONS 16
+
 typedef struct __TagInfo  TagInfo;  /* forwards */
 typedef struct __ScanList ScanList;
 typedef struct __PLC      PLC;
+typedef struct __ArenaChunk ArenaChunk;
+
+/* Arena:
+ * Memory for TagInfos, tag names and tag data of one PLC.
+ * Those are never freed one by one, so they are placed
+ * one after the other into large chunks.
+ * Tags created in sequence and their data thus end up
+ * next to each other in memory.
+ * Guarded by the PLC.lock.
+ */
+typedef struct
+{
+    ArenaChunk *chunk;      /* current chunk, links to previous ones */
+    size_t     used;        /* bytes used in current chunk */
+    size_t     size;        /* bytes in all chunks */
+    size_t     replaced;    /* bytes of data buffers that had to grow */
+}   Arena;
+
+/* Histogram:
+ * Counts of times in log-scale bins.
+ * Bin 0 counts times below EIP_HISTOGRAM_MIN seconds,
+ * bin i counts times up to EIP_HISTOGRAM_MIN * 2^i,
+ * the last bin also counts anything longer.
+ * Updated by the scan task, guarded by the PLC.lock.
+ */
+#define EIP_HISTOGRAM_BINS 24
+#define EIP_HISTOGRAM_MIN  10e-6
+typedef struct
+{
+    size_t     count[EIP_HISTOGRAM_BINS];
+}   Histogram;
+
+/* ScanPhases:
+ * Where the scan task spends its time,
+ * running totals in seconds since the last reset.
+ * Updated by the scan task, guarded by the PLC.lock.
+ */
+typedef struct
+{
+    size_t     transfers;  /* MultiRequests sent */
+    double     plan;       /* sizing the MultiRequests */
+    double     encode;     /* building the requests */
+    double     send;       /* sending them */
+    double     wait;       /* waiting for and reading the response */
+    double     decode;     /* checking responses, copying data */
+    double     callbacks;  /* device support callbacks */
+}   ScanPhases;
+
+/* Trace:
+ * Ring of the latest protocol events of a PLC,
+ * for example to check the timing of transfers
+ * without the delays of printing every packet.
+ * Written by the scan tasks of the PLC's sessions, which may run
+ * in parallel, and by drvEtherIP_restart. Each writer reserves
+ * its own event by incrementing 'head' with epicsAtomic,
+ * or under a lock before R3.15, so there's no lock otherwise.
+ * Dumped by drvEtherIP_trace which checks 'seq'
+ * to skip events that were overwritten meanwhile.
+ */
+#define EIP_TRACE_SIZE 1024 /* events per PLC */
+typedef enum
+{
+    TRACE_SEND = 1,    /* MultiRequest sent */
+    TRACE_RECEIVE,     /* response received */
+    TRACE_TIMEOUT,     /* no response */
+    TRACE_ERROR,       /* failed to send, or invalid response */
+    TRACE_CONNECT,     /* connected, 'items' = 0 if that failed */
+    TRACE_DISCONNECT
+}   TraceType;
+
+typedef struct
+{
+    size_t         seq;     /* 1, 2, ... for n'th event, 0 while written */
+    epicsTimeStamp time;
+    TraceType      type;
+    size_t         session; /* index of PLC's session */
+    size_t         items;   /* requests in MultiRequest */
+    size_t         size;    /* bytes sent or received */
+    TransactionID  tid;
+}   TraceEvent;
+
+typedef struct
+{
+    size_t         head;    /* number of events written so far */
+    TraceEvent     events[EIP_TRACE_SIZE];
+}   Trace;
+
+/* TagView:
+ * The tags of a scanlist or of the detached write queue
+ * as arrays, so the scan task walks them by index.
+ * Only holds tags that can be read/written,
+ * with their read sizes next to each other.
+ * A scanlist's view is rebuilt after tags were added, moved,
+ * or their sizes determined.
+ * Guarded by the PLC.lock.
+ */
+typedef struct
+{
+    eip_bool   valid;           /* false: rebuild before use */
+    size_t     count;           /* tags in view */
+    size_t     capacity;        /* allocated array size */
+    TagInfo    **tags;
+    size_t     *r_request_size; /* copies of TagInfo.cip_r_request_size */
+    size_t     *r_response_size;/* and cip_r_response_size */
+}   TagView;
+
+typedef enum
+{
+    SESSION_DISCONNECTED, /* waiting to (re-)connect */
+    SESSION_CONNECTING,
+    SESSION_CONNECTED
+}   SessionState;
+
+/* Session:
+ * One of the EtherNet/IP sessions to a PLC,
+ * each with its own connection and scan task.
+ * The PLC's scanlists are distributed across its sessions.
+ * Tags are read and written via the session of their scanlist,
+ * so the transfers for one tag remain in order.
+ *
+ * Sessions belong to the first PLC defined for an IP address.
+ * PLCs in other slots behind the same IP address share them,
+ * see PLC.next_shared, and each request is routed to the slot
+ * of the PLC that it addresses.
+ */
+typedef struct
+{
+    PLC           *plc;         /* PLC that owns the session */
+    PLC           *next_scanned;/* PLC to scan first on next run, 0: plc */
+    size_t        index;        /* 0, 1, ... within PLC */
+    epicsMutexId  lock;         /* guards connection, see drvEtherIP.c */
+    EIPConnection *connection;
+    SessionState  state;
+    size_t        connect_failures; /* in a row */
+    double        reconnect_delay;  /* seconds, 0 once a scan run worked */
+    epicsTimeStamp next_connect; /* earliest time for next attempt */
+    CN_UDINT      random;       /* state of jitter generator */
+    size_t        scan_runs;    /* runs of the scan task so far */
+    epicsThreadId scan_task_id;
+    double        locked;       /* when scan task took the PLC.lock */
+    epicsEventId  write_event;  /* wakes scan task for queued writes   */
+    TagInfo       *write_queue; /* tags with pending writes, in order, */
+    TagInfo       *write_queue_tail; /* guarded by PLC.write_lock      */
+    epicsTimeStamp last_write_flush; /* when write_queue was last sent */
+    TagView       write_view;   /* detached write_queue, see TagView */
+}   Session;
+
+/* RateLimit:
+ * Token buckets for the transfers to a PLC
+ * and the throttle factor that reacts to a busy PLC.
+ * PLCs with the same IP address, i.e. the slots behind one
+ * ENET module, share its sessions and thus one RateLimit.
+ * Guarded by the PLC.write_lock.
+ */
+typedef struct
+{
+    double        packet_rate;  /* packets per second, 0: unlimited */
+    double        byte_rate;    /* bytes per second, 0: unlimited */
+    double        packets;      /* tokens, negative while in debt */
+    double        bytes;
+    double        factor;       /* 1: full rate, less while throttled */
+    double        measured;     /* packets per second, counted .. */
+    double        count_start;  /* .. since this phase_clock */
+    size_t        counted;
+    double        base_rate;    /* measured rate when throttling started */
+    double        refilled;     /* phase_clock of last refill */
+    double        throttled;    /* .. of last decrease of factor */
+    size_t        slow_transfers; /* in a row */
+    size_t        throttles;    /* Count: decreases of factor */
+    size_t        delays;       /* Count: transfers that had to wait */
+    double        delay_time;   /* seconds those waited */
+}   RateLimit;
 
 /* THE singleton main structure for this driver
  * Note that each PLC entry has it's own lock
@@ -52,7 +264,7 @@ typedef struct
  * in IOC startup file.
  *
  * Holds
- * - EIPConnection for ether_ip protocol routines
+ * - Sessions with EIPConnection for ether_ip protocol routines
  * - ScanList for this PLC, filled by device support
  */
 struct __PLC
@@ -63,10 +275,23 @@ struct __PLC
     char          *ip_addr;     /* IP or DNS name that IOC knows          */
     int           slot;         /* slot in ControlLogix Backplane: 0, ... */
     size_t        plc_errors;   /* # of communication errors              */
+    size_t        tag_errors;   /* # of tag reads refused by PLC          */
     size_t        slow_scans;   /* Count: scan task is getting late       */
-    EIPConnection *connection;
+    size_t        writes_sent;  /* Count: tag writes sent to PLC          */
+    size_t        writes_coalesced; /* Count: writes replaced by newer value */
+    Histogram     scan_time_hist; /* scan times of all scanlists */
+    Histogram     rtt_hist;     /* round trip of each MultiRequest */
+    Histogram     late_hist;    /* scanlist start after schedule */
+    ScanPhases    phases;       /* of all scanlists and writes */
+    double        lock_time;    /* seconds scan task held the lock */
+    Trace         trace;        /* recent protocol events */
+    RateLimit     *rate;        /* limits transfers to PLC's IP, shared */
+    size_t        session_count;
+    Session       *sessions;    /* session_count sessions, maybe shared */
+    PLC           *next_shared; /* next PLC that shares these sessions */
     DL_List       scanlists;    /* List of struct ScanList */
-    epicsThreadId scan_task_id;
+    epicsMutexId  write_lock;   /* guards sessions' write_queue, see drvEtherIP.c */
+    Arena         arena;        /* memory for tags, see Arena */
 };
 
 /* ScanList:
@@ -77,16 +302,23 @@ struct __ScanList
 {
     DLL_Node       node;
     PLC            *plc;            /* PLC to which this Scanlist belongs */
+    Session        *session;        /* .. and session that scans it */
     eip_bool       enabled;
     double         period;          /* scan period [secs]  */
     size_t         list_errors;     /* # of communication errors */
     size_t         sched_errors;    /* # of scheduling errors */
     epicsTimeStamp scan_time;       /* stamp of last run time */
     epicsTimeStamp scheduled_time;  /* stamp for next run time */
+    size_t         scan_run;        /* session's scan_runs when last scanned */
     double         min_scan_time;   /* statistics: scan time in seconds */
     double         max_scan_time;   /* minimum, maximum, */
     double         last_scan_time;  /* and most recent scan */
+    Histogram      scan_time_hist;  /* scan times */
+    Histogram      rtt_hist;        /* round trip of each MultiRequest */
+    Histogram      late_hist;       /* scan start after schedule */
+    ScanPhases     phases;          /* time spent per phase */
     DL_List        taginfos;        /* List of struct TagInfo */
+    TagView        view;            /* taginfos for scan task, see TagView */
 };
 
 typedef void (*EIPCallback) (void *arg);
@@ -129,9 +361,32 @@ struct __TagInfo
     size_t     valid_data_size;    /* used portion of data, 0 for "invalid" */
     eip_bool   do_write;           /* set by device, reset by driver */
     eip_bool   is_writing;         /* driver copy of do_write for cycle */
+    size_t     dirty_first;        /* do_write: first element to write, */
+    size_t     dirty_last;         /* last element to write */
+    size_t     write_first;        /* is_writing: range of elements */
+    size_t     write_count;        /* in this cycle's write request */
+    size_t     cip_w_this_request_size; /* byte-size of this cycle's write */
     CN_USINT   *data;              /* CIP data (type, raw data), with buffer capacity of data_size */
+    CN_USINT   inline_data[16];    /* 'data' for scalars, no extra buffer */
+    eip_bool   data_on_heap;       /* 'data' was calloc'ed, not in Arena */
     double     transfer_time;      /* time needed for last transfer */
     DL_List    callbacks;          /* TagCallbacks for new values&write done */
+    eip_bool   write_queued;       /* on PLC's write_queue? */
+    TagInfo    *next_write;        /* next TagInfo on PLC's write_queue */
+    eip_bool   do_rmw;             /* set by device: modify bits of one element */
+    eip_bool   is_rmw;             /* driver copy of do_rmw for cycle */
+    eip_bool   no_rmw;             /* PLC refused read-modify-write, use do_write */
+    eip_bool   rmw_indexed;        /* rmw_element needs array index in path */
+    size_t     rmw_element;        /* array index for read-modify-write */
+    size_t     rmw_mask_size;      /* bytes per mask, 1, 2 or 4 */
+    CN_UDINT   rmw_or_mask;        /* bits to set */
+    CN_UDINT   rmw_and_mask;       /* bits to keep, 0 bits are cleared */
+    CN_UDINT   rmw_sent_or_mask;   /* is_rmw: masks of the request */
+    CN_UDINT   rmw_sent_and_mask;  /* in progress, kept until its reply */
+    size_t     cip_rmw_request_size;/* byte-size of read-modify-write request */
+    size_t     read_errors;        /* failed reads in a row */
+    double     quarantine_delay;   /* secs, 0 when last read worked */
+    epicsTimeStamp quarantine_end; /* skip reads until then */
 };
 
 #ifdef __cplusplus
@@ -156,11 +411,16 @@ void drvEtherIP_describe(unsigned type_id);
 
 void drvEtherIP_reset_statistics();
 
+/* Define PLC with 'sessions' (1 when 0) parallel sessions */
 eip_bool drvEtherIP_define_PLC(const char *PLC_name,
-                           const char *ip_addr, int slot);
+                           const char *ip_addr, int slot, int sessions);
 
 PLC *drvEtherIP_find_PLC(const char *PLC_name);
 
+/* Limit transfers to PLC to packets and bytes per second, 0: unlimited */
+eip_bool drvEtherIP_limit_rate(const char *PLC_name,
+                               double packets, double bytes);
+
 TagInfo *drvEtherIP_add_tag(PLC *plc, double period,
                             const char *string_tag, size_t elements);
 /* Register callbacks for "received new data" and "finished the write".
@@ -172,8 +432,44 @@ void drvEtherIP_add_callback(PLC *plc, TagInfo *tag,
 void drvEtherIP_remove_callback(PLC *plc, TagInfo *tag,
                                 EIPCallback callback, void *arg);
 
+/* Device support changed the tag's data and wants it written.
+ * Sets do_write and wakes the PLC's scan task
+ * so that the write is sent right away,
+ * not on the next run of the tag's scanlist.
+ * Note: Caller must hold the tag's data_lock!
+ */
+void drvEtherIP_request_write(PLC *plc, TagInfo *tag);
+
+/* Like drvEtherIP_request_write, but device support only changed
+ * 'count' array elements starting at 'element'.
+ * Pending ranges are merged, and only the merged range is written.
+ */
+void drvEtherIP_request_element_write(PLC *plc, TagInfo *tag,
+                                      size_t element, size_t count);
+
+/* Device support changed bits within one element of the tag's data
+ * and wants those written.
+ * Uses the Logix Read-Modify-Write service, so only the given bits
+ * are sent and other bits of the element remain as they are in the PLC.
+ * Falls back to drvEtherIP_request_write when that's not possible.
+ * Note: Caller must hold the tag's data_lock!
+ */
+void drvEtherIP_request_bit_write(PLC *plc, TagInfo *tag, size_t element,
+                                  CN_UDINT set_bits, CN_UDINT clear_bits);
+
 int drvEtherIP_restart();
 
+/* Dump the last 'count' protocol events of a PLC (all PLCs for "") */
+void drvEtherIP_trace(const char *PLC_name, int count);
+
+/* Add time in seconds to histogram */
+void drvEtherIP_histogram_add(Histogram *hist, double seconds);
+
+/* Time below which the 'fraction' (0..1) of the histogram's
+ * times fall, i.e. upper limit of that bin. 0 if empty */
+double drvEtherIP_histogram_percentile(const Histogram *hist,
+                                       double fraction);
+
 /* Command-line communication test,
  * not used by the driver */
 int drvEtherIP_read_tag(const char *ip_addr,
@@ -35,6 +35,20 @@ static void EIP_timeoutCall(const iocshArgBuf * args) {
 	EIP_TIMEOUT = args[0].ival;
 }
 
+static const iocshArg EIP_timeout_floorArg0 = {"millisec", iocshArgInt};
+static const iocshArg *const EIP_timeout_floorArgs[1] = {&EIP_timeout_floorArg0};
+static const iocshFuncDef EIP_timeout_floorDef = {"EIP_timeout_floor", 1, EIP_timeout_floorArgs};
+static void EIP_timeout_floorCall(const iocshArgBuf * args) {
+	EIP_TIMEOUT_FLOOR = args[0].ival;
+}
+
+static const iocshArg EIP_write_holdoffArg0 = {"millisec", iocshArgInt};
+static const iocshArg *const EIP_write_holdoffArgs[1] = {&EIP_write_holdoffArg0};
+static const iocshFuncDef EIP_write_holdoffDef = {"EIP_write_holdoff", 1, EIP_write_holdoffArgs};
+static void EIP_write_holdoffCall(const iocshArgBuf * args) {
+	EIP_WRITE_HOLDOFF = args[0].ival;
+}
+
 static const iocshArg EIP_buffer_limitArg0 = {"bytes", iocshArgInt};
 static const iocshArg *const EIP_buffer_limitArgs[1] = {&EIP_buffer_limitArg0};
 static const iocshFuncDef EIP_buffer_limitDef = {"EIP_buffer_limit", 1, EIP_buffer_limitArgs};
@@ -46,6 +60,27 @@ static void EIP_buffer_limitCall(const iocshArgBuf * args) {
                (unsigned long) EIP_buffer_limit);
 }
 
+static const iocshArg EIP_buffer_probeArg0 = {"enable", iocshArgInt};
+static const iocshArg *const EIP_buffer_probeArgs[1] = {&EIP_buffer_probeArg0};
+static const iocshFuncDef EIP_buffer_probeDef = {"EIP_buffer_probe", 1, EIP_buffer_probeArgs};
+static void EIP_buffer_probeCall(const iocshArgBuf * args) {
+	EIP_buffer_probe = args[0].ival;
+}
+
+static const iocshArg EIP_captureArg0 = {"file.pcap", iocshArgString};
+static const iocshArg *const EIP_captureArgs[1] = {&EIP_captureArg0};
+static const iocshFuncDef EIP_captureDef = {"EIP_capture", 1, EIP_captureArgs};
+static void EIP_captureCall(const iocshArgBuf * args) {
+	EIP_capture(args[0].sval);
+}
+
+static const iocshArg EIP_replayArg0 = {"file.pcap", iocshArgString};
+static const iocshArg *const EIP_replayArgs[1] = {&EIP_replayArg0};
+static const iocshFuncDef EIP_replayDef = {"EIP_replay", 1, EIP_replayArgs};
+static void EIP_replayCall(const iocshArgBuf * args) {
+	EIP_replay(args[0].sval);
+}
+
 static const iocshFuncDef drvEtherIP_helpDef =
     {"drvEtherIP_help", 0, 0};
 static void drvEtherIP_helpCall(const iocshArgBuf * args) {
@@ -77,6 +112,15 @@ static void drvEtherIP_describeCall(const iocshArgBuf * args) {
 	drvEtherIP_describe(args[0].ival);
 }
 
+static const iocshArg drvEtherIP_traceArg0 = {"plc_name", iocshArgString};
+static const iocshArg drvEtherIP_traceArg1 = {"count"   , iocshArgInt   };
+static const iocshArg * const drvEtherIP_traceArgs[2] =
+{&drvEtherIP_traceArg0, &drvEtherIP_traceArg1};
+static const iocshFuncDef drvEtherIP_traceDef = {"drvEtherIP_trace", 2, drvEtherIP_traceArgs};
+static void drvEtherIP_traceCall(const iocshArgBuf * args) {
+	drvEtherIP_trace(args[0].sval, args[1].ival);
+}
+
 static const iocshFuncDef drvEtherIP_dumpDef =
     {"drvEtherIP_dump", 0, 0};
 static void drvEtherIP_dumpCall(const iocshArgBuf * args) {
@@ -99,11 +143,23 @@ static void drvEtherIP_reportCall(const iocshArgBuf * args) {
 static const iocshArg drvEtherIP_define_PLCArg0 = {"plc_name", iocshArgString};
 static const iocshArg drvEtherIP_define_PLCArg1 = {"ip_addr" , iocshArgString};
 static const iocshArg drvEtherIP_define_PLCArg2 = {"slot"    , iocshArgInt   };
-static const iocshArg * const drvEtherIP_define_PLCArgs[3] =
-{&drvEtherIP_define_PLCArg0, &drvEtherIP_define_PLCArg1, &drvEtherIP_define_PLCArg2};
-static const iocshFuncDef drvEtherIP_define_PLCDef = {"drvEtherIP_define_PLC", 3, drvEtherIP_define_PLCArgs};
+static const iocshArg drvEtherIP_define_PLCArg3 = {"sessions", iocshArgInt   };
+static const iocshArg * const drvEtherIP_define_PLCArgs[4] =
+{&drvEtherIP_define_PLCArg0, &drvEtherIP_define_PLCArg1, &drvEtherIP_define_PLCArg2,
+ &drvEtherIP_define_PLCArg3};
+static const iocshFuncDef drvEtherIP_define_PLCDef = {"drvEtherIP_define_PLC", 4, drvEtherIP_define_PLCArgs};
 static void drvEtherIP_define_PLCCall(const iocshArgBuf * args) {
-	drvEtherIP_define_PLC(args[0].sval, args[1].sval, args[2].ival);
+	drvEtherIP_define_PLC(args[0].sval, args[1].sval, args[2].ival, args[3].ival);
+}
+
+static const iocshArg drvEtherIP_limit_rateArg0 = {"plc_name" , iocshArgString};
+static const iocshArg drvEtherIP_limit_rateArg1 = {"packets/s", iocshArgDouble};
+static const iocshArg drvEtherIP_limit_rateArg2 = {"bytes/s"  , iocshArgDouble};
+static const iocshArg * const drvEtherIP_limit_rateArgs[3] =
+{&drvEtherIP_limit_rateArg0, &drvEtherIP_limit_rateArg1, &drvEtherIP_limit_rateArg2};
+static const iocshFuncDef drvEtherIP_limit_rateDef = {"drvEtherIP_limit_rate", 3, drvEtherIP_limit_rateArgs};
+static void drvEtherIP_limit_rateCall(const iocshArgBuf * args) {
+	drvEtherIP_limit_rate(args[0].sval, args[1].dval, args[2].dval);
 }
 
 static const iocshArg drvEtherIP_read_tagArg0 = {"ip_addr" , iocshArgString};
@@ -124,16 +180,23 @@ void drvEtherIP_Register() {
 	iocshRegister(&drvEtherIP_default_rateDef, drvEtherIP_default_rateCall);
 	iocshRegister(&EIP_verbosityDef        , EIP_verbosityCall);
 	iocshRegister(&EIP_timeoutDef          , EIP_timeoutCall);
+	iocshRegister(&EIP_timeout_floorDef    , EIP_timeout_floorCall);
 	iocshRegister(&EIP_buffer_limitDef     , EIP_buffer_limitCall);
+	iocshRegister(&EIP_buffer_probeDef     , EIP_buffer_probeCall);
+	iocshRegister(&EIP_write_holdoffDef    , EIP_write_holdoffCall);
+	iocshRegister(&EIP_captureDef          , EIP_captureCall);
+	iocshRegister(&EIP_replayDef           , EIP_replayCall);
 	iocshRegister(&drvEtherIP_helpDef      , drvEtherIP_helpCall);
 	iocshRegister(&drvEtherIP_initDef      , drvEtherIP_initCall);
 	iocshRegister(&drvEtherIP_restartDef   , drvEtherIP_restartCall);
 	iocshRegister(&drvEtherIP_dumpDef      , drvEtherIP_dumpCall);
 	iocshRegister(&drvEtherIP_listDef      , drvEtherIP_listCall);
 	iocshRegister(&drvEtherIP_describeDef  , drvEtherIP_describeCall);
+	iocshRegister(&drvEtherIP_traceDef     , drvEtherIP_traceCall);
 	iocshRegister(&drvEtherIP_reset_statisticsDef, drvEtherIP_reset_statisticsCall);
 	iocshRegister(&drvEtherIP_reportDef    , drvEtherIP_reportCall);
 	iocshRegister(&drvEtherIP_define_PLCDef, drvEtherIP_define_PLCCall);
+	iocshRegister(&drvEtherIP_limit_rateDef, drvEtherIP_limit_rateCall);
 	iocshRegister(&drvEtherIP_read_tagDef  , drvEtherIP_read_tagCall);
 }
 #ifdef __cplusplus
@@ -0,0 +1,269 @@
+/* EtherNet/IP: ControlNet over Ethernet
+ *
+ * Test of the driver's retries.
+ * Writes of bits, sent as read-modify-write, must not get lost
+ * when the PLC drops a whole transfer because it's busy
+ * or because the transfer exceeds its buffer.
+ * A buffer limit probed for one slot must not apply to others.
+ * Reconnects after failed transfers must be spaced out.
+ * Uses the simulated PLC via the loopback transport,
+ * no network or PLC required.
+ */
+
+#include<memory.h>
+#include<stdio.h>
+#include<string.h>
+#include<stddef.h>
+#include<stdlib.h>
+#include"epicsUnitTest.h"
+#include"testMain.h"
+#define EIP_SIM_LOOPBACK
+#include"ether_ip_sim.c"
+#include"drvEtherIP.c"
+
+/* Not an IOC, no iocsh commands to register */
+void drvEtherIP_Register()
+{
+}
+
+#define BITS_TAG  "retry_test_bits_of_a_tag_with_a_long_name"
+#define OTHER_TAG "retry_test_other_tag_with_a_name_long_enough_for_the_buffer"
+
+static PLC      *plc;
+static ScanList *list;
+static Session  *session;
+static TagInfo  *bits;
+
+/* Simulated PLC: Reply 'busy' to all MultiRequests, or accept them */
+static void sim_busy(eip_bool busy)
+{
+    epicsMutexLock(sim.lock);
+    sim.busy_rate = busy ? 1e-6 : 0.0;
+    epicsTimeGetCurrent(&sim.last_request);
+    epicsMutexUnlock(sim.lock);
+}
+
+/* Value of the simulated PLC's tag */
+static CN_UDINT sim_value(const char *name)
+{
+    SimTag   *tag = find_tag(name);
+    CN_UDINT value;
+
+    epicsMutexLock(sim.lock);
+    unpack_UDINT(tag->data + tag->header_size, &value);
+    epicsMutexUnlock(sim.lock);
+    return value;
+}
+
+/* Update cached value and request bit write like device support */
+static void write_bits(CN_UDINT set_bits, CN_UDINT clear_bits)
+{
+    CN_UDINT value;
+
+    epicsMutexLock(bits->data_lock);
+    if (get_CIP_UDINT(bits->data, 0, &value))
+        put_CIP_UDINT(bits->data, 0, (value | set_bits) & ~clear_bits);
+    drvEtherIP_request_bit_write(plc, bits, 0, set_bits, clear_bits);
+    epicsMutexUnlock(bits->data_lock);
+}
+
+/* Scan the tags like the scan task */
+static eip_bool scan()
+{
+    eip_bool ok;
+
+    epicsMutexLock(session->lock);
+    ok = lock_scanned_PLC(session, plc);
+    if (ok)
+    {
+        ok = process_ScanList(session, list);
+        unlock_scanned_PLC(session, plc);
+    }
+    epicsMutexUnlock(session->lock);
+    return ok;
+}
+
+/* Send the queued writes like the scan task */
+static eip_bool flush_writes()
+{
+    double   holdoff;
+    eip_bool ok;
+
+    epicsMutexLock(session->lock);
+    ok = process_WriteQueue(session, &holdoff);
+    epicsMutexUnlock(session->lock);
+    return ok;
+}
+
+static void setup()
+{
+    sim.lock = epicsMutexCreate();
+    sim.buffer_limit = SIM_MAX_BUFFER_LIMIT;
+    EIP_buffer_probe = false;
+    EIP_verbosity = 0;
+    if (! (add_tag(BITS_TAG, "DINT", 1, 16.0)  &&
+           add_tag(OTHER_TAG, "DINT", 1, 0.0)  &&
+           sort_tags()))
+        testAbort("Cannot create simulated tags");
+    EIP_loopback(&sim_loopback_target);
+    drvEtherIP_init();
+    if (! drvEtherIP_define_PLC("retry", "127.0.0.1", 0, 1))
+        testAbort("Cannot define PLC");
+    plc = drvEtherIP_find_PLC("retry");
+    bits = drvEtherIP_add_tag(plc, 1.0, BITS_TAG, 1);
+    if (! (bits  &&  drvEtherIP_add_tag(plc, 1.0, OTHER_TAG, 1)))
+        testAbort("Cannot add tags");
+    list = get_PLC_ScanList(plc, 1.0, false);
+    session = list->session;
+    epicsMutexLock(session->lock);
+    testOk(assert_Session_connect(session), "Connected via loopback");
+    epicsMutexUnlock(session->lock);
+    testOk(scan()  &&  bits->valid_data_size > 0, "Initial read");
+}
+
+/* Write queue is dropped by busy PLC,
+ * bits requested meanwhile add to the dropped ones
+ */
+static void test_busy_write_queue()
+{
+    sim_busy(true);
+    write_bits(0x01, 0x10);
+    testOk(flush_writes(), "Busy PLC is no error");
+    testOk(sim_value(BITS_TAG) == 0x10, "Bits not written while busy");
+    testOk(bits->write_queued, "Dropped write is queued again");
+    write_bits(0x02, 0);
+    sim_busy(false);
+    testOk(flush_writes(), "Write queue sent");
+    testOk(sim_value(BITS_TAG) == 0x03,
+           "Bits of dropped and later write: 0x%X", sim_value(BITS_TAG));
+    testOk(! bits->write_queued, "Write queue is empty");
+}
+
+/* Scan is dropped by busy PLC */
+static void test_busy_scan()
+{
+    sim_busy(true);
+    write_bits(0x04, 0);
+    testOk(scan(), "Busy PLC is no error");
+    testOk(sim_value(BITS_TAG) == 0x03, "Bits not written while busy");
+    sim_busy(false);
+    testOk(scan(), "Scan");
+    testOk(sim_value(BITS_TAG) == 0x07,
+           "Bits of dropped scan: 0x%X", sim_value(BITS_TAG));
+    testOk(flush_writes()  &&  ! bits->write_queued,
+           "Nothing left to write");
+}
+
+/* Transfer of both tags exceeds the PLC's buffer */
+static void test_buffer_limit()
+{
+    size_t limit = route_Session(session, plc)->transfer_buffer_limit;
+    size_t scans;
+
+    sim.buffer_limit = EIP_MIN_BUFFER_LIMIT;
+    write_bits(0x08, 0);
+    for (scans=0;  scans < 10  &&  sim_value(BITS_TAG) != 0x0F;  ++scans)
+        if (! scan())
+            break;
+    testOk(route_Session(session, plc)->transfer_buffer_limit < limit,
+           "Buffer limit reduced from %u to %u bytes", (unsigned) limit,
+           (unsigned) route_Session(session, plc)->transfer_buffer_limit);
+    testOk(sim_value(BITS_TAG) == 0x0F,
+           "Bits written in smaller transfer: 0x%X", sim_value(BITS_TAG));
+}
+
+/* Failed read-modify-write falls back to a write,
+ * but only a PLC that lacks the service disables it for the tag
+ */
+static void test_item_error()
+{
+    sim.error_percent = 100.0;
+    write_bits(0x10, 0);
+    testOk(scan(), "Failed item is no transfer error");
+    testOk(bits->do_write  &&  ! bits->no_rmw,
+           "Falls back to write, read-modify-write still enabled");
+    testOk(bits->write_queued, "Write is queued");
+    sim.error_percent = 0.0;
+    testOk(flush_writes()  &&  ! bits->write_queued, "Write queue sent");
+    testOk(sim_value(BITS_TAG) == 0x1F,
+           "Bits written as element: 0x%X", sim_value(BITS_TAG));
+}
+
+/* Limit probed for the PLC in one slot
+ * doesn't apply when the connection is routed to another slot
+ */
+static void test_route_slot()
+{
+    EIPConnection *c = session->connection;
+
+    epicsMutexLock(session->lock);
+    c->transfer_buffer_limit = c->probed_buffer_limit = EIP_max_buffer_limit();
+    c->probed_slot = plc->slot;
+    testOk(route_Session(session, plc)->transfer_buffer_limit ==
+           EIP_max_buffer_limit(), "Probed limit applies to probed slot");
+    EIP_route_slot(c, plc->slot + 1);
+    testOk(c->transfer_buffer_limit == (size_t) EIP_buffer_limit,
+           "Other slot uses EIP_buffer_limit, %u bytes",
+           (unsigned) c->transfer_buffer_limit);
+    route_Session(session, plc);
+    epicsMutexUnlock(session->lock);
+}
+
+/* Seconds until the session may reconnect */
+static double reconnect_wait()
+{
+    epicsTimeStamp now;
+
+    epicsTimeGetCurrent(&now);
+    return epicsTimeDiffInSeconds(&session->next_connect, &now);
+}
+
+/* PLC accepts connections, but then fails:
+ * Reconnects are spaced out like failed connections
+ */
+static void test_reconnect_backoff()
+{
+    eip_bool ok;
+    double   wait;
+
+    sim.timeout_percent = 100.0;
+    testOk(! scan(), "Scan fails without reply");
+    epicsMutexLock(session->lock);
+    fail_Session(session);
+    wait = reconnect_wait();
+    ok = assert_Session_connect(session);
+    epicsMutexUnlock(session->lock);
+    testOk(wait >= 0.5*EIP_RECONNECT_DELAY,
+           "Reconnect delayed by %.2f secs", wait);
+    testOk(! ok, "No reconnect before then");
+
+    /* Delay passed, connecting works, but the next scan fails again */
+    sim.timeout_percent = 0.0;
+    epicsMutexLock(session->lock);
+    epicsTimeGetCurrent(&session->next_connect);
+    ok = assert_Session_connect(session);
+    epicsMutexUnlock(session->lock);
+    testOk(ok, "Reconnected");
+    sim.timeout_percent = 100.0;
+    testOk(! scan(), "Scan fails again");
+    epicsMutexLock(session->lock);
+    fail_Session(session);
+    wait = reconnect_wait();
+    epicsMutexUnlock(session->lock);
+    testOk(wait >= EIP_RECONNECT_DELAY,
+           "Next reconnect delayed longer, by %.2f secs", wait);
+    sim.timeout_percent = 0.0;
+}
+
+MAIN(drvEtherIPRetryTest)
+{
+    testPlan(28);
+    setup();
+    test_busy_write_queue();
+    test_busy_scan();
+    test_buffer_limit();
+    test_item_error();
+    test_route_slot();
+    test_reconnect_backoff();
+    return testDone();
+}
@@ -33,6 +33,8 @@
 
 int EIP_buffer_limit =  EIP_DEFAULT_BUFFER_LIMIT;
 
+int EIP_buffer_probe = true;
+
 static const CN_UINT __endian_test = 0x0001;
 #define is_little_endian (*((const CN_USINT*)&__endian_test))
 
@@ -633,31 +635,77 @@ void EIP_free_ParsedTag(ParsedTag *tag)
     }
 }
 
-/* Word-size of path for ControlLogix tag */
-static size_t tag_path_size(const ParsedTag *tag)
+/* Byte-size of path segment for array element */
+static size_t element_path_size(CN_UDINT element)
 {
-    size_t bytes = 0, slen;
+    if (element <= 0xFF)
+        return 2;
+    if (element <= 0xFFFF)
+        return 4;
+    return 6;
+}
 
-    while (tag)
+static CN_USINT *make_element_path(CN_USINT *path, CN_UDINT element)
+{
+    if (element <= 0xFF)
     {
-        switch (tag->type)
-        {
-        case te_name:
-            slen = strlen(tag->value.name);
-            bytes += 2 + slen + slen%2;    /* 0x91, len, string [, pad] */
-            break;
-        case te_element:
-            if (tag->value.element <= 0xFF)
-                bytes += 2;
-            else
-            if (tag->value.element <= 0xFFFF)
-                bytes += 4;
-            else
-                bytes += 6;
-            break;
-        }
-        tag = tag->next;
+        *(path++) = 0x28;
+        *(path++) = element;
+    }
+    else
+    if (element <= 0xFFFF)
+    {
+        *(path++) = 0x29;
+        *(path++) = 0x00;
+        *(path++) =  element & 0x00FF;
+        *(path++) = (element & 0xFF00) >> 8;
+    }
+    else
+    {
+        *(path++) = 0x2A;
+        *(path++) = 0x00;
+        *(path++) =  element & 0x000000FF;
+        *(path++) = (element & 0x0000FF00) >> 8;
+        *(path++) = (element & 0x00FF0000) >> 16;
+        *(path++) = (element & 0xFF000000) >> 24;
     }
+    return path;
+}
+
+/* Byte-size of path for one ParsedTag node */
+static size_t tag_node_path_size(const ParsedTag *tag)
+{
+    size_t slen;
+
+    if (tag->type == te_element)
+        return element_path_size(tag->value.element);
+    slen = strlen(tag->value.name);
+    return 2 + slen + slen%2;    /* 0x91, len, string [, pad] */
+}
+
+/* build path for one ParsedTag node */
+static CN_USINT *make_tag_node_path(CN_USINT *path, const ParsedTag *tag)
+{
+    size_t slen;
+
+    if (tag->type == te_element)
+        return make_element_path(path, tag->value.element);
+    slen = strlen(tag->value.name);
+    path[0] = 0x91; /* spec 4 p.21: "ANSI extended symbol segment" */
+    path[1] = (CN_USINT)slen;
+    memcpy(& path[2],  tag->value.name, slen);
+    if (slen % 2) /* pad */
+        path[2+slen] = 0;
+    return path + 2 + slen + slen%2;
+}
+
+/* Word-size of path for ControlLogix tag */
+static size_t tag_path_size(const ParsedTag *tag)
+{
+    size_t bytes = 0;
+
+    for (/**/; tag; tag = tag->next)
+        bytes += tag_node_path_size(tag);
 
     return bytes / 2;
 }
@@ -665,51 +713,47 @@ static size_t tag_path_size(const ParsedTag *tag)
 /* build path for ControlLogix tag */
 static CN_USINT *make_tag_path(CN_USINT *path, const ParsedTag *tag)
 {
-    size_t slen;
+    for (/**/; tag; tag = tag->next)
+        path = make_tag_node_path(path, tag);
 
-    while (tag)
+    return path;
+}
+
+/* Path for array element 'element' of the tag:
+ * If the tag ends in an array index, 'element' is added to it,
+ * for example "x[2]" with element 3 is "x[5]".
+ * Otherwise 'element' is appended as index, "x" -> "x[3]".
+ */
+static eip_bool is_final_index(const ParsedTag *tag)
+{
+    return tag->type == te_element  &&  tag->next == 0;
+}
+
+/* Word-size of path for element of ControlLogix tag */
+static size_t tag_element_path_size(const ParsedTag *tag, size_t element)
+{
+    size_t bytes = 0;
+
+    for (/**/; tag; tag = tag->next)
     {
-        switch (tag->type)
-        {
-        case te_name:
-            slen = strlen(tag->value.name);
-
-            path[0] = 0x91; /* spec 4 p.21: "ANSI extended symbol segment" */
-            path[1] = (CN_USINT)slen;
-            memcpy(& path[2],  tag->value.name, slen);
-            if (slen % 2) /* pad */
-                path[2+slen] = 0;
-            path += 2 + slen + slen%2;
-            break;
-        case te_element:
-            if (tag->value.element <= 0xFF)
-            {
-                *(path++) = 0x28;
-                *(path++) = tag->value.element;
-            }
-            else
-            if (tag->value.element <= 0xFFFF)
-            {
-                *(path++) = 0x29;
-                *(path++) = 0x00;
-                *(path++) =  tag->value.element & 0x00FF;
-                *(path++) = (tag->value.element & 0xFF00) >> 8;
-            }
-            else
-            {
-                *(path++) = 0x2A;
-                *(path++) = 0x00;
-                *(path++) =  tag->value.element & 0x000000FF;
-                *(path++) = (tag->value.element & 0x0000FF00) >> 8;
-                *(path++) = (tag->value.element & 0x00FF0000) >> 16;
-                *(path++) = (tag->value.element & 0xFF000000) >> 24;
-            }
-            break;
-        }
-        tag = tag->next;
+        if (is_final_index(tag))
+            return (bytes + element_path_size(tag->value.element + element)) / 2;
+        bytes += tag_node_path_size(tag);
     }
+    return (bytes + element_path_size(element)) / 2;
+}
 
-    return path;
+/* build path for element of ControlLogix tag */
+static CN_USINT *make_tag_element_path(CN_USINT *path, const ParsedTag *tag,
+                                       size_t element)
+{
+    for (/**/; tag; tag = tag->next)
+    {
+        if (is_final_index(tag))
+            return make_element_path(path, tag->value.element + element);
+        path = make_tag_node_path(path, tag);
+    }
+    return make_element_path(path, element);
 }
 
 static const CN_USINT *dump_raw_path(CN_USINT size, const CN_USINT *path)
@@ -802,6 +846,7 @@ static const char *service_name(CN_Services service)
     case S_CIP_MultiRequest:          return "S_CIP_MultiRequest";
     case S_CIP_ReadData:              return "CIP_ReadData";
     case S_CIP_WriteData:             return "CIP_WriteData";
+    case S_CIP_ReadModifyWrite:       return "CIP_ReadModifyWrite";
     case S_CM_Unconnected_Send:       return "CM_Unconnected_Send";
     case S_Get_Instance_Attr_List:    return "S_Get_Instance_Attr_List";
     case S_CM_Forward_Open:           return "CM_Forward_Open";
@@ -812,6 +857,7 @@ static const char *service_name(CN_Services service)
     case S_CIP_MultiRequest|0x80:     return "S_CIP_MultiRequest-Reply";
     case S_CIP_ReadData|0x80:         return "CIP_ReadData-Reply";
     case S_CIP_WriteData|0x80:        return "CIP_WriteData-Reply";
+    case S_CIP_ReadModifyWrite|0x80:  return "CIP_ReadModifyWrite-Reply";
     case S_CM_Unconnected_Send|0x80:  return "CM_Unconnected_Send-Reply";
     case S_Get_Instance_Attr_List|0x80: return "S_Get_Instance_Attr_List-Reply";
     case S_CM_Forward_Open|0x80:      return "CM_Forward_Open-Reply";
@@ -827,11 +873,13 @@ static const char *CN_error_text(CN_USINT status)
     {
     case 0x00:  return "Ok";
     case 0x01:  return "Extended error";
+    case 0x02:  return "Resource unavailable";
     case 0x04:  return "Unknown tag or Path error";
     case 0x05:  return "Instance not found";
     case 0x06:  return "Buffer too small, partial data only";
     case 0x08:  return "Service not supported";
     case 0x09:  return "Invalid Attribute";
+    case 0x11:  return "Reply data too large";
     case 0x13:  return "Not enough data";
     case 0x14:  return "Attribute not supported, ext. shows attribute";
     case 0x15:  return "Too much data";
@@ -1086,22 +1134,30 @@ CN_USINT *make_CM_Unconnected_Send(CN_USINT *request,
  */
 size_t CIP_Type_size(CIP_Type type)
 {
+#define CIP_TYPE_SIZE(type, name, size)  case type: return size;
     switch (type)
     {
-        case T_CIP_BOOL:  return sizeof(CN_USINT);
-        case T_CIP_SINT:  return sizeof(CN_USINT);
-        case T_CIP_INT:   return sizeof(CN_UINT);
-        case T_CIP_DINT:  return sizeof(CN_DINT);
+        CIP_ATOMIC_TYPES(CIP_TYPE_SIZE)
 #ifdef SUPPORT_LINT
-        case T_CIP_LINT:  return sizeof(CN_LINT);
-        case T_CIP_ULINT: return sizeof(CN_ULINT);
+        CIP_LINT_TYPES(CIP_TYPE_SIZE)
 #endif
-        case T_CIP_REAL:  return sizeof(CN_REAL);
-        case T_CIP_LREAL: return sizeof(CN_LREAL);
-        case T_CIP_BITS:  return sizeof(CN_UDINT);
         default:
             return 0;
     }
+#undef CIP_TYPE_SIZE
+}
+
+const char *CIP_Type_name(CIP_Type type)
+{
+#define CIP_TYPE_NAME(type, name, size)  case type: return name;
+    switch (type)
+    {
+        CIP_ATOMIC_TYPES(CIP_TYPE_NAME)
+        CIP_LINT_TYPES(CIP_TYPE_NAME)
+        default:
+            return 0;
+    }
+#undef CIP_TYPE_NAME
 }
 
 /* MR_Request for S_CIP_ReadData:
@@ -1427,6 +1483,140 @@ eip_bool get_CIP_USINT(const CN_USINT *raw_type_and_data,
     return false;
 }
 
+/* Bulk versions of get_CIP_double, get_CIP_DINT, get_CIP_USINT
+ * for 'count' elements starting at 'element'.
+ * They check the type once and then run plain loops over
+ * the raw data that the compiler can vectorize, or memcpy
+ * when the host already uses the CIP little endian format.
+ * Results match the single-element calls.
+ */
+#define RAW_UINT(p)  ((CN_UINT) ((p)[0] | ((p)[1]<<8)))
+#define RAW_UDINT(p) ((CN_UDINT)(p)[0]        | ((CN_UDINT)(p)[1]<< 8) | \
+                      ((CN_UDINT)(p)[2]<<16) | ((CN_UDINT)(p)[3]<<24))
+
+eip_bool get_CIP_double_array(const CN_USINT *raw_type_and_data,
+                              size_t element, size_t count, double *result)
+{
+    CN_UINT        type;
+    const CN_USINT *buf;
+    CN_UDINT       vd;
+    CN_REAL        vr;
+    size_t         i;
+
+    buf = unpack_UINT(raw_type_and_data, &type);
+    buf += element*CIP_Type_size(type);
+    switch (type)
+    {
+        case T_CIP_BOOL:
+        case T_CIP_SINT:
+            for (i=0; i<count; ++i)
+                result[i] = (double) buf[i];
+            return true;
+        case T_CIP_INT:
+            for (i=0; i<count; ++i)
+                result[i] = (double) RAW_UINT(buf + 2*i);
+            return true;
+        case T_CIP_DINT:
+        case T_CIP_BITS:
+            for (i=0; i<count; ++i)
+                result[i] = (double) RAW_UDINT(buf + 4*i);
+            return true;
+        case T_CIP_REAL:
+            /* Assemble the little endian bits, then reinterpret
+             * as float, which works for either host byte order */
+            for (i=0; i<count; ++i)
+            {
+                vd = RAW_UDINT(buf + 4*i);
+                memcpy(&vr, &vd, sizeof(vr));
+                result[i] = (double) vr;
+            }
+            return true;
+        case T_CIP_LREAL:
+            if (is_little_endian)
+                memcpy(result, buf, count*sizeof(CN_LREAL));
+            else
+                for (i=0; i<count; ++i)
+                    unpack_LREAL(buf + 8*i, result + i);
+            return true;
+    }
+    EIP_printf(1, "EIP get_CIP_double_array: unknown type 0x%04X\n", (int) type);
+    return false;
+}
+
+eip_bool get_CIP_DINT_array(const CN_USINT *raw_type_and_data,
+                            size_t element, size_t count, CN_DINT *result)
+{
+    CN_UINT        type;
+    const CN_USINT *buf;
+    CN_UDINT       vd;
+    CN_REAL        vr;
+    CN_LREAL       vlr;
+    size_t         i;
+
+    buf = unpack_UINT(raw_type_and_data, &type);
+    buf += element*CIP_Type_size(type);
+    switch (type)
+    {
+        case T_CIP_BOOL:
+        case T_CIP_SINT:
+            for (i=0; i<count; ++i)
+                result[i] = (CN_DINT) buf[i];
+            return true;
+        case T_CIP_INT:
+        case T_CIP_UINT:
+            for (i=0; i<count; ++i)
+                result[i] = (CN_DINT) (CN_INT) RAW_UINT(buf + 2*i);
+            return true;
+        case T_CIP_DINT:
+        case T_CIP_BITS:
+            if (is_little_endian)
+                memcpy(result, buf, count*sizeof(CN_DINT));
+            else
+                for (i=0; i<count; ++i)
+                    result[i] = (CN_DINT) RAW_UDINT(buf + 4*i);
+            return true;
+        case T_CIP_REAL:
+            for (i=0; i<count; ++i)
+            {
+                vd = RAW_UDINT(buf + 4*i);
+                memcpy(&vr, &vd, sizeof(vr));
+                result[i] = (CN_DINT) vr;
+            }
+            return true;
+        case T_CIP_LREAL:
+            for (i=0; i<count; ++i)
+            {
+                unpack_LREAL(buf + 8*i, &vlr);
+                result[i] = (CN_DINT) vlr;
+            }
+            return true;
+    }
+    EIP_printf(1, "EIP get_CIP_DINT_array: unknown type 0x%04X\n", (int) type);
+    return false;
+}
+
+eip_bool get_CIP_USINT_array(const CN_USINT *raw_type_and_data,
+                             size_t element, size_t count, CN_USINT *result)
+{
+    CN_UINT        type;
+    const CN_USINT *buf;
+
+    buf = unpack_UINT(raw_type_and_data, &type);
+    buf += element*CIP_Type_size(type);
+    switch (type)
+    {
+        case T_CIP_BOOL:
+        case T_CIP_SINT:
+            memcpy(result, buf, count);
+            return true;
+    }
+    EIP_printf(1, "EIP get_CIP_USINT_array: cannot handle type 0x%04X\n", (int) type);
+    return false;
+}
+
+#undef RAW_UINT
+#undef RAW_UDINT
+
 /* Fill buffer with up to 'size' characters (incl. ending '\0').
  * Return true for success */
 eip_bool get_CIP_STRING(const CN_USINT *raw_type_and_data,
@@ -1459,7 +1649,7 @@ eip_bool get_CIP_STRING(const CN_USINT *raw_type_and_data,
         return false;
     }
 
-    buf += element*(T_CIP_STRUCT_LEN_BYTES + T_CIP_STRUCT_STRING_BUF);
+    buf += element*CIP_STRUCT_STRING_size;
     buf = unpack_UINT(buf, &len);
     buf = unpack_UINT(buf, &no_idea_what_this_is);
 
@@ -1729,6 +1919,56 @@ CN_USINT *make_CIP_WriteData (CN_USINT *request, size_t buf_size, const ParsedTa
     return buf + data_size;
 }
 
+/* Size of CIP WriteData request for 'elements' of the tag,
+ * starting at array element 'element', see make_CIP_WriteData_range.
+ */
+size_t CIP_WriteData_range_size(const ParsedTag *tag, size_t element,
+                                CIP_Type type, size_t elements)
+{
+    return   2
+           + 2 * tag_element_path_size(tag, element)
+           + 4 + CIP_Type_size(type) * elements;
+}
+
+/* Fill buffer with CIP WriteData request for part of an array:
+ * 'elements' starting at array element 'element', which is added to
+ * a final array index of the tag or appended if the tag has none.
+ * raw_data points to the first element to write, in network format.
+ * Only for atomic types, not strings.
+ */
+CN_USINT *make_CIP_WriteData_range(CN_USINT *request, const ParsedTag *tag,
+                                   size_t element, CIP_Type type,
+                                   size_t elements, const CN_USINT *raw_data)
+{
+    size_t   data_size = CIP_Type_size(type) * elements;
+    CN_USINT *buf;
+
+    if (data_size <= 0)
+    {
+        EIP_printf(2, "make_CIP_WriteData_range: unsupported type 0x%X\n",
+                   type);
+        return 0;
+    }
+    buf = make_MR_Request(request, S_CIP_WriteData,
+                          tag_element_path_size(tag, element));
+    buf = make_tag_element_path(buf, tag, element);
+    buf = pack_UINT(buf, type);
+    buf = pack_UINT(buf, elements);
+    memcpy(buf, raw_data, data_size);
+    if (EIP_verbosity >= 10)
+    {
+        char buffer[EIP_MAX_TAG_LENGTH];
+        EIP_copy_ParsedTag(buffer, tag);
+        EIP_printf(10, "    Path: Tag '%s', from element %d\n",
+                   buffer, (int)element);
+        EIP_printf(10, "    UINT type     = 0x%X\n", type);
+        EIP_printf(10, "    UINT elements = %d\n", (int)elements);
+        EIP_printf(10, "    Data: ");
+        EIP_hexdump(10, raw_data, data_size);
+    }
+    return buf + data_size;
+}
+
 void dump_CIP_WriteRequest (const CN_USINT *request)
 {
     const CN_USINT *buf;
@@ -1761,6 +2001,79 @@ eip_bool check_CIP_WriteData_Response (const CN_USINT *response,
     return is_raw_MRResponse_ok(response, response_size);
 }
 
+/* MR_Request for S_CIP_ReadModifyWrite:
+ *   MR_Request w/ tag path, maybe including array element
+ *   CN_UINT    mask_size;        // bytes per mask: 1, 2, 4, ...
+ *   CN_USINT   or_mask[mask_size];  // 1 bits are set
+ *   CN_USINT   and_mask[mask_size]; // 0 bits are cleared
+ *
+ * 1756-PM020, "Read Modify Write Tag Service"
+ */
+size_t CIP_ReadModifyWrite_size(const ParsedTag *tag, eip_bool indexed,
+                                size_t element, size_t mask_size)
+{
+    return   2                          /* service, path_size */
+           + 2 * (indexed ? tag_element_path_size(tag, element)
+                          : tag_path_size(tag))
+           + sizeof(CN_UINT)            /* mask_size */
+           + 2 * mask_size;
+}
+
+CN_USINT *make_CIP_ReadModifyWrite(CN_USINT *request,
+                                   const ParsedTag *tag, eip_bool indexed,
+                                   size_t element, size_t mask_size,
+                                   CN_UDINT or_mask, CN_UDINT and_mask)
+{
+    CN_USINT *buf;
+    size_t   i;
+
+    if (mask_size > sizeof(CN_UDINT))
+    {
+        EIP_printf(2, "make_CIP_ReadModifyWrite: unsupported mask size %u\n",
+                   (unsigned)mask_size);
+        return 0;
+    }
+    buf = make_MR_Request(request, S_CIP_ReadModifyWrite,
+                          indexed ? tag_element_path_size(tag, element)
+                                  : tag_path_size(tag));
+    buf = indexed ? make_tag_element_path(buf, tag, element)
+                  : make_tag_path(buf, tag);
+    buf = pack_UINT(buf, mask_size);
+    for (i=0; i<mask_size; ++i)
+        *(buf++) = (or_mask >> (8*i)) & 0xFF;
+    for (i=0; i<mask_size; ++i)
+        *(buf++) = (and_mask >> (8*i)) & 0xFF;
+    if (EIP_verbosity >= 10)
+    {
+        char buffer[EIP_MAX_TAG_LENGTH];
+        EIP_copy_ParsedTag(buffer, tag);
+        EIP_printf(10, "    Path: Tag '%s', element %d%s\n", buffer,
+                   (int)element, indexed ? "" : " (not indexed)");
+        EIP_printf(10, "    UINT mask size = %d\n", (int)mask_size);
+        EIP_printf(10, "    OR mask  = 0x%08X\n", (unsigned)or_mask);
+        EIP_printf(10, "    AND mask = 0x%08X\n", (unsigned)and_mask);
+    }
+    return buf;
+}
+
+/* Test CIP_ReadModifyWrite response: If not OK, report error */
+eip_bool check_CIP_ReadModifyWrite_Response(const CN_USINT *response,
+                                            size_t response_size)
+{
+    CN_USINT service = response[0];
+    if ((service & 0x7F) != S_CIP_ReadModifyWrite)
+    {
+        if (EIP_verbosity >= 2)
+        {
+            EIP_printf(2, "EIP: Expected Response to CIP_ReadModifyWrite, got:\n");
+            EIP_dump_raw_MR_Response(response, response_size);
+        }
+        return false;
+    }
+
+    return is_raw_MRResponse_ok(response, response_size);
+}
+
 /* CIP_MultiRequest:
  *  MR_Request
  *  CN_UINT    count      number of requests that follow
@@ -1871,13 +2184,31 @@ size_t CIP_MultiResponse_size (size_t count, size_t responses_size)
            + responses_size;
 }
 
+eip_bool is_CIP_buffer_error(CN_USINT general_status)
+{
+    return general_status == 0x06  ||  general_status == 0x11  ||
+           general_status == 0x15;
+}
+
+eip_bool is_CIP_busy_error(CN_USINT general_status)
+{
+    return general_status == 0x02;
+}
+
+eip_bool is_CIP_unsupported_error(CN_USINT general_status)
+{
+    return general_status == 0x08;
+}
+
 /* Check if response is valid for a S_CIP_MultiRequest */
 eip_bool check_CIP_MultiRequest_Response (const CN_USINT *response,
                                           size_t response_size)
 {
     CN_USINT service        = response[0];
     CN_USINT general_status = response[2];
-    if (service == (S_CIP_MultiRequest|0x80)  &&  general_status == 0)
+    /* 0x1E: Some embedded requests failed, each reply has its own status */
+    if (service == (S_CIP_MultiRequest|0x80)  &&
+        (general_status == 0  ||  general_status == 0x1E))
     {
         if (EIP_verbosity >= 10)
         {
@@ -1961,6 +2292,57 @@ const CN_USINT *get_CIP_MultiRequest_Response (const CN_USINT *response,
     return mem;
 }
 
+/* Locate all replies of a MultiRequest response with one pass
+ * over its offset table.
+ * Offsets must increase and leave room for at least an MR_Response
+ * header within the response_size.
+ * Returns count of replies, 0 if there are more than max_count
+ * or the response is malformed.
+ */
+size_t get_CIP_MultiRequest_Responses(const CN_USINT *response,
+                                      size_t response_size,
+                                      size_t max_count,
+                                      const CN_USINT *replies[],
+                                      size_t reply_sizes[])
+{
+    const CN_USINT *countp, *offsetp;
+    size_t data_size, i;
+    CN_UINT count, offset, next;
+
+    if (response_size < 4)
+        return 0;
+    countp = EIP_raw_MR_Response_data(response, response_size, &data_size);
+    if (data_size < 2)
+        return 0;
+    offsetp = unpack_UINT(countp, &count);
+    if (count > max_count  ||  2 + 2*(size_t)count > data_size)
+    {
+        EIP_printf(2, "EIP MultiRequest response: %u replies do not fit\n",
+                   (unsigned) count);
+        return 0;
+    }
+    if (count > 0)
+        unpack_UINT(offsetp, &offset);
+    for (i=0; i<count; ++i)
+    {
+        if (i+1 < count)
+            unpack_UINT(offsetp + 2*(i+1), &next);
+        else
+            next = (CN_UINT) data_size;
+        if (offset < 2 + 2*count  ||  offset + 4 > next  ||  next > data_size)
+        {
+            EIP_printf(2, "EIP MultiRequest response: "
+                       "reply %u at invalid offset 0x%X\n",
+                       (unsigned) i, (unsigned) offset);
+            return 0;
+        }
+        replies[i] = countp + offset;
+        reply_sizes[i] = next - offset;
+        offset = next;
+    }
+    return count;
+}
+
 /********************************************************
  * Connection: socket, connect, send/receive buffers, ...
  ********************************************************/
@@ -1969,8 +2351,12 @@ void EIP_dump_connection (const EIPConnection *c)
 {
     printf ("EIPConnection:\n");
     printf ("    SOCKET          : %d\n", c->sock);
-    printf ("    buffer_limit    : %u\n", (unsigned int)c->transfer_buffer_limit);
+    printf ("    buffer_limit    : %u%s\n", (unsigned int)c->transfer_buffer_limit,
+            c->probed_buffer_limit ? " (probed)" : "");
     printf ("    millisec_timeout: %u\n", (unsigned int)c->millisec_timeout);
+    printf ("    read timeout    : %u\n", (unsigned int)EIP_read_timeout(c));
+    printf ("    round trip      : %.3f +- %.3f ms\n",
+            c->srtt*1000.0, c->rttvar*1000.0);
     printf ("    CN_UDINT session: 0x%08X\n", c->session);
     printf ("    buffer location : 0x%lX\n", (unsigned long)c->buffer);
     printf ("    buffer size     : %u\n", (unsigned int)EIP_BUFFER_SIZE);
@@ -2055,39 +2441,27 @@ void EIP_dispose(EIPConnection *c)
 {
     free(c->buffer);
     c->buffer = 0;
+    free(c->peer_name);
     free(c);
 }
 
-/* Init. connection:
- * Init. fields,
- * connect to target
- */
-eip_bool EIP_connect(EIPConnection *c,
-                     const char *ip_addr, unsigned short port,
-                     unsigned short slot,
-                     size_t millisec_timeout)
+/********************************************************
+ * TCP transport
+ ********************************************************/
+
+static eip_bool tcp_open(EIPConnection *c, const char *ip_addr)
 {
     struct sockaddr_in addr;
+    osiSocklen_t addr_size;
     struct timeval timeout;
     int flag = true;
 
-    c->transfer_buffer_limit = EIP_buffer_limit;
-    c->millisec_timeout = millisec_timeout;
-    c->slot = slot;
-    timeout.tv_sec = millisec_timeout/1000;
-    timeout.tv_usec = (millisec_timeout-timeout.tv_sec*1000)*1000;
-
-    /* Get IP from ip_addr in '123.456.789.123' format ... */
+    timeout.tv_sec = c->millisec_timeout/1000;
+    timeout.tv_usec = (c->millisec_timeout-timeout.tv_sec*1000)*1000;
     memset (&addr, 0, sizeof (addr));
     addr.sin_family = AF_INET;
-    addr.sin_port = htons (port);
-    if(hostToIPAddr(ip_addr, &addr.sin_addr) < 0) {
-            EIP_printf (2, "EIP cannot find IP for '%s'\n",
-                        ip_addr);
-            return false;
-    }
-    if (c->sock != 0)
-        EIP_printf (2, "EIP_connect found open socket\n");
+    addr.sin_port = htons (c->peer_port);
+    addr.sin_addr.s_addr = htonl (c->peer_ip);
     /* Create socket and set it to no-delay */
     c->sock = socket (AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (c->sock == EIP_INVALID_SOCKET)
@@ -2105,17 +2479,636 @@ eip_bool EIP_connect(EIPConnection *c,
         return false;
     }
     EIP_printf(10, "EIP connectWithTimeout(%s:%u, %d sec, %d msec)\n",
-               ip_addr, port, (int)timeout.tv_sec, (int)timeout.tv_usec);
+               ip_addr, c->peer_port,
+               (int)timeout.tv_sec, (int)timeout.tv_usec);
     if (connectWithTimeout(c->sock, (struct sockaddr *)&addr,
                            sizeof (addr), &timeout) != 0)
     {
-        EIP_printf (3, "EIP cannot connect to %s:%u\n", ip_addr, port);
+        EIP_printf (3, "EIP cannot connect to %s:%u\n", ip_addr, c->peer_port);
         EIP_socket_close (c->sock);
         c->sock = 0;
         return false;
     }
     EIP_printf (9, "EIP connected to %s:%u on socket %d\n",
-                ip_addr, port, c->sock);
+                ip_addr, c->peer_port, c->sock);
+    addr_size = sizeof(addr);
+    if (getsockname(c->sock, (struct sockaddr *)&addr, &addr_size) == 0)
+    {
+        c->local_ip = ntohl(addr.sin_addr.s_addr);
+        c->local_port = ntohs(addr.sin_port);
+    }
+    return true;
+}
+
+static int tcp_send(EIPConnection *c, const CN_USINT *data, size_t size)
+{
+    return send(c->sock, (void *)data, size, 0);
+}
+
+static int tcp_poll(EIPConnection *c, size_t millisec_timeout)
+{
+    fd_set fds;
+    struct timeval timeout;
+
+    /* Reset all select() arguments to be portable with
+     * implementations that might update timeout.
+     */
+    // TODO Should use poll() instead of select(),
+    //      but vxWorks only offers select()...
+    FD_ZERO(&fds);
+    FD_SET(c->sock, &fds);
+    timeout.tv_sec = millisec_timeout/1000;
+    timeout.tv_usec = (millisec_timeout - timeout.tv_sec*1000)*1000;
+    return select(c->sock+1, &fds, 0, 0, &timeout);
+}
+
+static int tcp_receive(EIPConnection *c, CN_USINT *data, size_t size)
+{
+    int part;
+
+    set_nonblock(c->sock, 1);
+    part = recv(c->sock, (char *)data, size, 0);
+    set_nonblock(c->sock, 0);
+    return part;
+}
+
+static void tcp_close(EIPConnection *c)
+{
+    EIP_socket_close (c->sock);
+}
+
+static const EIPTransport tcp_transport =
+{
+    "TCP", tcp_open, tcp_send, tcp_poll, tcp_receive, tcp_close
+};
+
+/* Transport for connections opened from now on, 0 for TCP */
+static const EIPTransport *connect_transport = 0;
+
+void EIP_set_transport(const EIPTransport *transport)
+{
+    connect_transport = transport;
+}
+
+/********************************************************
+ * Capture and replay of connection buffers
+ ********************************************************/
+
+#define PCAP_MAGIC          0xA1B2C3D4
+#define PCAP_MAGIC_NSEC     0xA1B23C4D /* same, but nanosecond stamps */
+#define PCAP_LINKTYPE_ETHER 1
+#define PCAP_LINKTYPE_RAW   101        /* IPv4 packets, no link layer */
+#define PCAP_IP_TCP_SIZE    40         /* IPv4 and TCP headers we write */
+
+static FILE         *capture_file = 0;
+static epicsMutexId capture_lock = 0;
+static char         *replay_file = 0;
+static epicsMutexId replay_lock = 0;
+
+static CN_UDINT swap_UDINT(CN_UDINT value)
+{
+    return (value << 24) | ((value & 0xFF00) << 8) |
+           ((value >> 8) & 0xFF00) | (value >> 24);
+}
+
+/* IP and TCP headers use big endian */
+static CN_USINT *put_net_UINT(CN_USINT *buf, CN_UINT value)
+{
+    *(buf++) = value >> 8;
+    *(buf++) = value & 0xFF;
+    return buf;
+}
+
+static CN_USINT *put_net_UDINT(CN_USINT *buf, CN_UDINT value)
+{
+    buf = put_net_UINT(buf, (CN_UINT) (value >> 16));
+    return put_net_UINT(buf, (CN_UINT) (value & 0xFFFF));
+}
+
+static CN_UINT get_net_UINT(const CN_USINT *buf)
+{
+    return (CN_UINT) ((buf[0] << 8) | buf[1]);
+}
+
+static CN_UDINT get_net_UDINT(const CN_USINT *buf)
+{
+    return ((CN_UDINT) get_net_UINT(buf) << 16) | get_net_UINT(buf+2);
+}
+
+eip_bool EIP_capture(const char *filename)
+{
+    CN_UDINT magic = PCAP_MAGIC, zone = 0, sigfigs = 0,
+             snaplen = 65535, linktype = PCAP_LINKTYPE_RAW;
+    CN_UINT  major = 2, minor = 4;
+    FILE     *file = 0, *old;
+
+    if (! capture_lock)
+        capture_lock = epicsMutexCreate();
+    if (filename  &&  *filename)
+    {
+        file = fopen(filename, "wb");
+        if (! file)
+        {
+            EIP_printf(1, "EIP cannot create capture file '%s'\n", filename);
+            return false;
+        }
+        if (fwrite(&magic,    sizeof(magic),    1, file) != 1  ||
+            fwrite(&major,    sizeof(major),    1, file) != 1  ||
+            fwrite(&minor,    sizeof(minor),    1, file) != 1  ||
+            fwrite(&zone,     sizeof(zone),     1, file) != 1  ||
+            fwrite(&sigfigs,  sizeof(sigfigs),  1, file) != 1  ||
+            fwrite(&snaplen,  sizeof(snaplen),  1, file) != 1  ||
+            fwrite(&linktype, sizeof(linktype), 1, file) != 1)
+        {
+            EIP_printf(1, "EIP cannot write capture file '%s'\n", filename);
+            fclose(file);
+            return false;
+        }
+    }
+    epicsMutexLock(capture_lock);
+    old = capture_file;
+    capture_file = file;
+    epicsMutexUnlock(capture_lock);
+    if (old)
+        fclose(old);
+    return true;
+}
+
+/* Write message as IPv4/TCP packet to capture file */
+static void capture_message(EIPConnection *c, eip_bool sent,
+                            const CN_USINT *data, size_t size)
+{
+    CN_USINT       headers[PCAP_IP_TCP_SIZE], *buf;
+    CN_UDINT       record[4], sum;
+    epicsTimeStamp now;
+    int            dir = sent ? 0 : 1;
+    size_t         i;
+
+    if (! capture_file)
+        return;
+    epicsTimeGetCurrent(&now);
+    record[0] = now.secPastEpoch + POSIX_TIME_AT_EPICS_EPOCH;
+    record[1] = now.nsec / 1000;
+    record[2] = record[3] = PCAP_IP_TCP_SIZE + size;
+    /* IPv4 */
+    buf = headers;
+    *(buf++) = 0x45;                 /* version 4, 5 UDINTs of header */
+    *(buf++) = 0;                    /* type of service */
+    buf = put_net_UINT(buf, (CN_UINT) (PCAP_IP_TCP_SIZE + size));
+    buf = put_net_UINT(buf, 0);      /* identification */
+    buf = put_net_UINT(buf, 0x4000); /* don't fragment */
+    *(buf++) = 64;                   /* time to live */
+    *(buf++) = 6;                    /* TCP */
+    buf = put_net_UINT(buf, 0);      /* checksum, see below */
+    buf = put_net_UDINT(buf, sent ? c->local_ip : c->peer_ip);
+    buf = put_net_UDINT(buf, sent ? c->peer_ip : c->local_ip);
+    for (sum=0, i=0; i<20; i+=2)
+        sum += get_net_UINT(headers+i);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum += sum >> 16;
+    put_net_UINT(headers+10, (CN_UINT) ~sum);
+    /* TCP, checksum left 0 */
+    buf = put_net_UINT(buf, sent ? c->local_port : c->peer_port);
+    buf = put_net_UINT(buf, sent ? c->peer_port : c->local_port);
+    buf = put_net_UDINT(buf, c->capture_seq[dir]);
+    buf = put_net_UDINT(buf, c->capture_seq[!dir]);
+    *(buf++) = 5 << 4;               /* 5 UDINTs of header */
+    *(buf++) = 0x18;                 /* PSH, ACK */
+    buf = put_net_UINT(buf, 0xFFFF); /* window */
+    buf = put_net_UINT(buf, 0);      /* checksum */
+    buf = put_net_UINT(buf, 0);      /* urgent pointer */
+    c->capture_seq[dir] += size;
+
+    epicsMutexLock(capture_lock);
+    if (capture_file)
+    {
+        fwrite(record,  sizeof(record),  1, capture_file);
+        fwrite(headers, sizeof(headers), 1, capture_file);
+        fwrite(data, size, 1, capture_file);
+    }
+    epicsMutexUnlock(capture_lock);
+}
+
+/* Replay state of a connection.
+ * Each connection replays one recorded TCP connection to its peer,
+ * identified by the local port in the capture.
+ */
+typedef struct ReplayData
+{
+    struct ReplayData *next; /* in replay_streams */
+    FILE          *file;
+    eip_bool      swapped;   /* file in other byte order */
+    size_t        link_size; /* bytes before IP header */
+    CN_UDINT      peer_ip;
+    CN_UINT       peer_port;
+    CN_UINT       local_port;/* of replayed connection, 0 until known */
+    size_t        offset;    /* in current message of replayed connection */
+    CN_UINT       length;    /* of current message after its header */
+    TransactionID tid;       /* of last request sent */
+}   ReplayData;
+
+/* Open replay connections, guarded by replay_lock */
+static ReplayData *replay_streams = 0;
+
+/* Open replay_file for connection */
+static eip_bool replay_open(EIPConnection *c, const char *ip_addr)
+{
+    ReplayData *replay = (ReplayData *) calloc(1, sizeof(ReplayData));
+    CN_UDINT   magic, fields[5]; /* version, zone, sigfigs, snaplen, linktype */
+
+    if (! replay)
+    {
+        EIP_printf(1, "EIP cannot allocate replay data\n");
+        return false;
+    }
+    epicsMutexLock(replay_lock);
+    replay->file = replay_file ? fopen(replay_file, "rb") : 0;
+    if (! replay->file)
+    {
+        EIP_printf(1, "EIP cannot open replay file '%s'\n",
+                   replay_file ? replay_file : "");
+        epicsMutexUnlock(replay_lock);
+        free(replay);
+        return false;
+    }
+    if (fread(&magic, sizeof(magic), 1, replay->file) == 1  &&
+        fread(fields, sizeof(fields), 1, replay->file) == 1)
+    {
+        replay->swapped = magic != PCAP_MAGIC  &&  magic != PCAP_MAGIC_NSEC;
+        if (replay->swapped)
+        {
+            magic = swap_UDINT(magic);
+            fields[4] = swap_UDINT(fields[4]);
+        }
+        if ((magic == PCAP_MAGIC  ||  magic == PCAP_MAGIC_NSEC)  &&
+            (fields[4] == PCAP_LINKTYPE_RAW  ||
+             fields[4] == PCAP_LINKTYPE_ETHER))
+        {
+            replay->link_size = fields[4] == PCAP_LINKTYPE_ETHER ? 14 : 0;
+            replay->peer_ip = c->peer_ip;
+            replay->peer_port = c->peer_port;
+            replay->next = replay_streams;
+            replay_streams = replay;
+            c->transport_data = replay;
+            c->local_ip = 0x7F000001;
+            c->local_port = 0;
+            EIP_printf (9, "EIP replaying %s:%u from '%s'\n",
+                        ip_addr, c->peer_port, replay_file);
+            epicsMutexUnlock(replay_lock);
+            return true;
+        }
+    }
+    EIP_printf(1, "EIP replay file '%s' is no pcap file "
+               "of IPv4 or Ethernet packets\n", replay_file);
+    epicsMutexUnlock(replay_lock);
+    fclose(replay->file);
+    free(replay);
+    return false;
+}
+
+/* Is recorded TCP connection with given local port
+ * the one replayed by this connection?
+ * The first one that no other replay connection
+ * to the same peer uses becomes this connection's.
+ */
+static eip_bool replay_stream(EIPConnection *c, CN_UINT local_port)
+{
+    ReplayData *replay = (ReplayData *) c->transport_data, *other;
+
+    if (replay->local_port)
+        return replay->local_port == local_port;
+    epicsMutexLock(replay_lock);
+    for (other = replay_streams;  other;  other = other->next)
+        if (other->local_port == local_port  &&
+            other->peer_ip == replay->peer_ip  &&
+            other->peer_port == replay->peer_port)
+            break;
+    if (! other)
+    {
+        replay->local_port = local_port;
+        c->local_port = local_port;
+    }
+    epicsMutexUnlock(replay_lock);
+    return other == 0;
+}
+
+/* Replace transaction ID in the encapsulation headers
+ * of a recorded TCP segment, which may hold parts of messages
+ */
+static void replay_patch_tid(ReplayData *replay, CN_USINT *data, size_t size)
+{
+    size_t i = 0, chunk;
+
+    while (i < size)
+    {
+        if (replay->offset < sizeof_EncapsulationHeader)
+        {   /* EncapsulationHeader: length is at 2, transaction ID at 12 */
+            if (replay->offset == 2)
+                replay->length = data[i];
+            else if (replay->offset == 3)
+                replay->length |= (CN_UINT) (data[i] << 8);
+            else if (replay->offset >= 12  &&
+                     replay->offset < 12 + TRANS_ID_LEN)
+                data[i] = replay->tid.byte[replay->offset - 12];
+            ++replay->offset;
+            ++i;
+        }
+        else
+        {   /* Skip message body */
+            chunk = sizeof_EncapsulationHeader + replay->length -
+                    replay->offset;
+            if (chunk > size - i)
+                chunk = size - i;
+            replay->offset += chunk;
+            i += chunk;
+        }
+        if (replay->offset >= sizeof_EncapsulationHeader  &&
+            replay->offset >= sizeof_EncapsulationHeader + replay->length)
+            replay->offset = 0;
+    }
+}
+
+/* Nothing is sent, but response will get this transaction ID */
+static int replay_send(EIPConnection *c, const CN_USINT *data, size_t size)
+{
+    ReplayData *replay = (ReplayData *) c->transport_data;
+
+    memcpy(replay->tid.byte, data+12, TRANS_ID_LEN);
+    return (int) size;
+}
+
+/* Responses are read from the file, no need to wait */
+static int replay_poll(EIPConnection *c, size_t millisec_timeout)
+{
+    return 1;
+}
+
+/* Read next TCP segment that the peer sent
+ * on the replayed connection into 'data'.
+ * Skips all other packets.
+ * Returns size of segment, 0 at end of file.
+ */
+static int replay_receive(EIPConnection *c, CN_USINT *data, size_t size)
+{
+    ReplayData *replay = (ReplayData *) c->transport_data;
+    CN_USINT headers[14+60+60]; /* Ethernet, IPv4 and TCP with options */
+    CN_USINT *ip, *tcp;
+    CN_UDINT record[4];
+    size_t   packet, used, ip_size, tcp_size, total, payload;
+
+    while (fread(record, sizeof(record), 1, replay->file) == 1)
+    {
+        packet = replay->swapped ? swap_UDINT(record[2]) : record[2];
+        used = 0;
+        payload = 0;
+        ip = headers + replay->link_size;
+        tcp = 0;
+        /* Read link layer and IPv4 header, check for IPv4 & TCP */
+        if (packet >= replay->link_size + 20  &&
+            fread(headers, replay->link_size + 20, 1, replay->file) == 1)
+        {
+            used = replay->link_size + 20;
+            ip_size = (ip[0] & 0x0F) * 4;
+            if ((replay->link_size == 0  ||
+                 get_net_UINT(headers+12) == 0x0800)  &&
+                (ip[0] >> 4) == 4  &&  ip[9] == 6  &&  ip_size >= 20  &&
+                packet >= used + ip_size - 20 + 20  &&
+                fread(ip+20, ip_size - 20 + 20, 1, replay->file) == 1)
+            {
+                used += ip_size - 20 + 20;
+                tcp = ip + ip_size;
+            }
+        }
+        /* Read rest of TCP header, determine payload */
+        if (tcp)
+        {
+            tcp_size = (tcp[12] >> 4) * 4;
+            total = get_net_UINT(ip+2);
+            if (tcp_size >= 20  &&  packet >= used + tcp_size - 20  &&
+                (tcp_size == 20  ||
+                 fread(tcp+20, tcp_size - 20, 1, replay->file) == 1))
+            {
+                used += tcp_size - 20;
+                if (total > ip_size + tcp_size)
+                    payload = total - ip_size - tcp_size;
+                if (payload > packet - used)
+                    payload = packet - used;
+            }
+        }
+        /* Data from the peer on the replayed connection? */
+        if (payload > 0  &&  payload <= size  &&
+            get_net_UDINT(ip+12) == c->peer_ip  &&
+            get_net_UINT(tcp) == c->peer_port  &&
+            replay_stream(c, get_net_UINT(tcp+2))  &&
+            fread(data, payload, 1, replay->file) == 1)
+        {
+            used += payload;
+            if (packet > used)
+                fseek(replay->file, (long) (packet - used), SEEK_CUR);
+            replay_patch_tid(replay, data, payload);
+            return (int) payload;
+        }
+        if (packet > used  &&
+            fseek(replay->file, (long) (packet - used), SEEK_CUR) != 0)
+            break;
+    }
+    EIP_printf(2, "EIP replay has no more responses\n");
+    return 0;
+}
+
+static void replay_close(EIPConnection *c)
+{
+    ReplayData *replay = (ReplayData *) c->transport_data, **link;
+
+    epicsMutexLock(replay_lock);
+    for (link = &replay_streams;  *link;  link = &(*link)->next)
+        if (*link == replay)
+        {
+            *link = replay->next;
+            break;
+        }
+    epicsMutexUnlock(replay_lock);
+    fclose(replay->file);
+    free(replay);
+    c->transport_data = 0;
+}
+
+static const EIPTransport replay_transport =
+{
+    "Replay", replay_open, replay_send, replay_poll, replay_receive, replay_close
+};
+
+eip_bool EIP_replay(const char *filename)
+{
+    char *name = 0, *old;
+
+    if (! replay_lock)
+        replay_lock = epicsMutexCreate();
+    if (filename  &&  *filename)
+    {
+        name = EIP_strdup(filename);
+        if (! name)
+            return false;
+    }
+    epicsMutexLock(replay_lock);
+    old = replay_file;
+    replay_file = name;
+    connect_transport = name ? &replay_transport : 0;
+    epicsMutexUnlock(replay_lock);
+    free(old);
+    return true;
+}
+
+/********************************************************
+ * Loopback transport to a target within this process
+ ********************************************************/
+
+static const EIPLoopbackTarget *loopback_target = 0;
+
+/* Loopback state of a connection */
+typedef struct
+{
+    const EIPLoopbackTarget *target;
+    void           *state;      /* target's state for the connection */
+    const CN_USINT *reply;      /* part of reply not yet received */
+    size_t         reply_size;
+}   LoopbackData;
+
+static eip_bool loopback_open(EIPConnection *c, const char *ip_addr)
+{
+    LoopbackData *loopback = (LoopbackData *) calloc(1, sizeof(LoopbackData));
+
+    if (! loopback)
+    {
+        EIP_printf(1, "EIP cannot allocate loopback data\n");
+        return false;
+    }
+    loopback->target = loopback_target;
+    loopback->state = loopback->target->open(c->peer_ip, c->peer_port);
+    if (! loopback->state)
+    {
+        EIP_printf (3, "EIP loopback target rejects %s:%u\n",
+                    ip_addr, c->peer_port);
+        free(loopback);
+        return false;
+    }
+    c->transport_data = loopback;
+    c->local_ip = 0x7F000001;
+    c->local_port = 0;
+    EIP_printf (9, "EIP loopback to %s:%u\n", ip_addr, c->peer_port);
+    return true;
+}
+
+/* Target handles the request right away */
+static int loopback_send(EIPConnection *c, const CN_USINT *data, size_t size)
+{
+    LoopbackData *loopback = (LoopbackData *) c->transport_data;
+
+    loopback->reply = loopback->target->handle(loopback->state, data, size,
+                                               &loopback->reply_size);
+    if (! loopback->reply)
+        loopback->reply_size = 0;
+    return (int) size;
+}
+
+/* Reply is available right away, or never */
+static int loopback_poll(EIPConnection *c, size_t millisec_timeout)
+{
+    LoopbackData *loopback = (LoopbackData *) c->transport_data;
+
+    return loopback->reply_size > 0;
+}
+
+static int loopback_receive(EIPConnection *c, CN_USINT *data, size_t size)
+{
+    LoopbackData *loopback = (LoopbackData *) c->transport_data;
+
+    if (size > loopback->reply_size)
+        size = loopback->reply_size;
+    memcpy(data, loopback->reply, size);
+    loopback->reply += size;
+    loopback->reply_size -= size;
+    return (int) size;
+}
+
+static void loopback_close(EIPConnection *c)
+{
+    LoopbackData *loopback = (LoopbackData *) c->transport_data;
+
+    loopback->target->close(loopback->state);
+    free(loopback);
+    c->transport_data = 0;
+}
+
+static const EIPTransport loopback_transport =
+{
+    "Loopback", loopback_open, loopback_send, loopback_poll,
+    loopback_receive, loopback_close
+};
+
+void EIP_loopback(const EIPLoopbackTarget *target)
+{
+    loopback_target = target;
+    connect_transport = target ? &loopback_transport : 0;
+}
+
+/* Init. connection:
+ * Init. fields,
+ * connect to target via the selected transport
+ */
+eip_bool EIP_connect(EIPConnection *c,
+                     const char *ip_addr, unsigned short port,
+                     unsigned short slot,
+                     size_t millisec_timeout)
+{
+    struct in_addr addr;
+    eip_bool       same_peer;
+
+    c->millisec_timeout = millisec_timeout;
+    c->slot = slot;
+
+    /* Get IP from ip_addr in '123.456.789.123' format ...
+     * unless it's the address of the previous, good connection,
+     * so reconnecting doesn't wait for the name server */
+    same_peer = c->peer_name  &&  strcmp(c->peer_name, ip_addr) == 0;
+    if (! (same_peer  &&  c->peer_checked))
+    {
+        c->peer_checked = false;
+        if (hostToIPAddr(ip_addr, &addr) >= 0)
+            c->peer_ip = ntohl(addr.s_addr);
+        else if (same_peer)
+            EIP_printf (2, "EIP cannot find IP for '%s', using previous IP\n",
+                        ip_addr);
+        else
+        {
+            EIP_printf (2, "EIP cannot find IP for '%s'\n",
+                        ip_addr);
+            return false;
+        }
+        if (! same_peer)
+        {
+            free(c->peer_name);
+            c->peer_name = EIP_strdup(ip_addr);
+            /* Round trips and limit of a previous peer don't apply */
+            c->srtt = c->rttvar = 0.0;
+            c->probed_buffer_limit = 0;
+        }
+    }
+    c->transfer_buffer_limit = c->probed_buffer_limit ?
+                               c->probed_buffer_limit : EIP_buffer_limit;
+    c->sent_time = 0.0;
+    c->peer_port = port;
+    if (c->sock != 0)
+        EIP_printf (2, "EIP_connect found open socket\n");
+    c->transport = connect_transport ? connect_transport : &tcp_transport;
+    if (! c->transport->open(c, ip_addr))
+    {   /* Check address and services again on next attempt */
+        c->peer_checked = false;
+        c->sock = 0;
+        return false;
+    }
+    if (c->sock == 0) /* Mark as connected */
+        c->sock = EIP_INVALID_SOCKET;
     return true;
 }
 
@@ -2123,10 +3116,57 @@ static void EIP_disconnect (EIPConnection *c)
 {
     EIP_printf (9, "EIP disconnecting socket %d\n", c->sock);
 
-    EIP_socket_close (c->sock);
+    if (c->sock)
+        c->transport->close(c);
     c->sock = 0;
 }
 
+/* Clock for round trip times, secs */
+static double rtt_clock()
+{
+#if defined(VERSION_INT)  &&  EPICS_VERSION_INT >= VERSION_INT(3,16,1,0)
+    return epicsMonotonicGet() * 1e-9;
+#else
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    return now.secPastEpoch + now.nsec * 1e-9;
+#endif
+}
+
+/* Update smoothed round trip time and its variation
+ * (as for TCP retransmission timer, RFC 6298)
+ */
+static void update_rtt(EIPConnection *c, double rtt)
+{
+    double delta;
+
+    if (c->srtt <= 0.0)
+    {
+        c->srtt = rtt;
+        c->rttvar = rtt / 2;
+    }
+    else
+    {
+        delta = c->srtt > rtt ? c->srtt - rtt : rtt - c->srtt;
+        c->rttvar = 0.75*c->rttvar + 0.25*delta;
+        c->srtt = 0.875*c->srtt + 0.125*rtt;
+    }
+}
+
+size_t EIP_read_timeout(const EIPConnection *c)
+{
+    double timeout;
+
+    if (c->millisec_min_timeout <= 0  ||  c->srtt <= 0.0)
+        return c->millisec_timeout;
+    timeout = (c->srtt + 4*c->rttvar) * 1000.0;
+    if (timeout < c->millisec_min_timeout)
+        return c->millisec_min_timeout;
+    if (timeout > c->millisec_timeout)
+        return c->millisec_timeout;
+    return (size_t) timeout;
+}
+
 eip_bool EIP_send_connection_buffer(EIPConnection *c)
 {
     CN_UINT length;
@@ -2135,10 +3175,15 @@ eip_bool EIP_send_connection_buffer(EIPConnection *c)
 
     unpack_UINT(c->buffer+2, &length);
     len = sizeof_EncapsulationHeader + length;
-    ok = send(c->sock, (void *)c->buffer, len, 0) == len;
+    ok = c->transport->send(c, c->buffer, len) == len;
 
     EIP_printf(9, "Data sent (%d bytes):\n", len);
     EIP_hexdump(9, c->buffer, len);
+    if (ok)
+    {
+        capture_message(c, true, c->buffer, len);
+        c->sent_time = rtt_clock();
+    }
 
     return ok;
 }
@@ -2158,35 +3203,29 @@ eip_bool EIP_read_connection_buffer(EIPConnection *c)
     eip_bool checked = false; /* Checked EncapsulationHeader for message size? */
     int part;                 /* Size of partial reply */
     int needed=0;             /* Total size of reply (valid when 'checked') */
-    fd_set fds;
-    struct timeval timeout;
     CN_UINT length;
+    size_t timeout = EIP_read_timeout(c);
+    double rtt;
 
-    set_nonblock(c->sock, 1);
     do
     {
-        /* Check for availability of data.
-         * Reset all select() arguments to be portable with
-         * implementations that might update timeout.
-         */
-        // TODO Should use poll() instead of select(),
-        //      but vxWorks only offers select()...
-        FD_ZERO(&fds);
-        FD_SET(c->sock, &fds);
-        timeout.tv_sec = c->millisec_timeout/1000;
-        timeout.tv_usec = (c->millisec_timeout - timeout.tv_sec*1000)*1000;
-        if (select(c->sock+1, &fds, 0, 0, &timeout) <= 0)
+        /* Check for availability of data */
+        if (c->transport->poll(c, timeout) <= 0)
         {
-            EIP_printf(2, "EIP read timeout after receiving %d bytes\n", got);
+            EIP_printf(2, "EIP read timeout (%u ms) after receiving %d bytes\n",
+                       (unsigned) timeout, got);
+            /* Back off: Next time wait longer, up to millisec_timeout */
+            c->rttvar = c->rttvar*2 + c->srtt;
+            c->sent_time = 0.0;
             ok = false;
             break;
         }
-        /* Select shows there's data, read some */
+        /* Poll shows there's data, read some */
         /* TODO Read exact message size.
          * Once the 'needed' message size is known, maybe
          * we should only read up to that message size?
          */
-        part = recv(c->sock, ((char *)c->buffer + got), EIP_BUFFER_SIZE - got, 0);
+        part = c->transport->receive(c, c->buffer + got, EIP_BUFFER_SIZE - got);
         if (part <= 0)
         {
             EIP_printf(2, "EIP end-of-data after receiving %d bytes\n", got);
@@ -2212,10 +3251,20 @@ eip_bool EIP_read_connection_buffer(EIPConnection *c)
         }
     }
     while (got < sizeof_EncapsulationHeader  ||  got < needed);
-    set_nonblock (c->sock, 0);
 
     EIP_printf(9, "Data Received (%d bytes):\n", got);
     EIP_hexdump(9, c->buffer, got);
+    if (ok)
+    {
+        capture_message(c, false, c->buffer, got);
+        if (c->sent_time > 0.0)
+        {
+            rtt = rtt_clock() - c->sent_time;
+            if (rtt >= 0.0)
+                update_rtt(c, rtt);
+            c->sent_time = 0.0;
+        }
+    }
 
     return ok;
 }
@@ -2535,32 +3584,18 @@ typedef char CIPTypeInfoBuffer[50];
  */
 static const char *decode_extended_type(CN_UINT type, CIPTypeInfoBuffer buffer)
 {
-    if ((type & 0xE000) == 0x0000)
-        switch (type & 0x0FFF)
-        {
-            case T_CIP_BOOL:   strcpy(buffer, "BOOL");  return buffer;
-            case T_CIP_SINT:   strcpy(buffer, "SINT");  return buffer;
-            case T_CIP_INT:    strcpy(buffer, "INT");   return buffer;
-            case T_CIP_UINT:   strcpy(buffer, "UINT");  return buffer;
-            case T_CIP_DINT:   strcpy(buffer, "DINT");  return buffer;
-            case T_CIP_LINT:   strcpy(buffer, "LINT");  return buffer;
-            case T_CIP_ULINT:  strcpy(buffer, "ULINT"); return buffer;
-            case T_CIP_REAL:   strcpy(buffer, "REAL");  return buffer;
-            case T_CIP_LREAL:  strcpy(buffer, "LREAL"); return buffer;
-        }
-    else if ((type & 0xE000) == 0x2000)
-        switch (type & 0x0FFF)
-        {
-            case T_CIP_BOOL:   strcpy(buffer, "BOOL[]");  return buffer;
-            case T_CIP_SINT:   strcpy(buffer, "SINT[]");  return buffer;
-            case T_CIP_INT:    strcpy(buffer, "INT[]");   return buffer;
-            case T_CIP_UINT:   strcpy(buffer, "UINT[]");  return buffer;
-            case T_CIP_DINT:   strcpy(buffer, "DINT[]");  return buffer;
-            case T_CIP_LINT:   strcpy(buffer, "LINT[]");  return buffer;
-            case T_CIP_ULINT:  strcpy(buffer, "ULINT[]"); return buffer;
-            case T_CIP_REAL:   strcpy(buffer, "REAL[]");  return buffer;
-            case T_CIP_LREAL:  strcpy(buffer, "LREAL[]"); return buffer;
-        }
+    const char *name = CIP_Type_name((CIP_Type) (type & 0x0FFF));
+
+    if ((type & 0xE000) == 0x0000  &&  name)
+    {
+        strcpy(buffer, name);
+        return buffer;
+    }
+    else if ((type & 0xE000) == 0x2000  &&  name)
+    {
+        sprintf(buffer, "%s[]", name);
+        return buffer;
+    }
     else if ((type & 0xE000) == 0xA000)
         switch (type & 0x0FFF)
         {
@@ -3012,12 +4047,13 @@ const CN_USINT *EIP_unpack_RRData (const CN_USINT *buf,
     return next;
 }
 
-/* Send unconnected GetAttributeSingle service request to class/instance/attr
+/* Send unconnected GetAttributeSingle or ..All service request
+ * to class/instance/attr (attr 0 for All)
  *
  * Result: ptr to data or 0,
  * len is set to length of data
  */
-void *EIP_Get_Attribute_Single(EIPConnection *c,
+static void *EIP_Get_Attribute(EIPConnection *c, CN_Services service_code,
                                CN_Classes cls, CN_USINT instance,
                                CN_USINT attr, size_t *len)
 {
@@ -3036,25 +4072,25 @@ void *EIP_Get_Attribute_Single(EIPConnection *c,
     request = EIP_make_SendRRData(c, request_size, &tid);
     if (! request)
         return 0;
-    path = make_MR_Request(request, S_Get_Attribute_Single, path_size);
+    path = make_MR_Request(request, service_code, path_size);
     make_CIA_path(path, cls, instance, attr);
     if (! EIP_send_connection_buffer(c))
     {
-        EIP_printf(2, "EIP_Get_Attribute_Single: send failed\n");
+        EIP_printf(2, "EIP %s: send failed\n", service_name(service_code));
         return 0;
     }
     if (! EIP_read_connection_buffer(c))
     {
-        EIP_printf(2, "EIP_Get_Attribute_Single: No response\n");
+        EIP_printf(2, "EIP %s: No response\n", service_name(service_code));
         return 0;
     }
 
     response = EIP_unpack_RRData((CN_USINT *)c->buffer, &data);
     unpack(response, "sSs", &service, &general_status);
-    if (service != (S_Get_Attribute_Single | 0x80)  ||
+    if (service != (service_code | 0x80)  ||
         general_status != 0)
     {
-        EIP_printf(2, "EIP_Get_Attribute_Single: error in response\n");
+        EIP_printf(2, "EIP %s: error in response\n", service_name(service_code));
         if (EIP_verbosity >= 3)
             EIP_dump_raw_MR_Response(response, data.data_length);
         return 0;
@@ -3067,8 +4103,8 @@ void *EIP_Get_Attribute_Single(EIPConnection *c,
         char tid_str[32], rid_str[32];
         transactionIdString(&tid,tid_str,sizeof(tid_str));
         transactionIdString(&rid,rid_str,sizeof(rid_str));
-        EIP_printf (2, "EIP_Get_Attribute_Single: Transaction id mismatch, got %s expected %s\n",
-                    rid_str,tid_str);
+        EIP_printf (2, "EIP %s: Transaction id mismatch, got %s expected %s\n",
+                    service_name(service_code), rid_str,tid_str);
         dump_EncapsulationHeader (&data.header);
         return 0;
     }
@@ -3079,7 +4115,54 @@ void *EIP_Get_Attribute_Single(EIPConnection *c,
     return attrib;
 }
 
-static eip_bool EIP_check_interface(EIPConnection *c)
+void *EIP_Get_Attribute_Single(EIPConnection *c,
+                               CN_Classes cls, CN_USINT instance,
+                               CN_USINT attr, size_t *len)
+{
+    return EIP_Get_Attribute(c, S_Get_Attribute_Single,
+                             cls, instance, attr, len);
+}
+
+void *EIP_Get_Attribute_All(EIPConnection *c,
+                            CN_Classes cls, CN_USINT instance, size_t *len)
+{
+    return EIP_Get_Attribute(c, S_Get_Attribute_All, cls, instance, 0, len);
+}
+
+/* Get identity from the attributes of the Identity object
+ * in one request:
+ * vendor, device type, product code, revision, status,
+ * serial number, product name (SHORT_STRING), ...
+ */
+static eip_bool EIP_get_identity(EIPConnection *c)
+{
+    EIPIdentityInfo *info = &c->info;
+    const CN_USINT  *data;
+    CN_UINT         product_code, status;
+    CN_USINT        name_len;
+    size_t          len;
+
+    data = EIP_Get_Attribute_All(c, C_Identity, 1, &len);
+    if (!data  ||  len < 15)
+        return false;
+    data = unpack_UINT(data, &info->vendor);
+    data = unpack_UINT(data, &info->device_type);
+    data = unpack_UINT(data, &product_code);
+    data = unpack_UINT(data, &info->revision);
+    data = unpack_UINT(data, &status);
+    data = unpack_UDINT(data, &info->serial_number);
+    name_len = *data++;
+    if (15 + (size_t)name_len > len  ||  name_len >= sizeof(info->name))
+        return false;
+    memcpy(info->name, data, name_len);
+    info->name[name_len] = '\0';
+    return true;
+}
+
+/* Get identity one attribute at a time,
+ * for targets that don't support Get_Attribute_All
+ */
+static eip_bool EIP_get_identity_attributes(EIPConnection *c)
 {
     EIPIdentityInfo  *info = &c->info;
     void *data;
@@ -3111,6 +4194,15 @@ static eip_bool EIP_check_interface(EIPConnection *c)
         info->name[len] = '\0';
     }
     else return false;
+    return true;
+}
+
+static eip_bool EIP_check_interface(EIPConnection *c)
+{
+    EIPIdentityInfo  *info = &c->info;
+
+    if (! (EIP_get_identity(c)  ||  EIP_get_identity_attributes(c)))
+        return false;
     EIP_printf(9, "------------------------------\n");
     EIP_printf(9, "Identity information of target:\n");
     EIP_printf(9, "    UINT vendor         = 0x%04X\n", info->vendor);
@@ -3122,6 +4214,248 @@ static eip_bool EIP_check_interface(EIPConnection *c)
     return true;
 }
 
+/* Probe for the buffer limit with MultiRequests for the identity
+ * of the PLC in c->slot: Get_Attribute_All requests have
+ * large replies, Get_Attribute_Single requests for the vendor
+ * small replies.
+ * Probe 'n' sends all + n*all_step Get_Attribute_All
+ * and single + n*single_step Get_Attribute_Single requests.
+ */
+typedef struct
+{
+    EIPConnection *c;
+    size_t        max;          /* largest limit to try */
+    size_t        all_request;  /* size of each request and reply */
+    size_t        all_reply;    /* .. 0 if not supported */
+    size_t        single_request;
+    size_t        single_reply;
+    size_t        all, single;
+    size_t        all_step, single_step;
+}   BufferProbe;
+
+static size_t probe_count(const BufferProbe *probe, size_t n)
+{
+    return probe->all + probe->single
+         + n * (probe->all_step + probe->single_step);
+}
+
+/* Larger of MultiRequest and response size for probe n */
+static size_t probe_size(const BufferProbe *probe, size_t n)
+{
+    size_t all = probe->all + n * probe->all_step;
+    size_t single = probe->single + n * probe->single_step;
+    size_t request  = CIP_MultiRequest_size(all + single,
+                                            all * probe->all_request +
+                                            single * probe->single_request);
+    size_t response = CIP_MultiResponse_size(all + single,
+                                             all * probe->all_reply +
+                                             single * probe->single_reply);
+    return request > response ? request : response;
+}
+
+/* Send probe n.
+ * Returns 1 when the PLC handled all requests, 0 when it refused,
+ * -1 on network errors.
+ */
+static int probe_transfer(BufferProbe *probe, size_t n, size_t *response_size)
+{
+    EIPConnection  *c = probe->c;
+    EncapsulationRRData rr_data;
+    TransactionID  tid, rid;
+    size_t         all = probe->all + n * probe->all_step;
+    size_t         count = probe_count(probe, n), multi_size, i;
+    CN_USINT       *send_request, *multi_request, *request;
+    const CN_USINT *response, *replies[CIP_MultiRequest_max_count];
+    size_t         reply_sizes[CIP_MultiRequest_max_count];
+
+    multi_size = CIP_MultiRequest_size(count,
+                                       all * probe->all_request +
+                                       (count-all) * probe->single_request);
+    generateTransactionId(&tid);
+    send_request = EIP_make_SendRRData(c, CM_Unconnected_Send_size(multi_size),
+                                       &tid);
+    if (! send_request)
+        return 0;
+    multi_request = make_CM_Unconnected_Send(send_request, multi_size, c->slot);
+    if (! (multi_request  &&  prepare_CIP_MultiRequest(multi_request, count)))
+        return 0;
+    for (i=0; i<count; ++i)
+    {
+        if (i < all)
+        {
+            request = CIP_MultiRequest_item(multi_request, i,
+                                            probe->all_request);
+            if (! request)
+                return 0;
+            make_CIA_path(make_MR_Request(request, S_Get_Attribute_All,
+                                          CIA_path_size(C_Identity, 1, 0)),
+                          C_Identity, 1, 0);
+        }
+        else
+        {
+            request = CIP_MultiRequest_item(multi_request, i,
+                                            probe->single_request);
+            if (! request)
+                return 0;
+            make_CIA_path(make_MR_Request(request, S_Get_Attribute_Single,
+                                          CIA_path_size(C_Identity, 1, 1)),
+                          C_Identity, 1, 1);
+        }
+    }
+    if (! (EIP_send_connection_buffer(c)  &&  EIP_read_connection_buffer(c)))
+        return -1;
+    response = EIP_unpack_RRData(c->buffer, &rr_data);
+    extractTransactionId(&rr_data.header, &rid);
+    if (! compareTransactionIds(&tid, &rid))
+        return -1;
+    *response_size = rr_data.data_length;
+    EIP_printf(8, "EIP buffer probe %u+%u requests, %u / %u bytes: "
+               "status 0x%02X\n", (unsigned)all, (unsigned)(count-all),
+               (unsigned)multi_size, (unsigned)rr_data.data_length,
+               response[2]);
+    if (response[0] == (S_CIP_MultiRequest|0x80)  &&  response[2] == 0  &&
+        get_CIP_MultiRequest_Responses(response, rr_data.data_length,
+                                       CIP_MultiRequest_max_count,
+                                       replies, reply_sizes) == count)
+        return 1;
+    return 0;
+}
+
+/* Find largest probe n that works, binary search from the n
+ * that fits c->transfer_buffer_limit (assumed to work)
+ * to the one that fits max.
+ * Sets n and its size.
+ * Returns false on network errors.
+ */
+static eip_bool probe_search(BufferProbe *probe, size_t *n, size_t *size)
+{
+    size_t lo, hi, mid, response_size;
+    int    ok;
+
+    /* lo: n known to work, hi: first n that won't fit */
+    for (lo = 0;  probe_count(probe, lo+1) <= CIP_MultiRequest_max_count  &&
+           probe_size(probe, lo+1) <= probe->c->transfer_buffer_limit;  ++lo)
+        ;
+    for (hi = lo+1;  probe_count(probe, hi) <= CIP_MultiRequest_max_count  &&
+           probe_size(probe, hi) <= probe->max;  ++hi)
+        ;
+    /* Try the largest n first, most PLCs will handle it */
+    mid = hi - 1;
+    while (lo < hi - 1)
+    {
+        ok = probe_transfer(probe, mid, &response_size);
+        if (ok < 0)
+            return false;
+        if (ok)
+            lo = mid;
+        else
+            hi = mid;
+        mid = (lo + hi) / 2;
+    }
+    *n = lo;
+    *size = probe_size(probe, lo);
+    return true;
+}
+
+size_t EIP_max_buffer_limit()
+{   /* MultiRequest in Unconnected_Send in RRData must fit the buffer,
+     * one byte for padding */
+    size_t request = EIP_BUFFER_SIZE - sizeof_EncapsulationRRData
+                     - CM_Unconnected_Send_size(0) - 1;
+    size_t response = EIP_BUFFER_SIZE - sizeof_EncapsulationRRData;
+    return request < response ? request : response;
+}
+
+eip_bool EIP_probe_buffer_limit(EIPConnection *c)
+{
+    BufferProbe probe;
+    size_t      n, request_limit, response_limit = 0, response_size;
+    int         ok;
+    eip_bool    done;
+
+    memset(&probe, 0, sizeof(probe));
+    probe.c = c;
+    probe.max = EIP_max_buffer_limit();
+    probe.all_request = MR_Request_size(CIA_path_size(C_Identity, 1, 0));
+    probe.single_request = MR_Request_size(CIA_path_size(C_Identity, 1, 1));
+    probe.single_reply = 4 + sizeof(CN_UINT);
+    if (c->transfer_buffer_limit >= probe.max)
+        return true;
+    /* Check support for Get_Attribute_All, learn size of its reply */
+    probe.all = 1;
+    ok = probe_transfer(&probe, 0, &response_size);
+    if (ok > 0)
+        probe.all_reply = response_size - CIP_MultiResponse_size(1, 0);
+    /* Small requests with small replies probe the request size */
+    probe.all = 0;
+    probe.single_step = 1;
+    done = ok >= 0  &&  probe_search(&probe, &n, &request_limit);
+    if (done  &&  probe.all_reply > 0)
+    {   /* Large replies, then small ones to fill up, the response size */
+        probe.all_step = 1;
+        probe.single_step = 0;
+        done = probe_search(&probe, &n, &response_limit);
+        if (done)
+        {
+            probe.all = n;
+            probe.all_step = 0;
+            probe.single_step = 1;
+            done = probe_search(&probe, &n, &response_limit);
+        }
+        if (response_limit < request_limit)
+            request_limit = response_limit;
+    }
+    if (! done)
+    {
+        EIP_printf(2, "EIP buffer probe failed, using %u bytes\n",
+                   (unsigned)c->transfer_buffer_limit);
+        c->probed_buffer_limit = c->transfer_buffer_limit;
+        return false;
+    }
+    if (request_limit > c->transfer_buffer_limit)
+        c->transfer_buffer_limit = request_limit;
+    c->probed_buffer_limit = c->transfer_buffer_limit;
+    c->probed_slot = c->slot;
+    EIP_printf(4, "EIP buffer limit for slot %d: %u bytes\n",
+               c->slot, (unsigned)c->transfer_buffer_limit);
+    return true;
+}
+
+void EIP_reduce_buffer_limit(EIPConnection *c, size_t failed_size)
+{
+    size_t limit = failed_size - failed_size/16;
+
+    if (limit > c->transfer_buffer_limit)
+        limit = c->transfer_buffer_limit;
+    if (limit < EIP_MIN_BUFFER_LIMIT)
+        limit = EIP_MIN_BUFFER_LIMIT;
+    if (limit == c->transfer_buffer_limit)
+        return;
+    EIP_printf(2, "EIP transfer of %u bytes was too large, "
+               "reducing buffer limit from %u to %u bytes\n",
+               (unsigned)failed_size, (unsigned)c->transfer_buffer_limit,
+               (unsigned)limit);
+    c->transfer_buffer_limit = limit;
+    if (c->probed_buffer_limit)
+        c->probed_buffer_limit = limit;
+}
+
+void EIP_route_slot(EIPConnection *c, int slot)
+{
+    if (c->slot == slot)
+        return;
+    c->slot = slot;
+    if (c->probed_buffer_limit  &&  c->probed_slot != slot  &&
+        c->transfer_buffer_limit > (size_t) EIP_buffer_limit)
+    {
+        EIP_printf(2, "EIP buffer limit probed for slot %d does not apply "
+                   "to slot %d, using %u bytes\n",
+                   c->probed_slot, slot, (unsigned) EIP_buffer_limit);
+        c->transfer_buffer_limit = EIP_buffer_limit;
+        c->probed_buffer_limit = c->transfer_buffer_limit;
+    }
+}
+
 eip_bool EIP_startup(EIPConnection *c,
                  const char *ip_addr, unsigned short port,
                  int slot,
@@ -3134,14 +4468,17 @@ eip_bool EIP_startup(EIPConnection *c,
     if (! EIP_connect(c, ip_addr, port, slot, millisec_timeout))
         return false;
 
-    if (! EIP_list_services(c)  ||
+    /* ListServices only when connecting to peer for the first time */
+    if (! (c->peer_checked  ||  EIP_list_services(c))  ||
         ! EIP_register_session(c))
     {
         EIP_printf(1, "EIP_startup: target %s does not respond\n",
                    ip_addr);
+        c->peer_checked = false;
         EIP_disconnect(c);
         return false;
     }
+    c->peer_checked = true;
 
     if (! EIP_check_interface(c))
     {
@@ -3149,6 +4486,13 @@ eip_bool EIP_startup(EIPConnection *c,
         EIP_printf(1, "EIP_startup: cannot determine target's identity\n");
     }
 
+    /* Probe only when connecting to peer for the first time.
+     * When it fails, keep the connection and EIP_buffer_limit.
+     * A connection that's really broken fails in the next scan.
+     */
+    if (EIP_buffer_probe  &&  ! c->probed_buffer_limit)
+        EIP_probe_buffer_limit(c);
+
     return true;
 }
 
@@ -11,6 +11,9 @@
  * kasemirk@ornl.gov
  */
 
+#ifndef ETHER_IP_H
+#define ETHER_IP_H
+
 #ifndef NO_EPICS
 #include"epicsVersion.h"
 #endif
@@ -94,6 +97,7 @@ typedef int               EIP_SOCKET;
 #endif
 #endif
 
+#include <stdio.h>
 #include "eip_bool.h"
 
 /* This could be an application on its own...
@@ -171,6 +175,15 @@ void EIP_hexdump(int level, const void *_data, int len);
  */
 extern int EIP_buffer_limit;
 
+/** Probe for a larger buffer limit when connecting?
+ *  EIP_startup then tries MultiRequests up to EIP_BUFFER_SIZE,
+ *  using EIP_buffer_limit as the size known to work.
+ */
+extern int EIP_buffer_probe;
+
+/** Lower end when reducing the limit after buffer errors */
+#define EIP_MIN_BUFFER_LIMIT 100
+
 /** Best estimate for EIP_buffer_limit */
 #define EIP_DEFAULT_BUFFER_LIMIT 480
 
@@ -230,6 +243,7 @@ typedef enum /* Spec 4, p.36 */
     S_CIP_MultiRequest     = 0x0A,  /* Logix5000 Data Access */
     S_CIP_ReadData         = 0x4C,  /* Logix5000 Data Access */
     S_CIP_WriteData        = 0x4D,  /* Logix5000 Data Access */
+    S_CIP_ReadModifyWrite  = 0x4E,  /* Logix5000 Data Access */
     S_CM_Unconnected_Send  = 0x52,
     S_CM_Forward_Open      = 0x54,
     S_Get_Instance_Attr_List = 0x55,
@@ -447,6 +461,30 @@ typedef enum
     T_CIP_STRUCT_STRING_BUF = 84
 } CIP_STRUCT_Type;
 
+/* Bytes of one STRING struct element, after the struct type code */
+#define CIP_STRUCT_STRING_size (T_CIP_STRUCT_LEN_BYTES + T_CIP_STRUCT_STRING_BUF)
+
+/* Name and bytes per element of the atomic CIP types,
+ * X(type, name, size), from which CIP_Type_name and CIP_Type_size
+ * are generated. The get_CIP_... and put_CIP_... conversions
+ * still handle each type by itself.
+ * LINT and ULINT are listed separately because
+ * their values are only supported with SUPPORT_LINT.
+ */
+#define CIP_ATOMIC_TYPES(X)       \
+    X(T_CIP_BOOL,  "BOOL",  1)    \
+    X(T_CIP_SINT,  "SINT",  1)    \
+    X(T_CIP_INT,   "INT",   2)    \
+    X(T_CIP_UINT,  "UINT",  2)    \
+    X(T_CIP_DINT,  "DINT",  4)    \
+    X(T_CIP_REAL,  "REAL",  4)    \
+    X(T_CIP_LREAL, "LREAL", 8)    \
+    X(T_CIP_BITS,  "BITS",  4)
+
+#define CIP_LINT_TYPES(X)         \
+    X(T_CIP_LINT,  "LINT",  8)    \
+    X(T_CIP_ULINT, "ULINT", 8)
+
 /* Size of appreviated type code.
  * We only use those with size 2, no structures */
 #define CIP_Typecode_size 2
@@ -455,9 +493,12 @@ typedef enum
  * (Does not work for structs) */
 #define get_CIP_typecode(td)  ( (CIP_Type)  (((CN_USINT *)td)[0]) )
 
-/* Determine byte size of CIP_Type */
+/* Determine byte size of CIP_Type, 0 if not supported */
 size_t CIP_Type_size(CIP_Type type);
 
+/* Name of atomic CIP_Type, or 0 if unknown */
+const char *CIP_Type_name(CIP_Type type);
+
 /* Turn tag string into ParsedTag,
  * convert back into string and free it
  */
@@ -483,11 +524,36 @@ const CN_USINT *check_CIP_ReadData_Response(const CN_USINT *response,
 CN_USINT *make_CIP_WriteData(CN_USINT *buf, size_t buf_size, const ParsedTag *tag,
                              CIP_Type type, size_t elements,
                              CN_USINT *raw_data);
+/* CIP WriteData request for 'elements' of an array tag,
+ * starting at array element 'element'.
+ * raw_data points to the first element to write.
+ */
+size_t CIP_WriteData_range_size(const ParsedTag *tag, size_t element,
+                                CIP_Type type, size_t elements);
+CN_USINT *make_CIP_WriteData_range(CN_USINT *request, const ParsedTag *tag,
+                                   size_t element, CIP_Type type,
+                                   size_t elements, const CN_USINT *raw_data);
 void dump_CIP_WriteRequest(const CN_USINT *request);
 /* Test CIP_WriteData response: If not OK, report error */
 eip_bool check_CIP_WriteData_Response(const CN_USINT *response,
                                   size_t response_size);
 
+/* Logix Read-Modify-Write Tag service:
+ * Set the bits of or_mask, clear those not in and_mask,
+ * both using mask_size bytes (1, 2, 4).
+ * With 'indexed', the request addresses array element 'element',
+ * which is added to a final array index of the tag
+ * or appended as an index if the tag has none.
+ */
+size_t CIP_ReadModifyWrite_size(const ParsedTag *tag, eip_bool indexed,
+                                size_t element, size_t mask_size);
+CN_USINT *make_CIP_ReadModifyWrite(CN_USINT *request,
+                                   const ParsedTag *tag, eip_bool indexed,
+                                   size_t element, size_t mask_size,
+                                   CN_UDINT or_mask, CN_UDINT and_mask);
+eip_bool check_CIP_ReadModifyWrite_Response(const CN_USINT *response,
+                                            size_t response_size);
+
 size_t CIP_MultiRequest_size(size_t count, size_t requests_size);
 size_t CIP_MultiResponse_size(size_t count, size_t responses_size);
 eip_bool prepare_CIP_MultiRequest(CN_USINT *request, size_t count);
@@ -496,6 +562,17 @@ CN_USINT *CIP_MultiRequest_item(CN_USINT *request,
                                 size_t request_no,
                                 size_t single_request_size);
 
+/* Does general status indicate that a request or reply was too large? */
+eip_bool is_CIP_buffer_error(CN_USINT general_status);
+
+/* Does general status indicate that the PLC lacks resources, i.e. is busy? */
+eip_bool is_CIP_busy_error(CN_USINT general_status);
+
+/* Does general status indicate that the PLC doesn't support the service? */
+eip_bool is_CIP_unsupported_error(CN_USINT general_status);
+
+/* Check MultiRequest response, OK even if some embedded requests failed,
+ * so check each reply */
 eip_bool check_CIP_MultiRequest_Response(const CN_USINT *response,
                                      size_t response_size);
 void dump_CIP_MultiRequest_Response_Error(const CN_USINT *response,
@@ -504,6 +581,18 @@ const CN_USINT *get_CIP_MultiRequest_Response(const CN_USINT *response,
                                               size_t response_size,
                                               size_t reply_no,
                                               size_t *reply_size);
+/* Upper limit for replies in one MultiRequest response:
+ * each needs at least a 2 byte offset and a 4 byte MR_Response */
+#define CIP_MultiRequest_max_count (EIP_BUFFER_SIZE/6)
+
+/* Locate all replies, checking the offsets against response_size.
+ * Returns count of replies, 0 for more than max_count or malformed response
+ */
+size_t get_CIP_MultiRequest_Responses(const CN_USINT *response,
+                                      size_t response_size,
+                                      size_t max_count,
+                                      const CN_USINT *replies[],
+                                      size_t reply_sizes[]);
 
 /* dump CIP data, type and data are in raw format */
 void dump_raw_CIP_data(const CN_USINT *raw_type_and_data, size_t elements);
@@ -521,6 +610,13 @@ eip_bool put_CIP_LINT(const CN_USINT *raw_type_and_data,
 #endif
 eip_bool get_CIP_USINT(const CN_USINT *raw_type_and_data,
                        size_t element, CN_USINT *result);
+/* Convert 'count' elements starting at 'element' */
+eip_bool get_CIP_double_array(const CN_USINT *raw_type_and_data,
+                              size_t element, size_t count, double *result);
+eip_bool get_CIP_DINT_array(const CN_USINT *raw_type_and_data,
+                            size_t element, size_t count, CN_DINT *result);
+eip_bool get_CIP_USINT_array(const CN_USINT *raw_type_and_data,
+                             size_t element, size_t count, CN_USINT *result);
 /* Fill buffer with up to 'size' characters (incl. ending '\0').
  * Return true for success */
 eip_bool get_CIP_STRING(const CN_USINT *raw_type_and_data,
@@ -682,19 +778,57 @@ typedef struct
    CN_USINT name[100];
 } EIPIdentityInfo;
 
+typedef struct __EIPConnection EIPConnection;
+
+/* Transport of encapsulation messages for an EIPConnection.
+ * Default is TCP. Other transports set sock to EIP_INVALID_SOCKET
+ * while open, so sock != 0 still means 'connected'.
+ */
+typedef struct
+{
+    const char *name;
+    /* Open connection to c->peer_ip, c->peer_port
+     * (ip_addr only for messages), set c->local_ip, local_port.
+     */
+    eip_bool (*open)(EIPConnection *c, const char *ip_addr);
+    /* Send data, return bytes sent or -1 on error */
+    int      (*send)(EIPConnection *c, const CN_USINT *data, size_t size);
+    /* Wait for data to receive: > 0 when available, <= 0 on timeout */
+    int      (*poll)(EIPConnection *c, size_t millisec_timeout);
+    /* Receive up to 'size' bytes, return count, <= 0 for end of data */
+    int      (*receive)(EIPConnection *c, CN_USINT *data, size_t size);
+    void     (*close)(EIPConnection *c);
+}   EIPTransport;
+
 /* Parameters & buffers for one EtherNet/IP connection.
  * sock == 0 is used to detect unused/shutdown connections. */
-typedef struct
+struct __EIPConnection
 {
     EIP_SOCKET              sock;       /* silk or nylon */
     int                     slot;       /* PLC's slot on backplane */
     size_t                  transfer_buffer_limit; /* PLC limit */
+    size_t                  probed_buffer_limit; /* for peer, 0: none */
+    int                     probed_slot; /* .. which only applies to it */
     size_t                  millisec_timeout; /* .. for socket calls */
+    size_t                  millisec_min_timeout; /* floor for adaptive
+                                                   * read timeout, 0: fixed */
+    double                  srtt;       /* smoothed round trip, secs, 0: none */
+    double                  rttvar;     /* .. and its variation */
+    double                  sent_time;  /* of last request, 0: none */
     CN_UDINT                session;    /* session ID, generated by target */
     CN_USINT                *buffer;    /* buffer for read/write, EIP_BUFFER_SIZE */
     EIPIdentityInfo         info;
     EIPConnectionParameters params;
-}   EIPConnection;
+    CN_UDINT                local_ip;   /* addresses for capture, */
+    CN_UDINT                peer_ip;    /* host byte order */
+    char                    *peer_name; /* ip_addr that resolved to peer_ip */
+    eip_bool                peer_checked; /* connected to peer_ip before */
+    CN_UINT                 local_port;
+    CN_UINT                 peer_port;
+    CN_UDINT                capture_seq[2]; /* TCP seq. sent, received */
+    const EIPTransport      *transport; /* set by EIP_connect */
+    void                    *transport_data; /* .. private to transport */
+};
 
 #ifdef _WIN32
 #pragma pack(pop)
@@ -722,6 +856,35 @@ EIPConnection *EIP_init();
 /** Dispose EIPConnection */
 void EIP_dispose(EIPConnection *c);
 
+/** Largest transfer_buffer_limit that fits the connection buffer */
+size_t EIP_max_buffer_limit();
+
+/** Find the largest MultiRequest and response that the PLC in c->slot
+ *  handles, starting from c->transfer_buffer_limit.
+ *  Sets transfer_buffer_limit and probed_buffer_limit,
+ *  which remain at the start value when the probe fails.
+ *  Returns false on network errors.
+ */
+eip_bool EIP_probe_buffer_limit(EIPConnection *c);
+
+/** Reduce transfer_buffer_limit (and probed_buffer_limit)
+ *  after the PLC refused a transfer of 'failed_size' bytes
+ *  as too large.
+ */
+void EIP_reduce_buffer_limit(EIPConnection *c, size_t failed_size);
+
+/** Route requests of the connection to the PLC in another slot.
+ *  A limit probed for the PLC in one slot doesn't apply to the others,
+ *  so the connection then returns to EIP_buffer_limit.
+ */
+void EIP_route_slot(EIPConnection *c, int slot);
+
+/** Timeout in millisec for reading the response to a request:
+ *  With millisec_min_timeout set, derived from the measured
+ *  round trip times, limited to millisec_min_timeout ... millisec_timeout.
+ */
+size_t EIP_read_timeout(const EIPConnection *c);
+
 /** Connect to PLC */
 eip_bool EIP_startup(EIPConnection *c,
                  const char *ip_addr, unsigned short port,
@@ -751,6 +914,51 @@ eip_bool EIP_send_connection_buffer(EIPConnection *c);
  */
 eip_bool EIP_read_connection_buffer(EIPConnection *c);
 
+/** Write all messages sent and received by all connections
+ *  as IPv4/TCP packets into a pcap file, for example to inspect
+ *  with Wireshark.
+ *  NULL or "" stops capturing.
+ *  @return true when OK
+ */
+eip_bool EIP_capture(const char *filename);
+
+/** Have connections opened from now on read the responses from
+ *  a pcap file instead of the network.
+ *  The responses of the connection's IP address are returned in order,
+ *  no matter what was sent.
+ *  Transaction IDs are patched to match the requests.
+ *  NULL or "" uses the network again.
+ *  @return true when OK
+ */
+eip_bool EIP_replay(const char *filename);
+
+/** Simulated target for the loopback transport */
+typedef struct
+{
+    /* Create target's state for a new connection, 0 on error */
+    void *(*open)(CN_UDINT peer_ip, CN_UINT peer_port);
+    /* Handle one request, return reply or 0 to not reply.
+     * Reply remains valid until the next call.
+     */
+    const CN_USINT *(*handle)(void *target, const CN_USINT *request,
+                              size_t size, size_t *reply_size);
+    void (*close)(void *target);
+}   EIPLoopbackTarget;
+
+/** Have connections opened from now on pass requests to
+ *  the target within this process instead of the network.
+ *  Replies are available right away, a request
+ *  that the target does not answer results in a timeout.
+ *  NULL uses the network again.
+ */
+void EIP_loopback(const EIPLoopbackTarget *target);
+
+/** Have connections opened from now on use the given transport.
+ *  NULL selects TCP.
+ *  Replaces a transport selected by EIP_replay or EIP_loopback.
+ */
+void EIP_set_transport(const EIPTransport *transport);
+
 /* VxWorks has no strdup */
 char *EIP_strdup(const char *text);
 
@@ -775,4 +983,9 @@ void *EIP_Get_Attribute_Single(EIPConnection *c,
                                CN_Classes cls, CN_USINT instance,
                                CN_USINT attr, size_t *len);
 
+void *EIP_Get_Attribute_All(EIPConnection *c,
+                            CN_Classes cls, CN_USINT instance, size_t *len);
+
+#endif /* ETHER_IP_H */
+
 /* EOF ether_ip.h */
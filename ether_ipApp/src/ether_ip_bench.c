@@ -0,0 +1,643 @@
+/* EtherNet/IP: ControlNet over Ethernet
+ *
+ * Micro-benchmarks for the protocol encoding and decoding,
+ * for the driver's MultiRequest planning
+ * and for its scan of the simulated PLC via the loopback transport.
+ * Uses synthetic tags, no network or PLC required.
+ *
+ * For each benchmark, the time per operation and
+ * the number of protocol bytes handled per operation
+ * are reported, so that changes to ether_ip.c or drvEtherIP.c
+ * can be compared before and after.
+ */
+
+#include<memory.h>
+#include<stdio.h>
+#include<string.h>
+#include<stddef.h>
+#include<stdlib.h>
+#define EIP_SIM_LOOPBACK
+#include"ether_ip_sim.c"
+#include"drvEtherIP.c"
+
+/* Not an IOC, no iocsh commands to register */
+void drvEtherIP_Register()
+{
+}
+
+/* Minimum time to run each benchmark */
+static double min_seconds = 0.5;
+
+/* Only run benchmarks whose name contains this text */
+static const char *filter = 0;
+
+/* Results are added to this so that the compiler
+ * cannot skip the benchmarked code
+ */
+static volatile double sink;
+
+/* Synthetic tags, see make_tags() */
+#define MAX_TAGS 10000
+static size_t     tag_count = 1000;
+static ParsedTag  *tags[MAX_TAGS];
+static CIP_Type   tag_type[MAX_TAGS];
+static size_t     tag_elements[MAX_TAGS];
+
+/* Benchmark: Perform 'runs' operations, return total bytes handled */
+typedef size_t (*BenchFunc)(size_t runs);
+
+static void bench(const char *name, BenchFunc func)
+{
+    epicsTimeStamp start, end;
+    size_t runs = 1, bytes;
+    double secs;
+
+    if (filter  &&  strstr(name, filter) == 0)
+        return;
+    func(1); /* warm up */
+    while (true)
+    {
+        epicsTimeGetCurrent(&start);
+        bytes = func(runs);
+        epicsTimeGetCurrent(&end);
+        secs = epicsTimeDiffInSeconds(&end, &start);
+        if (secs >= min_seconds  ||  runs >= ((size_t)1 << 40))
+            break;
+        /* Aim for min_seconds with some margin */
+        if (secs < min_seconds / 100)
+            runs *= 100;
+        else
+            runs = (size_t)(runs * 1.2 * min_seconds / secs) + 1;
+    }
+    printf("%-36s %12.1f ns/op %10.1f bytes/op %12lu runs\n",
+           name, secs*1e9/runs, (double)bytes/runs, (unsigned long)runs);
+}
+
+/* Tags shaped like those of a typical IOC:
+ * Scalars, members of structures, elements of arrays
+ * of structures, and arrays.
+ */
+static void make_tags()
+{
+    char   name[EIP_MAX_TAG_LENGTH];
+    size_t i;
+
+    for (i=0; i<tag_count; ++i)
+    {
+        switch (i % 5)
+        {
+        case 0:
+            sprintf(name, "Tank%u_Level", (unsigned)i);
+            tag_type[i] = T_CIP_REAL;
+            tag_elements[i] = 1;
+            break;
+        case 1:
+            sprintf(name, "Line%u.Motor.Speed", (unsigned)i);
+            tag_type[i] = T_CIP_DINT;
+            tag_elements[i] = 1;
+            break;
+        case 2:
+            sprintf(name, "Program:Area%u.Valve[%u].Pos",
+                    (unsigned)(i/100), (unsigned)(i%100));
+            tag_type[i] = T_CIP_REAL;
+            tag_elements[i] = 1;
+            break;
+        case 3:
+            sprintf(name, "Interlocks%u", (unsigned)i);
+            tag_type[i] = T_CIP_BITS;
+            tag_elements[i] = 4;
+            break;
+        default:
+            sprintf(name, "Trend%u", (unsigned)i);
+            tag_type[i] = T_CIP_REAL;
+            tag_elements[i] = 40;
+        }
+        tags[i] = EIP_parse_tag(name);
+    }
+}
+
+/* Byte-size of read response for tag */
+static size_t read_response_size(size_t i)
+{
+    return 4 + CIP_Typecode_size + tag_elements[i]*CIP_Type_size(tag_type[i]);
+}
+
+/********************************************************
+ * Basic encoding/decoding
+ ********************************************************/
+
+static CN_USINT buffer[EIP_BUFFER_SIZE];
+
+static size_t bench_pack_UDINT(size_t runs)
+{
+    size_t i;
+    for (i=0; i<runs; ++i)
+        pack_UDINT(buffer + 4*(i%64), (CN_UDINT) i);
+    sink += buffer[3];
+    return 4*runs;
+}
+
+static size_t bench_unpack_UDINT(size_t runs)
+{
+    CN_UDINT val, sum = 0;
+    size_t i;
+    for (i=0; i<runs; ++i)
+    {
+        unpack_UDINT(buffer + 4*(i%64), &val);
+        sum += val;
+    }
+    sink += sum;
+    return 4*runs;
+}
+
+static size_t bench_pack_REAL(size_t runs)
+{
+    size_t i;
+    for (i=0; i<runs; ++i)
+        pack_REAL(buffer + 4*(i%64), (CN_REAL) i);
+    sink += buffer[3];
+    return 4*runs;
+}
+
+static size_t bench_unpack_REAL(size_t runs)
+{
+    CN_REAL val, sum = 0;
+    size_t i;
+    for (i=0; i<runs; ++i)
+    {
+        unpack_REAL(buffer + 4*(i%64), &val);
+        sum += val;
+    }
+    sink += sum;
+    return 4*runs;
+}
+
+/* Type and data of a REAL[100] and DINT[100] tag */
+static CN_USINT real_data[CIP_Typecode_size + 100*4];
+static CN_USINT dint_data[CIP_Typecode_size + 100*4];
+
+static void make_data()
+{
+    CN_USINT *r = pack_UINT(real_data, T_CIP_REAL);
+    CN_USINT *d = pack_UINT(dint_data, T_CIP_DINT);
+    size_t i;
+
+    for (i=0; i<100; ++i)
+    {
+        r = pack_REAL(r, (CN_REAL) i / 10);
+        d = pack_UDINT(d, (CN_UDINT) i);
+    }
+}
+
+static size_t bench_get_CIP_double_REAL(size_t runs)
+{
+    double val, sum = 0;
+    size_t i;
+    for (i=0; i<runs; ++i)
+    {
+        get_CIP_double(real_data, i%100, &val);
+        sum += val;
+    }
+    sink += sum;
+    return 4*runs;
+}
+
+static size_t bench_get_CIP_double_DINT(size_t runs)
+{
+    double val, sum = 0;
+    size_t i;
+    for (i=0; i<runs; ++i)
+    {
+        get_CIP_double(dint_data, i%100, &val);
+        sum += val;
+    }
+    sink += sum;
+    return 4*runs;
+}
+
+static size_t bench_get_CIP_DINT(size_t runs)
+{
+    CN_DINT val, sum = 0;
+    size_t i;
+    for (i=0; i<runs; ++i)
+    {
+        get_CIP_DINT(dint_data, i%100, &val);
+        sum += val;
+    }
+    sink += sum;
+    return 4*runs;
+}
+
+/* Array conversions, one 'op' is one element like above */
+static double   double_array[100];
+static CN_DINT  dint_array[100];
+
+static size_t bench_get_CIP_double_array_REAL(size_t runs)
+{
+    size_t i, n;
+    for (i=0; i<runs; i+=n)
+    {
+        n = runs - i < 100 ? runs - i : 100;
+        get_CIP_double_array(real_data, 0, n, double_array);
+    }
+    sink += double_array[1];
+    return 4*runs;
+}
+
+static size_t bench_get_CIP_DINT_array(size_t runs)
+{
+    size_t i, n;
+    for (i=0; i<runs; i+=n)
+    {
+        n = runs - i < 100 ? runs - i : 100;
+        get_CIP_DINT_array(dint_data, 0, n, dint_array);
+    }
+    sink += dint_array[1];
+    return 4*runs;
+}
+
+static size_t bench_put_CIP_double_REAL(size_t runs)
+{
+    size_t i;
+    for (i=0; i<runs; ++i)
+        put_CIP_double(real_data, i%100, (double) i);
+    sink += real_data[5];
+    return 4*runs;
+}
+
+/********************************************************
+ * Requests
+ ********************************************************/
+
+static size_t bench_make_CIP_ReadData(size_t runs)
+{
+    size_t i, bytes = 0;
+    for (i=0; i<runs; ++i)
+        bytes += make_CIP_ReadData(buffer, tags[i%tag_count],
+                                   tag_elements[i%tag_count]) - buffer;
+    return bytes;
+}
+
+static size_t bench_make_CIP_WriteData(size_t runs)
+{
+    size_t i, t, bytes = 0;
+    for (i=0; i<runs; ++i)
+    {
+        t = i%tag_count;
+        bytes += make_CIP_WriteData(buffer, sizeof(buffer), tags[t],
+                                    tag_type[t], tag_elements[t],
+                                    real_data + CIP_Typecode_size) - buffer;
+    }
+    return bytes;
+}
+
+/* Pack as many ReadData requests as fit into one MultiRequest,
+ * like the driver does.
+ * Bytes are those of the MultiRequest.
+ */
+static size_t bench_MultiRequest_pack(size_t runs)
+{
+    size_t i, t = 0, n, count, req_size, resp_size, bytes = 0;
+    size_t sizes[MAX_TAGS];
+    CN_USINT *item;
+
+    for (i=0; i<runs; ++i)
+    {
+        /* Determine count that fits into limit */
+        req_size = resp_size = 0;
+        for (count=0; count < tag_count; ++count)
+        {
+            n = (t + count) % tag_count;
+            sizes[count] = CIP_ReadData_size(tags[n]);
+            if (CIP_MultiRequest_size(count+1, req_size + sizes[count])
+                > (size_t)EIP_buffer_limit  ||
+                CIP_MultiResponse_size(count+1, resp_size + read_response_size(n))
+                > (size_t)EIP_buffer_limit)
+                break;
+            req_size += sizes[count];
+            resp_size += read_response_size(n);
+        }
+        prepare_CIP_MultiRequest(buffer, count);
+        for (n=0; n<count; ++n)
+        {
+            item = CIP_MultiRequest_item(buffer, n, sizes[n]);
+            make_CIP_ReadData(item, tags[(t + n) % tag_count],
+                              tag_elements[(t + n) % tag_count]);
+        }
+        bytes += CIP_MultiRequest_size(count, req_size);
+        t = (t + count) % tag_count;
+    }
+    return bytes;
+}
+
+/* MultiRequest response with ReadData replies for REAL tags */
+#define RESPONSE_ITEMS 20
+static CN_USINT multi_response[EIP_BUFFER_SIZE];
+static size_t   multi_response_size;
+
+static void make_multi_response()
+{
+    CN_USINT *buf, *countp, *item;
+    size_t i;
+
+    buf = pack_USINT(multi_response, S_CIP_MultiRequest | 0x80);
+    buf = pack_USINT(buf, 0);
+    buf = pack_USINT(buf, 0);
+    buf = pack_USINT(buf, 0);
+    countp = buf;
+    buf = pack_UINT(buf, RESPONSE_ITEMS);
+    item = countp + 2 + 2*RESPONSE_ITEMS;
+    for (i=0; i<RESPONSE_ITEMS; ++i)
+    {
+        buf = pack_UINT(buf, item - countp);
+        item = pack_USINT(item, S_CIP_ReadData | 0x80);
+        item = pack_USINT(item, 0);
+        item = pack_USINT(item, 0);
+        item = pack_USINT(item, 0);
+        item = pack_UINT(item, T_CIP_REAL);
+        item = pack_REAL(item, (CN_REAL) i);
+    }
+    multi_response_size = item - multi_response;
+}
+
+/* Decode all replies in a MultiRequest response.
+ * One op is one reply, bytes are those of the reply.
+ */
+static size_t bench_MultiResponse_decode(size_t runs)
+{
+    const CN_USINT *reply, *data;
+    size_t i, reply_size, data_size;
+    double val, sum = 0;
+
+    if (! check_CIP_MultiRequest_Response(multi_response,
+                                          multi_response_size))
+        return 0;
+    for (i=0; i<runs; ++i)
+    {
+        reply = get_CIP_MultiRequest_Response(multi_response,
+                                              multi_response_size,
+                                              i % RESPONSE_ITEMS,
+                                              &reply_size);
+        data = check_CIP_ReadData_Response(reply, reply_size, &data_size);
+        if (data  &&  get_CIP_double(data, 0, &val))
+            sum += val;
+    }
+    sink += sum;
+    return runs * multi_response_size / RESPONSE_ITEMS;
+}
+
+/* Same with one pass over the offset table per response */
+static size_t bench_MultiResponses_decode(size_t runs)
+{
+    const CN_USINT *replies[CIP_MultiRequest_max_count], *data;
+    size_t reply_sizes[CIP_MultiRequest_max_count];
+    size_t i, n = 0, data_size;
+    double val, sum = 0;
+
+    for (i=0; i<runs; ++i)
+    {
+        if (i % RESPONSE_ITEMS == 0)
+            n = get_CIP_MultiRequest_Responses(multi_response,
+                                               multi_response_size,
+                                               CIP_MultiRequest_max_count,
+                                               replies, reply_sizes);
+        if (n != RESPONSE_ITEMS)
+            return 0;
+        data = check_CIP_ReadData_Response(replies[i % RESPONSE_ITEMS],
+                                           reply_sizes[i % RESPONSE_ITEMS],
+                                           &data_size);
+        if (data  &&  get_CIP_double(data, 0, &val))
+            sum += val;
+    }
+    sink += sum;
+    return runs * multi_response_size / RESPONSE_ITEMS;
+}
+
+/********************************************************
+ * Driver
+ ********************************************************/
+
+static DL_List scan_tags;
+static Arena   arena;
+static TagView scan_view;
+
+/* TagInfos for synthetic tags, sizes as if read from PLC */
+static void make_TagInfos()
+{
+    char    name[EIP_MAX_TAG_LENGTH];
+    TagInfo *info;
+    size_t  i;
+
+    DLL_init(&scan_tags);
+    for (i=0; i<tag_count; ++i)
+    {
+        EIP_copy_ParsedTag(name, tags[i]);
+        info = new_TagInfo(&arena, name, tag_elements[i]);
+        if (! info)
+            exit(-1);
+        info->cip_r_request_size  = CIP_ReadData_size(info->tag);
+        info->cip_r_response_size = read_response_size(i);
+        info->cip_w_request_size  = info->cip_r_request_size
+                                  + info->cip_r_response_size - 4;
+        info->cip_w_response_size = 4;
+        if (! reserve_tag_data(&arena, info, info->cip_r_response_size - 4))
+            exit(-1);
+        pack_UINT(info->data, tag_type[i]);
+        info->valid_data_size = info->cip_r_response_size - 4;
+        DLL_append(&scan_tags, &info->node);
+    }
+    if (! fill_TagView(&scan_view, DLL_first(TagInfo, &scan_tags), false))
+        exit(-1);
+}
+
+/* Plan transfers for all tags of the scanlist, like process_TagInfos.
+ * One op is one tag, bytes are those of requests planned per tag.
+ */
+static size_t bench_determine_MultiRequest_count(size_t runs)
+{
+    TagInfo *batch[CIP_MultiRequest_max_count];
+    size_t  i, position = 0, count = 0, requests_size, responses_size,
+            multi_request_size, multi_response_size, bytes = 0;
+    epicsTimeStamp now;
+
+    epicsTimeGetCurrent(&now);
+
+    /* Ends on a complete transfer, so may run a few more than 'runs' */
+    for (i=0; i<runs; i += count)
+    {
+        if (position >= scan_view.count)
+            position = 0;
+        count = determine_MultiRequest_count(EIP_buffer_limit,
+                                             &scan_view, &position, false,
+                                             &now, batch,
+                                             &requests_size, &responses_size,
+                                             &multi_request_size,
+                                             &multi_response_size);
+        if (count <= 0)
+            return 0;
+        bytes += multi_request_size;
+    }
+    return bytes;
+}
+
+static PLC      *loopback_plc;
+static ScanList *loopback_list;
+static size_t   loopback_bytes; /* read responses per scan */
+
+/* Synthetic tags on simulated PLC, and PLC with scanlist
+ * of those tags connected to it via loopback
+ */
+static void make_loopback_PLC()
+{
+    char    name[EIP_MAX_TAG_LENGTH];
+    TagInfo *info;
+    size_t  i, t;
+
+    sim.lock = epicsMutexCreate();
+    sim.buffer_limit = SIM_MAX_BUFFER_LIMIT; /* EIP_buffer_limit applies */
+    EIP_buffer_probe = false;
+    for (i=0; i<tag_count; ++i)
+    {
+        EIP_copy_ParsedTag(name, tags[i]);
+        for (t=0; sim_types[t].type != tag_type[i]; ++t)
+            ;
+        if (! add_tag(name, sim_types[t].name, tag_elements[i], (double)i))
+            exit(-1);
+    }
+    if (! sort_tags())
+        exit(-1);
+    EIP_loopback(&sim_loopback_target);
+    drvEtherIP_init();
+    if (! drvEtherIP_define_PLC("bench", "127.0.0.1", 0, 1))
+        exit(-1);
+    loopback_plc = drvEtherIP_find_PLC("bench");
+    for (i=0; i<tag_count; ++i)
+    {
+        EIP_copy_ParsedTag(name, tags[i]);
+        if (! drvEtherIP_add_tag(loopback_plc, 1.0, name, tag_elements[i]))
+            exit(-1);
+    }
+    loopback_list = get_PLC_ScanList(loopback_plc, 1.0, false);
+    epicsMutexLock(loopback_list->session->lock);
+    if (! assert_Session_connect(loopback_list->session))
+        exit(-1);
+    epicsMutexUnlock(loopback_list->session->lock);
+    for (info=DLL_first(TagInfo, &loopback_list->taginfos);  info;
+         info=DLL_next(TagInfo, info))
+        loopback_bytes += info->cip_r_response_size;
+}
+
+/* Scan all tags of the scanlist, including the encoding of requests,
+ * the simulated PLC's handling of them and decoding of the responses.
+ * One op is one scan of all tags, bytes are those of the read responses.
+ */
+static size_t bench_process_ScanList(size_t runs)
+{
+    Session  *session = loopback_list->session;
+    size_t   i;
+    eip_bool ok = true;
+
+    epicsMutexLock(session->lock);
+    if (lock_scanned_PLC(session, loopback_plc))
+    {
+        for (i=0; ok  &&  i<runs; ++i)
+            ok = process_ScanList(session, loopback_list);
+        unlock_scanned_PLC(session, loopback_plc);
+    }
+    else
+        ok = false;
+    epicsMutexUnlock(session->lock);
+    return ok ? runs * loopback_bytes : 0;
+}
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s <Options> [name filter]\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -v verbosity                       Set verbosity 1-10\n");
+    fprintf(stderr, "  -n tags                            Number of synthetic tags, default %u\n",
+            (unsigned)tag_count);
+    fprintf(stderr, "  -b bytes                           Buffer limit, default %d\n",
+            EIP_buffer_limit);
+    fprintf(stderr, "  -t seconds                         Minimum time per benchmark\n");
+    exit(-1);
+}
+
+int main (int argc, const char *argv[])
+{
+    const char *arg;
+    size_t     i;
+
+    EIP_verbosity = 0;
+    for (i=1; i<(size_t)argc; ++i)
+    {
+        if (argv[i][0] == '-')
+        {
+#define         GETARG                                          \
+                if (argv[i][2])  { arg = &argv[i  ][2];      }  \
+                else             { arg = &argv[i+1][0]; ++i; }
+            switch (argv[i][1])
+            {
+            case 'v':
+                GETARG
+                if (arg) EIP_verbosity = atoi(arg);
+                else usage (argv[0]);
+                break;
+            case 'n':
+                GETARG
+                if (arg) tag_count = atol(arg);
+                else usage (argv[0]);
+                if (tag_count < 1  ||  tag_count > MAX_TAGS)
+                    usage (argv[0]);
+                break;
+            case 'b':
+                GETARG
+                if (arg) EIP_buffer_limit = atoi(arg);
+                else usage (argv[0]);
+                if (EIP_buffer_limit > EIP_BUFFER_SIZE)
+                    EIP_buffer_limit = EIP_BUFFER_SIZE;
+                break;
+            case 't':
+                GETARG
+                if (arg) min_seconds = atof(arg);
+                else usage (argv[0]);
+                break;
+            default:
+                usage (argv[0]);
+#undef          GETARG
+            }
+        }
+        else
+            filter = argv[i];
+    }
+
+    check_sizes();
+    transIdMutex = epicsMutexCreate();
+    make_tags();
+    make_data();
+    make_multi_response();
+    make_TagInfos();
+    make_loopback_PLC();
+    printf("%u tags, buffer limit %d bytes\n",
+           (unsigned)tag_count, EIP_buffer_limit);
+
+    bench("pack_UDINT",                   bench_pack_UDINT);
+    bench("unpack_UDINT",                 bench_unpack_UDINT);
+    bench("pack_REAL",                    bench_pack_REAL);
+    bench("unpack_REAL",                  bench_unpack_REAL);
+    bench("get_CIP_double REAL",          bench_get_CIP_double_REAL);
+    bench("get_CIP_double DINT",          bench_get_CIP_double_DINT);
+    bench("get_CIP_DINT",                 bench_get_CIP_DINT);
+    bench("get_CIP_double_array REAL",    bench_get_CIP_double_array_REAL);
+    bench("get_CIP_DINT_array",           bench_get_CIP_DINT_array);
+    bench("put_CIP_double REAL",          bench_put_CIP_double_REAL);
+    bench("make_CIP_ReadData",            bench_make_CIP_ReadData);
+    bench("make_CIP_WriteData",           bench_make_CIP_WriteData);
+    bench("MultiRequest pack",            bench_MultiRequest_pack);
+    bench("MultiRequest response decode", bench_MultiResponse_decode);
+    bench("MultiRequest responses decode", bench_MultiResponses_decode);
+    bench("determine_MultiRequest_count", bench_determine_MultiRequest_count);
+    bench("process_ScanList loopback",    bench_process_ScanList);
+
+    return 0;
+}
@@ -0,0 +1,1170 @@
+/* EtherNet/IP: ControlNet over Ethernet
+ *
+ * Soft PLC: Simulates a ControlLogix for tests of the driver
+ * without actual hardware.
+ *
+ * Answers the encapsulation commands and CIP services
+ * that ether_ip_test and the driver use:
+ * ListServices, RegisterSession, SendRRData with
+ * CM_Unconnected_Send, Get_Attribute_Single/All for the identity,
+ * MultiRequest, ReadData, WriteData, ReadModifyWrite
+ * and Get_Instance_Attribute_List for listing tags.
+ *
+ * Tags are defined in a file or created as synthetic REAL tags.
+ * Replies can be delayed by a latency with random jitter,
+ * sizes are checked against a buffer limit,
+ * and errors or timeouts can be injected.
+ *
+ * Since the driver always connects to the EtherNet/IP port,
+ * run several simulators on different local addresses
+ * (127.0.0.1, 127.0.0.2, ...) to simulate several PLCs.
+ */
+
+#include<memory.h>
+#include<stdio.h>
+#include<string.h>
+#include<stddef.h>
+#include<time.h>
+#include<stdlib.h>
+#include<epicsThread.h>
+#include"ether_ip.c"
+
+/* Buffer for one request or reply.
+ * Larger than EIP_BUFFER_SIZE so that requests which
+ * exceed the simulated limit can still be received and rejected.
+ */
+#define SIM_BUFFER_SIZE 4096
+
+/* Largest supported '-b' buffer limit */
+#define SIM_MAX_BUFFER_LIMIT (SIM_BUFFER_SIZE - sizeof_EncapsulationRRData - 16)
+
+/* Simulated tag */
+typedef struct
+{
+    char       *name;
+    CN_UINT    type;         /* CIP_Type, T_CIP_STRUCT for strings */
+    size_t     elements;     /* array elements; 32 bit words for BITS */
+    size_t     header_size;  /* type code (+ struct handle) in data */
+    size_t     element_size; /* bytes per element */
+    CN_USINT   *data;        /* type code, then elements, net format */
+}   SimTag;
+
+/* Simulator configuration and tags */
+static struct
+{
+    SimTag       *tags;          /* sorted by name */
+    size_t       count;
+    size_t       allocated;
+    int          slot;           /* PLC slot in backplane */
+    size_t       buffer_limit;   /* limit for CIP request/reply */
+    double       latency;        /* seconds before reply */
+    double       jitter;         /* random seconds added to latency */
+    double       error_percent;  /* % of items that fail */
+    double       timeout_percent;/* % of requests not answered */
+    double       busy_rate;      /* MultiRequests per second before
+                                  * replying 'resource unavailable', 0: any */
+    epicsTimeStamp last_request; /* .. time of last one that was handled */
+    epicsMutexId lock;           /* for tags' data and last_request */
+    CN_UDINT     next_session;
+}   sim;
+
+/* One client connection, handled by its own thread */
+typedef struct
+{
+    EIP_SOCKET sock;
+    CN_UDINT   session;
+    unsigned   seed;          /* for sim_random */
+    size_t     requests;      /* SendRRData requests */
+    size_t     items;         /* tags read or written */
+    size_t     errors;        /* .. that failed */
+    CN_USINT   request[SIM_BUFFER_SIZE];
+    CN_USINT   reply[SIM_BUFFER_SIZE];
+}   SimConnection;
+
+/* Random number 0..1 from connection's seed.
+ * Simple generator since rand_r is not available everywhere.
+ */
+static double sim_random(SimConnection *conn)
+{
+    conn->seed = conn->seed * 1103515245 + 12345;
+    return ((conn->seed >> 16) & 0x7FFF) / (double) 0x7FFF;
+}
+
+/********************************************************
+ * Tags
+ ********************************************************/
+
+static int compare_tags(const void *a, const void *b)
+{
+    return strcmp(((const SimTag *)a)->name, ((const SimTag *)b)->name);
+}
+
+static SimTag *find_tag(const char *name)
+{
+    SimTag key;
+    key.name = (char *)name;
+    return (SimTag *) bsearch(&key, sim.tags, sim.count,
+                              sizeof(SimTag), compare_tags);
+}
+
+/* Type name for tag file, type code, byte size of one element */
+static const struct
+{
+    const char *name;
+    CN_UINT    type;
+    size_t     size;
+}   sim_types[] =
+{
+    { "BOOL",   T_CIP_BOOL,  1 },
+    { "SINT",   T_CIP_SINT,  1 },
+    { "INT",    T_CIP_INT,   2 },
+    { "DINT",   T_CIP_DINT,  4 },
+    { "LINT",   T_CIP_LINT,  8 },
+    { "REAL",   T_CIP_REAL,  4 },
+    { "LREAL",  T_CIP_LREAL, 8 },
+    { "BITS",   T_CIP_BITS,  4 },
+    { "STRING", T_CIP_STRUCT, CIP_STRUCT_STRING_size },
+};
+
+#define SIM_TYPE_COUNT (sizeof(sim_types)/sizeof(sim_types[0]))
+
+/* Add tag, initialized to 'value'.
+ * Tags must be sorted via sort_tags before use
+ */
+static eip_bool add_tag(const char *name, const char *type_name,
+                        size_t elements, double value)
+{
+    SimTag   *tag;
+    size_t   t, i;
+    CN_USINT *buf;
+
+    for (t=0; t<SIM_TYPE_COUNT; ++t)
+        if (strcmp(type_name, sim_types[t].name) == 0)
+            break;
+    if (t >= SIM_TYPE_COUNT)
+    {
+        EIP_printf(0, "Tag '%s': Unknown type '%s'\n", name, type_name);
+        return false;
+    }
+    if (elements < 1)
+        elements = 1;
+    if (sim.count >= sim.allocated)
+    {
+        size_t allocated = sim.allocated ? 2*sim.allocated : 1024;
+        SimTag *tags = (SimTag *) realloc(sim.tags, allocated*sizeof(SimTag));
+        if (! tags)
+        {
+            EIP_printf(0, "No memory for %u tags\n", (unsigned)allocated);
+            return false;
+        }
+        sim.tags = tags;
+        sim.allocated = allocated;
+    }
+    tag = &sim.tags[sim.count];
+    tag->name         = EIP_strdup(name);
+    tag->type         = sim_types[t].type;
+    tag->elements     = elements;
+    tag->header_size  = tag->type == T_CIP_STRUCT ? 4 : CIP_Typecode_size;
+    tag->element_size = sim_types[t].size;
+    tag->data         = (CN_USINT *) calloc(1, tag->header_size +
+                                            elements*tag->element_size);
+    if (! (tag->name && tag->data))
+    {
+        EIP_printf(0, "No memory for tag '%s'\n", name);
+        return false;
+    }
+    buf = pack_UINT(tag->data, tag->type);
+    if (tag->type == T_CIP_STRUCT)
+        pack_UINT(buf, T_CIP_STRUCT_STRING);
+    for (i=0; i<elements; ++i)
+    {
+        buf = tag->data + tag->header_size + i*tag->element_size;
+        switch (tag->type)
+        {
+        case T_CIP_BOOL:
+        case T_CIP_SINT:  pack_USINT(buf, (CN_USINT) value);  break;
+        case T_CIP_INT:   pack_UINT(buf, (CN_UINT) value);    break;
+        case T_CIP_BITS:
+        case T_CIP_DINT:  pack_UDINT(buf, (CN_UDINT) value);  break;
+#ifdef SUPPORT_LINT
+        case T_CIP_LINT:  pack_LINT(buf, (CN_LINT) value);    break;
+#endif
+        case T_CIP_REAL:  pack_REAL(buf, (CN_REAL) value);    break;
+        case T_CIP_LREAL: pack_LREAL(buf, (CN_LREAL) value);  break;
+        }
+    }
+    ++sim.count;
+    return true;
+}
+
+static eip_bool sort_tags()
+{
+    size_t i;
+
+    qsort(sim.tags, sim.count, sizeof(SimTag), compare_tags);
+    for (i=1; i<sim.count; ++i)
+        if (strcmp(sim.tags[i-1].name, sim.tags[i].name) == 0)
+        {
+            EIP_printf(0, "Tag '%s' is defined more than once\n",
+                       sim.tags[i].name);
+            return false;
+        }
+    return true;
+}
+
+/* Read tag file with lines
+ *    name type [elements [value]]
+ * and '#' comments
+ */
+static eip_bool read_tag_file(const char *filename)
+{
+    FILE  *f = fopen(filename, "r");
+    char  line[200], name[EIP_MAX_TAG_LENGTH], type[20];
+    unsigned long elements;
+    double value;
+    int   n, lineno = 0;
+
+    if (! f)
+    {
+        EIP_printf(0, "Cannot open tag file '%s'\n", filename);
+        return false;
+    }
+    while (fgets(line, sizeof(line), f))
+    {
+        ++lineno;
+        elements = 1;
+        value = 0.0;
+        n = sscanf(line, "%99s %19s %lu %lf", name, type, &elements, &value);
+        if (n < 1  ||  name[0] == '#')
+            continue;
+        if (n < 2  ||  ! add_tag(name, type, elements, value))
+        {
+            EIP_printf(0, "%s line %d: Invalid tag definition\n",
+                       filename, lineno);
+            fclose(f);
+            return false;
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+/* Type code for Get_Instance_Attribute_List */
+static CN_UINT tag_list_type(const SimTag *tag)
+{
+    if (tag->type == T_CIP_STRUCT)
+        return tag->elements > 1 ? 0xA000 | T_CIP_STRUCT_STRING
+                                 : 0x8000 | T_CIP_STRUCT_STRING;
+    return tag->elements > 1 ? 0x2000 | tag->type : tag->type;
+}
+
+/********************************************************
+ * Replies
+ ********************************************************/
+
+/* Add MR_Response header for service with status
+ * and optional extended status, return location of data
+ */
+static CN_USINT *make_reply(CN_USINT *reply, CN_USINT service,
+                            CN_USINT status, CN_UINT ext_status)
+{
+    reply = pack_USINT(reply, service | 0x80);
+    reply = pack_USINT(reply, 0);
+    reply = pack_USINT(reply, status);
+    if (ext_status)
+    {
+        reply = pack_USINT(reply, 1);
+        return pack_UINT(reply, ext_status);
+    }
+    return pack_USINT(reply, 0);
+}
+
+/* Decode tag path into name as formatted by EIP_copy_ParsedTag.
+ * A final array index is returned in 'element', not part of the name.
+ * Returns false for unknown path segments.
+ */
+static eip_bool decode_tag_path(const CN_USINT *path, size_t path_bytes,
+                                char *name, size_t *element)
+{
+    const CN_USINT *end = path + path_bytes;
+    size_t  len = 0, seg;
+    CN_UINT ui;
+    CN_UDINT ud;
+
+    *element = 0;
+    name[0] = '\0';
+    while (path < end)
+    {
+        switch (path[0])
+        {
+        case 0x91: /* ANSI extended symbol segment */
+            seg = path[1];
+            if (len + seg + 2 >= EIP_MAX_TAG_LENGTH  ||  path + 2 + seg > end)
+                return false;
+            if (len > 0)
+                name[len++] = '.';
+            memcpy(name+len, path+2, seg);
+            len += seg;
+            name[len] = '\0';
+            path += 2 + seg + seg%2;
+            continue;
+        case 0x28:
+            ud = path[1];
+            path += 2;
+            break;
+        case 0x29:
+            path = unpack_UINT(path+2, &ui);
+            ud = ui;
+            break;
+        case 0x2A:
+            path = unpack_UDINT(path+2, &ud);
+            break;
+        default:
+            return false;
+        }
+        /* Array index: Final one is the element, others part of name */
+        if (path >= end)
+            *element = ud;
+        else
+        {
+            if (len + 12 >= EIP_MAX_TAG_LENGTH)
+                return false;
+            len += sprintf(name+len, "[%u]", (unsigned)ud);
+        }
+    }
+    return len > 0;
+}
+
+/* Locate tag and first element addressed by request path.
+ * For BITS, the path index is a bit number.
+ * Returns status for reply, 0 for OK.
+ */
+static CN_USINT lookup_tag(SimConnection *conn, const CN_USINT *request,
+                           SimTag **tag, size_t *element)
+{
+    char name[EIP_MAX_TAG_LENGTH];
+
+    ++conn->items;
+    if (! decode_tag_path(request+2, 2*request[1], name, element))
+        return 0x04;
+    *tag = find_tag(name);
+    if (! *tag)
+    {
+        EIP_printf(3, "Unknown tag '%s'\n", name);
+        return 0x04;
+    }
+    if ((*tag)->type == T_CIP_BITS)
+        *element /= 32;
+    /* Error injection */
+    if (sim.error_percent > 0  &&
+        100.0*sim_random(conn) < sim.error_percent)
+    {
+        EIP_printf(5, "Injecting error for '%s'\n", name);
+        return 0x0C; /* Object state conflict */
+    }
+    return 0;
+}
+
+/* Handle ReadData, write reply of at most 'limit' bytes */
+static size_t handle_ReadData(SimConnection *conn, const CN_USINT *request,
+                              size_t size, CN_USINT *reply, size_t limit)
+{
+    const CN_USINT *data = request + 2 + 2*request[1];
+    CN_UINT  elements;
+    SimTag   *tag;
+    size_t   element, bytes;
+    CN_USINT status, *buf;
+
+    if (data + 2 > request + size)
+        return make_reply(reply, request[0], 0x13, 0) - reply;
+    unpack_UINT(data, &elements);
+    status = lookup_tag(conn, request, &tag, &element);
+    if (status)
+        return make_reply(reply, request[0], status, 0) - reply;
+    if (element + elements > tag->elements)
+        return make_reply(reply, request[0], 0xFF, 0x2105) - reply;
+    bytes = elements * tag->element_size;
+    if (4 + tag->header_size + bytes > limit)
+    {   /* Like the PLC, return what fits */
+        if (4 + tag->header_size + tag->element_size > limit)
+            return make_reply(reply, request[0], 0x06, 0) - reply;
+        status = 0x06;
+        bytes = (limit - 4 - tag->header_size)
+              / tag->element_size * tag->element_size;
+    }
+    buf = make_reply(reply, request[0], status, 0);
+    epicsMutexLock(sim.lock);
+    memcpy(buf, tag->data, tag->header_size);
+    memcpy(buf + tag->header_size,
+           tag->data + tag->header_size + element*tag->element_size, bytes);
+    epicsMutexUnlock(sim.lock);
+    return buf + tag->header_size + bytes - reply;
+}
+
+/* Handle WriteData */
+static size_t handle_WriteData(SimConnection *conn, const CN_USINT *request,
+                               size_t size, CN_USINT *reply)
+{
+    const CN_USINT *data = request + 2 + 2*request[1];
+    const CN_USINT *end = request + size;
+    CN_UINT  type, handle, elements, len;
+    SimTag   *tag;
+    size_t   element;
+    CN_USINT status, *dest;
+
+    if (data + 4 > end)
+        return make_reply(reply, request[0], 0x13, 0) - reply;
+    data = unpack_UINT(data, &type);
+    status = lookup_tag(conn, request, &tag, &element);
+    if (status)
+        return make_reply(reply, request[0], status, 0) - reply;
+    if (type != tag->type)
+        return make_reply(reply, request[0], 0xFF, 0x2107) - reply;
+    if (type == T_CIP_STRUCT)
+    {   /* STRING: handle, elements, length, 0, characters */
+        if (data + 8 > end)
+            return make_reply(reply, request[0], 0x13, 0) - reply;
+        data = unpack_UINT(data, &handle);
+        data = unpack_UINT(data, &elements);
+        data = unpack_UINT(data, &len);
+        data += 2;
+        if (handle != T_CIP_STRUCT_STRING)
+            return make_reply(reply, request[0], 0xFF, 0x2107) - reply;
+        if (element >= tag->elements)
+            return make_reply(reply, request[0], 0xFF, 0x2105) - reply;
+        if (len > T_CIP_STRUCT_STRING_BUF  ||  data + len > end)
+            return make_reply(reply, request[0], 0x13, 0) - reply;
+        epicsMutexLock(sim.lock);
+        dest = tag->data + tag->header_size + element*tag->element_size;
+        pack_UINT(dest, len);
+        memset(dest + T_CIP_STRUCT_LEN_BYTES, 0, T_CIP_STRUCT_STRING_BUF);
+        memcpy(dest + T_CIP_STRUCT_LEN_BYTES, data, len);
+        epicsMutexUnlock(sim.lock);
+        return make_reply(reply, request[0], 0, 0) - reply;
+    }
+    data = unpack_UINT(data, &elements);
+    if (element + elements > tag->elements)
+        return make_reply(reply, request[0], 0xFF, 0x2105) - reply;
+    if (data + elements * tag->element_size > end)
+        return make_reply(reply, request[0], 0x13, 0) - reply;
+    epicsMutexLock(sim.lock);
+    memcpy(tag->data + tag->header_size + element*tag->element_size,
+           data, elements * tag->element_size);
+    epicsMutexUnlock(sim.lock);
+    return make_reply(reply, request[0], 0, 0) - reply;
+}
+
+/* Handle ReadModifyWrite */
+static size_t handle_ReadModifyWrite(SimConnection *conn,
+                                     const CN_USINT *request,
+                                     size_t size, CN_USINT *reply)
+{
+    const CN_USINT *data = request + 2 + 2*request[1];
+    CN_UINT  mask_size;
+    SimTag   *tag;
+    size_t   element, i;
+    CN_USINT status, *dest;
+
+    if (data + 2 > request + size)
+        return make_reply(reply, request[0], 0x13, 0) - reply;
+    data = unpack_UINT(data, &mask_size);
+    if (data + 2*mask_size > request + size)
+        return make_reply(reply, request[0], 0x13, 0) - reply;
+    status = lookup_tag(conn, request, &tag, &element);
+    if (status)
+        return make_reply(reply, request[0], status, 0) - reply;
+    if (element >= tag->elements)
+        return make_reply(reply, request[0], 0xFF, 0x2105) - reply;
+    if (tag->type == T_CIP_STRUCT  ||  tag->type == T_CIP_REAL  ||
+        tag->type == T_CIP_LREAL   ||  mask_size > tag->element_size)
+        return make_reply(reply, request[0], 0xFF, 0x2107) - reply;
+    epicsMutexLock(sim.lock);
+    dest = tag->data + tag->header_size + element*tag->element_size;
+    for (i=0; i<mask_size; ++i)
+        dest[i] = (dest[i] | data[i]) & data[mask_size + i];
+    epicsMutexUnlock(sim.lock);
+    return make_reply(reply, request[0], 0, 0) - reply;
+}
+
+/* Decode Class/Instance/Attribute path, 0 for missing elements */
+static eip_bool decode_CIA_path(const CN_USINT *request, CN_UINT *cls,
+                                CN_UDINT *instance, CN_UINT *attr)
+{
+    const CN_USINT *path = request + 2;
+    const CN_USINT *end = path + 2*request[1];
+    CN_UINT ui;
+
+    *cls = 0;
+    *instance = 0;
+    *attr = 0;
+    while (path < end)
+    {
+        switch (path[0])
+        {
+        case 0x20: *cls = path[1];      path += 2; break;
+        case 0x21: path = unpack_UINT(path+2, cls); break;
+        case 0x24: *instance = path[1]; path += 2; break;
+        case 0x25: path = unpack_UINT(path+2, &ui); *instance = ui; break;
+        case 0x30: *attr = path[1];     path += 2; break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Handle Get_Attribute_Single or _All for the identity */
+static size_t handle_Get_Attribute(const CN_USINT *request,
+                                   CN_USINT *reply)
+{
+    static const char *name = "EtherIP Soft PLC";
+    CN_UINT  cls, attr;
+    CN_UDINT instance;
+    CN_USINT *buf;
+
+    if (! decode_CIA_path(request, &cls, &instance, &attr))
+        return make_reply(reply, request[0], 0x04, 0) - reply;
+    if (cls != C_Identity  ||  instance != 1)
+        return make_reply(reply, request[0], 0x05, 0) - reply;
+    buf = make_reply(reply, request[0], 0, 0);
+    if (request[0] == S_Get_Attribute_All)
+    {
+        buf = pack_UINT(buf, 0x0001);       /* vendor */
+        buf = pack_UINT(buf, 0x000E);       /* PLC */
+        buf = pack_UINT(buf, 0x0037);       /* product code */
+        buf = pack_UINT(buf, 0x0114);       /* 20.1 */
+        buf = pack_UINT(buf, 0x0060);       /* status */
+        buf = pack_UDINT(buf, 0x5150AFC0 + sim.slot);
+        buf = pack_USINT(buf, strlen(name));
+        memcpy(buf, name, strlen(name));
+        return buf + strlen(name) - reply;
+    }
+    switch (attr)
+    {
+    case 1:  return pack_UINT(buf, 0x0001) - reply;  /* vendor */
+    case 2:  return pack_UINT(buf, 0x000E) - reply;  /* PLC */
+    case 4:  return pack_UINT(buf, 0x0114) - reply;  /* 20.1 */
+    case 6:  return pack_UDINT(buf, 0x5150AFC0 + sim.slot) - reply;
+    case 7:
+        buf = pack_USINT(buf, strlen(name));
+        memcpy(buf, name, strlen(name));
+        return buf + strlen(name) - reply;
+    }
+    return make_reply(reply, request[0], 0x14, 0) - reply;
+}
+
+/* Handle Get_Instance_Attribute_List of Symbol class:
+ * Tags starting at instance (= index+1) with name and type
+ */
+static size_t handle_Get_Instance_Attr_List(const CN_USINT *request,
+                                            CN_USINT *reply, size_t limit)
+{
+    CN_UINT  cls, attr;
+    CN_UDINT instance;
+    CN_USINT *buf, *start;
+    size_t   i, len;
+
+    if (! decode_CIA_path(request, &cls, &instance, &attr))
+        return make_reply(reply, request[0], 0x04, 0) - reply;
+    if (cls != C_Symbol)
+        return make_reply(reply, request[0], 0x05, 0) - reply;
+    start = buf = make_reply(reply, request[0], 0, 0);
+    for (i = instance > 0 ? instance-1 : 0;  i < sim.count;  ++i)
+    {
+        len = strlen(sim.tags[i].name);
+        if ((size_t)(buf - reply) + 8 + len > limit)
+        {   /* Partial list, client continues after last instance */
+            reply[2] = 0x06;
+            break;
+        }
+        buf = pack_UDINT(buf, i+1);
+        buf = pack_UINT(buf, len);
+        memcpy(buf, sim.tags[i].name, len);
+        buf = pack_UINT(buf + len, tag_list_type(&sim.tags[i]));
+    }
+    EIP_printf(8, "Listed %u bytes of tags\n", (unsigned)(buf - start));
+    return buf - reply;
+}
+
+static size_t handle_MR_Request(SimConnection *conn, const CN_USINT *request,
+                                size_t size, CN_USINT *reply, size_t limit);
+
+/* Handle MultiRequest: Each embedded request adds an embedded reply.
+ * When one of them fails, the overall status is 0x1E.
+ */
+static size_t handle_MultiRequest(SimConnection *conn,
+                                  const CN_USINT *request, size_t size,
+                                  CN_USINT *reply, size_t limit)
+{
+    const CN_USINT *countp = request + 2 + 2*request[1];
+    CN_UINT  count, offset, next;
+    CN_USINT *reply_countp, *item;
+    size_t   i, item_size, reply_size;
+
+    if (countp + 2 > request + size)
+        return make_reply(reply, request[0], 0x13, 0) - reply;
+    unpack_UINT(countp, &count);
+    if (countp + 2 + 2*count > request + size)
+        return make_reply(reply, request[0], 0x13, 0) - reply;
+    reply_countp = make_reply(reply, request[0], 0, 0);
+    pack_UINT(reply_countp, count);
+    item = reply_countp + 2 + 2*count;
+    for (i=0; i<count; ++i)
+    {
+        unpack_UINT(countp + 2 + 2*i, &offset);
+        if (i+1 < count)
+            unpack_UINT(countp + 2 + 2*(i+1), &next);
+        else
+            next = request + size - countp;
+        if (offset < 2 + 2*count  ||  next < offset  ||
+            countp + next > request + size)
+            return make_reply(reply, request[0], 0x13, 0) - reply;
+        pack_UINT(reply_countp + 2 + 2*i, item - reply_countp);
+        /* Each item may use what's left below the limit */
+        reply_size = item - reply;
+        item_size = handle_MR_Request(conn, countp + offset, next - offset,
+                                      item, limit > reply_size + 4
+                                            ? limit - reply_size : 4);
+        if (reply_size + item_size > limit)
+            item_size = make_reply(item, (countp + offset)[0], 0x11, 0) - item;
+        if (item[2] != 0)
+            reply[2] = 0x1E;
+        item += item_size;
+    }
+    return item - reply;
+}
+
+/* Is the simulated PLC able to handle another MultiRequest,
+ * or did the last one arrive less than 1/busy_rate ago?
+ */
+static eip_bool sim_accept_request()
+{
+    epicsTimeStamp now;
+    eip_bool       ok;
+
+    epicsMutexLock(sim.lock);
+    epicsTimeGetCurrent(&now);
+    ok = epicsTimeDiffInSeconds(&now, &sim.last_request) >= 1.0/sim.busy_rate;
+    if (ok)
+        sim.last_request = now;
+    epicsMutexUnlock(sim.lock);
+    return ok;
+}
+
+/* Handle CM_Unconnected_Send: Check route to slot, reply of
+ * embedded request replaces the Unconnected_Send reply.
+ */
+static size_t handle_Unconnected_Send(SimConnection *conn,
+                                      const CN_USINT *request, size_t size,
+                                      CN_USINT *reply, size_t limit)
+{
+    const CN_USINT *msg = request + 2 + 2*request[1] + 2;
+    const CN_USINT *route;
+    CN_UINT  msg_size;
+
+    if (msg + 2 > request + size)
+        return make_reply(reply, request[0], 0x13, 0) - reply;
+    msg = unpack_UINT(msg, &msg_size);
+    route = msg + msg_size + msg_size%2;
+    if (route + 4 > request + size)
+        return make_reply(reply, request[0], 0x13, 0) - reply;
+    /* Route: path size, reserved, port 1 (backplane), link = slot */
+    if (route[2] != 1  ||  route[3] != sim.slot)
+    {
+        EIP_printf(3, "Request for port %d, slot %d\n", route[2], route[3]);
+        return make_reply(reply, request[0], 0x01, 0x0312) - reply;
+    }
+    if (msg_size > sim.buffer_limit)
+    {
+        EIP_printf(3, "Request of %u bytes exceeds limit of %u\n",
+                   (unsigned)msg_size, (unsigned)sim.buffer_limit);
+        return make_reply(reply, msg[0], 0x15, 0) - reply;
+    }
+    if (msg[0] == S_CIP_MultiRequest  &&  sim.busy_rate > 0  &&
+        ! sim_accept_request())
+    {
+        EIP_printf(3, "Busy, MultiRequest exceeds %g per second\n",
+                   sim.busy_rate);
+        return make_reply(reply, msg[0], 0x02, 0) - reply;
+    }
+    return handle_MR_Request(conn, msg, msg_size, reply, limit);
+}
+
+/* Handle MR_Request, write reply of up to 'limit' bytes
+ * into 'reply', return size of reply
+ */
+static size_t handle_MR_Request(SimConnection *conn, const CN_USINT *request,
+                                size_t size, CN_USINT *reply, size_t limit)
+{
+    size_t reply_size;
+
+    if (size < 2  ||  2 + 2*(size_t)request[1] > size)
+        return make_reply(reply, size > 0 ? request[0] : 0, 0x13, 0) - reply;
+    if (EIP_verbosity >= 10)
+        dump_raw_MR_Request(request);
+    switch (request[0])
+    {
+    case S_CM_Unconnected_Send:
+        return handle_Unconnected_Send(conn, request, size, reply, limit);
+    case S_CIP_MultiRequest:
+        return handle_MultiRequest(conn, request, size, reply, limit);
+    case S_CIP_ReadData:
+        reply_size = handle_ReadData(conn, request, size, reply, limit);
+        break;
+    case S_CIP_WriteData:
+        reply_size = handle_WriteData(conn, request, size, reply);
+        break;
+    case S_CIP_ReadModifyWrite:
+        reply_size = handle_ReadModifyWrite(conn, request, size, reply);
+        break;
+    case S_Get_Attribute_Single:
+    case S_Get_Attribute_All:
+        return handle_Get_Attribute(request, reply);
+    case S_Get_Instance_Attr_List:
+        return handle_Get_Instance_Attr_List(request, reply, limit);
+    default:
+        return make_reply(reply, request[0], 0x08, 0) - reply;
+    }
+    /* Count failed tag accesses */
+    if (reply[2] != 0)
+        ++conn->errors;
+    return reply_size;
+}
+
+/********************************************************
+ * Encapsulation
+ ********************************************************/
+
+/* Copy request's encapsulation header into reply,
+ * including the transaction ID, and set length, session, status
+ */
+static CN_USINT *make_reply_header(SimConnection *conn, size_t length,
+                                   CN_UDINT status)
+{
+    memcpy(conn->reply, conn->request, sizeof_EncapsulationHeader);
+    pack_UINT(conn->reply+2, length);
+    pack_UDINT(conn->reply+4, conn->session);
+    pack_UDINT(conn->reply+8, status);
+    return conn->reply + sizeof_EncapsulationHeader;
+}
+
+static CN_USINT *make_ListServices_reply(SimConnection *conn)
+{
+    static const char name[16] = "Communications";
+    CN_USINT *buf = make_reply_header(conn, 2 + 24, 0);
+
+    buf = pack_UINT(buf, 1);        /* count */
+    buf = pack_UINT(buf, 0x100);    /* type: communications */
+    buf = pack_UINT(buf, 20);       /* length */
+    buf = pack_UINT(buf, 1);        /* version */
+    buf = pack_UINT(buf, (1<<5) | (1<<8)); /* CIP PDU, class 0/1 */
+    memcpy(buf, name, sizeof(name));
+    return buf + sizeof(name);
+}
+
+/* Handle SendRRData, return end of reply or 0 to not reply */
+static CN_USINT *make_RRData_reply(SimConnection *conn, size_t size)
+{
+    EncapsulationRRData rr;
+    const CN_USINT *request = EIP_unpack_RRData(conn->request, &rr);
+    CN_USINT *buf;
+    size_t   reply_size;
+
+    if (rr.header.session != conn->session  ||  conn->session == 0)
+        return make_reply_header(conn, 0, 0x64);
+    if (request + rr.data_length > conn->request + size  ||
+        rr.data_length > SIM_MAX_BUFFER_LIMIT)
+        return make_reply_header(conn, 0, 0x65);
+    ++conn->requests;
+    if (sim.timeout_percent > 0  &&
+        100.0*sim_random(conn) < sim.timeout_percent)
+    {
+        EIP_printf(5, "Injecting timeout\n");
+        return 0;
+    }
+    buf = conn->reply + sizeof_EncapsulationRRData;
+    reply_size = handle_MR_Request(conn, request, rr.data_length, buf,
+                                   sim.buffer_limit);
+    buf = make_reply_header(conn, sizeof_EncapsulationRRData
+                                  - sizeof_EncapsulationHeader + reply_size, 0);
+    buf = pack_UDINT(buf, 0);    /* interface handle */
+    buf = pack_UINT(buf, 0);     /* timeout */
+    buf = pack_UINT(buf, 2);     /* count */
+    buf = pack_UINT(buf, 0x00);  /* address type: UCMM */
+    buf = pack_UINT(buf, 0);     /* address length */
+    buf = pack_UINT(buf, 0xB2);  /* data type: unconnected message */
+    buf = pack_UINT(buf, reply_size);
+    return buf + reply_size;
+}
+
+/* Read one encapsulated message into conn->request, return size or 0 */
+static size_t read_request(SimConnection *conn)
+{
+    size_t  got = 0, needed = sizeof_EncapsulationHeader;
+    CN_UINT length;
+    int     part;
+
+    while (got < needed)
+    {
+        part = recv(conn->sock, (char *)conn->request + got, needed - got, 0);
+        if (part <= 0)
+            return 0;
+        got += part;
+        if (got == sizeof_EncapsulationHeader)
+        {
+            unpack_UINT(conn->request+2, &length);
+            needed += length;
+            if (needed > SIM_BUFFER_SIZE)
+            {
+                EIP_printf(1, "Request of %u bytes exceeds buffer\n",
+                           (unsigned)needed);
+                return 0;
+            }
+        }
+    }
+    EIP_printf(9, "Request (%d bytes):\n", (int)got);
+    EIP_hexdump(9, conn->request, got);
+    return got;
+}
+
+/* Handle request in conn->request, return end of reply or 0 to not reply */
+static CN_USINT *handle_request(SimConnection *conn,
+                                const EncapsulationHeader *header, size_t size)
+{
+    CN_USINT *end;
+
+    switch (header->command)
+    {
+    case EC_ListServices:
+        return make_ListServices_reply(conn);
+    case EC_RegisterSession:
+        epicsMutexLock(sim.lock);
+        conn->session = ++sim.next_session;
+        epicsMutexUnlock(sim.lock);
+        end = make_reply_header(conn, 4, 0);
+        memcpy(end, conn->request + sizeof_EncapsulationHeader, 4);
+        return end + 4;
+    case EC_UnRegisterSession:
+        return 0;
+    case EC_SendRRData:
+        return make_RRData_reply(conn, size);
+    default:
+        return make_reply_header(conn, 0, 0x01);
+    }
+}
+
+static void connection_task(void *arg)
+{
+    SimConnection *conn = (SimConnection *) arg;
+    EncapsulationHeader header;
+    CN_USINT *end;
+    size_t   size;
+    double   delay;
+    int      len;
+
+    EIP_printf(2, "Connection %d: Open\n", conn->sock);
+    while ((size = read_request(conn)) > 0)
+    {
+        unpack_EncapsulationHeader(conn->request, &header);
+        if (header.command == EC_UnRegisterSession)
+            break;
+        end = handle_request(conn, &header, size);
+        if (! end)
+            continue;
+        if (header.command == EC_SendRRData)
+        {
+            delay = sim.latency;
+            if (sim.jitter > 0)
+                delay += sim.jitter * sim_random(conn);
+            if (delay > 0)
+                epicsThreadSleep(delay);
+        }
+        len = end - conn->reply;
+        EIP_printf(9, "Reply (%d bytes):\n", len);
+        EIP_hexdump(9, conn->reply, len);
+        if (send(conn->sock, (void *)conn->reply, len, 0) != len)
+            break;
+    }
+    EIP_printf(1, "Connection %d: Closed after %u requests, "
+               "%u items, %u item errors\n",
+               conn->sock, (unsigned)conn->requests,
+               (unsigned)conn->items, (unsigned)conn->errors);
+    EIP_socket_close(conn->sock);
+    free(conn);
+}
+
+/********************************************************
+ * Loopback target
+ ********************************************************/
+
+/* The simulated PLC can also be used within a test program,
+ * via the loopback transport instead of the network:
+ *
+ *   #define EIP_SIM_LOOPBACK
+ *   #include "ether_ip_sim.c"
+ *   ...
+ *   sim.lock = epicsMutexCreate();
+ *   add_tag(...); sort_tags();
+ *   EIP_loopback(&sim_loopback_target);
+ *
+ * Replies are not delayed by the latency.
+ */
+static void *sim_loopback_open(CN_UDINT peer_ip, CN_UINT peer_port)
+{
+    SimConnection *conn = (SimConnection *) calloc(1, sizeof(SimConnection));
+
+    if (conn)
+        conn->seed = peer_ip + peer_port; /* Reproducible 'random' */
+    return conn;
+}
+
+static const CN_USINT *sim_loopback_handle(void *target,
+                                           const CN_USINT *request,
+                                           size_t size, size_t *reply_size)
+{
+    SimConnection *conn = (SimConnection *) target;
+    EncapsulationHeader header;
+    CN_USINT *end;
+
+    if (size > SIM_BUFFER_SIZE)
+        return 0;
+    memcpy(conn->request, request, size);
+    unpack_EncapsulationHeader(conn->request, &header);
+    end = handle_request(conn, &header, size);
+    if (! end)
+        return 0;
+    *reply_size = end - conn->reply;
+    return conn->reply;
+}
+
+static void sim_loopback_close(void *target)
+{
+    free(target);
+}
+
+static const EIPLoopbackTarget sim_loopback_target =
+{
+    sim_loopback_open, sim_loopback_handle, sim_loopback_close
+};
+
+#ifndef EIP_SIM_LOOPBACK
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s <Options> [tag type [elements [value]]] ...\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -v verbosity                       Set verbosity 1-10\n");
+    fprintf(stderr, "  -i ip                              Local address to use, default: all\n");
+    fprintf(stderr, "  -p port                            Select non-default TCP port\n");
+    fprintf(stderr, "  -s PLC slot in ControlLogix crate  Default: 0\n");
+    fprintf(stderr, "  -f file                            Read tags from file,\n");
+    fprintf(stderr, "                                     lines 'name type [elements [value]]'\n");
+    fprintf(stderr, "  -n count                           Add REAL tags sim0, sim1, ...\n");
+    fprintf(stderr, "  -b bytes                           Buffer limit, default: %d\n",
+            (int)EIP_DEFAULT_BUFFER_LIMIT + 20);
+    fprintf(stderr, "  -l latency                         .. of replies in ms\n");
+    fprintf(stderr, "  -j jitter                          Random ms added to latency\n");
+    fprintf(stderr, "  -e percent                         Items that fail\n");
+    fprintf(stderr, "  -x percent                         Requests that time out\n");
+    fprintf(stderr, "  -r rate                            MultiRequests per second before\n");
+    fprintf(stderr, "                                     replying 'resource unavailable'\n");
+    fprintf(stderr, "Types: ");
+    {
+        size_t t;
+        for (t=0; t<SIM_TYPE_COUNT; ++t)
+            fprintf(stderr, "%s ", sim_types[t].name);
+    }
+    fprintf(stderr, "\n");
+    exit(-1);
+}
+
+int main (int argc, const char *argv[])
+{
+    const char      *ip = 0;
+    unsigned short  port = 0xAF12;
+    const char      *arg, *type;
+    size_t          i, count = 0, elements;
+    char            name[EIP_MAX_TAG_LENGTH];
+    struct sockaddr_in addr;
+    EIP_SOCKET      listener, sock;
+    SimConnection   *conn;
+    int             flag = true;
+
+#ifdef _WIN32
+    /* Win32 socket init. */
+    WORD wVersionRequested;
+    WSADATA wsaData;
+    wVersionRequested = MAKEWORD(2, 2);
+    WSAStartup(wVersionRequested, &wsaData);
+#endif
+
+    check_sizes();
+    sim.lock = epicsMutexCreate();
+    transIdMutex = epicsMutexCreate();
+    sim.buffer_limit = EIP_DEFAULT_BUFFER_LIMIT + 20;
+    EIP_verbosity = 1;
+    /* parse arguments */
+    for (i=1; i<(size_t)argc; ++i)
+    {
+        if (argv[i][0] == '-')
+        {
+#define         GETARG                                          \
+                if (argv[i][2])  { arg = &argv[i  ][2];      }  \
+                else             { arg = &argv[i+1][0]; ++i; }
+            switch (argv[i][1])
+            {
+            case 'v':
+                GETARG
+                if (arg) EIP_verbosity = atoi(arg);
+                else usage (argv[0]);
+                break;
+            case 'i':
+                GETARG
+                if (arg) ip = arg;
+                else usage (argv[0]);
+                break;
+            case 'p':
+                GETARG
+                if (arg) port = (unsigned short) strtol(arg, 0, 0);
+                else usage (argv[0]);
+                break;
+            case 's':
+                GETARG
+                if (arg) sim.slot = (int) strtol(arg, 0, 0);
+                else usage (argv[0]);
+                break;
+            case 'f':
+                GETARG
+                if (! arg  ||  ! read_tag_file(arg))
+                    usage (argv[0]);
+                break;
+            case 'n':
+                GETARG
+                if (arg) count = atol(arg);
+                else usage (argv[0]);
+                break;
+            case 'b':
+                GETARG
+                if (arg) sim.buffer_limit = atol(arg);
+                else usage (argv[0]);
+                if (sim.buffer_limit > SIM_MAX_BUFFER_LIMIT)
+                    sim.buffer_limit = SIM_MAX_BUFFER_LIMIT;
+                break;
+            case 'l':
+                GETARG
+                if (arg) sim.latency = atof(arg) / 1000.0;
+                else usage (argv[0]);
+                break;
+            case 'j':
+                GETARG
+                if (arg) sim.jitter = atof(arg) / 1000.0;
+                else usage (argv[0]);
+                break;
+            case 'e':
+                GETARG
+                if (arg) sim.error_percent = atof(arg);
+                else usage (argv[0]);
+                break;
+            case 'x':
+                GETARG
+                if (arg) sim.timeout_percent = atof(arg);
+                else usage (argv[0]);
+                break;
+            case 'r':
+                GETARG
+                if (arg) sim.busy_rate = atof(arg);
+                else usage (argv[0]);
+                break;
+            default:
+                usage (argv[0]);
+#undef          GETARG
+            }
+        }
+        else
+        {   /* tag type [elements [value]] */
+            if (i+1 >= (size_t)argc)
+                usage (argv[0]);
+            arg = argv[i];
+            type = argv[++i];
+            elements = 1;
+            if (i+1 < (size_t)argc  &&  isdigit(argv[i+1][0]))
+                elements = atol(argv[++i]);
+            if (! add_tag(arg, type,  elements,
+                          (i+1 < (size_t)argc  &&  argv[i+1][0] != '-')
+                          ? atof(argv[++i]) : 0.0))
+                usage (argv[0]);
+        }
+    }
+    for (i=0; i<count; ++i)
+    {
+        sprintf(name, "sim%u", (unsigned)i);
+        if (! add_tag(name, "REAL", 1, (double)i))
+            return -1;
+    }
+    if (sim.count <= 0)
+    {
+        fprintf(stderr, "No tags\n");
+        usage (argv[0]);
+    }
+    if (! sort_tags())
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (ip  &&  hostToIPAddr(ip, &addr.sin_addr) < 0)
+    {
+        EIP_printf(0, "Cannot find IP for '%s'\n", ip);
+        return -1;
+    }
+    listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listener == EIP_INVALID_SOCKET)
+    {
+        EIP_printf(0, "Cannot create socket\n");
+        return -1;
+    }
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR,
+               (char *) &flag, sizeof(flag));
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0  ||
+        listen(listener, 10) != 0)
+    {
+        EIP_printf(0, "Cannot listen on %s:%u\n", ip ? ip : "*", port);
+        return -1;
+    }
+    EIP_printf(0, "Soft PLC with %u tags, slot %d, buffer limit %u, "
+               "listening on %s:%u\n",
+               (unsigned)sim.count, sim.slot, (unsigned)sim.buffer_limit,
+               ip ? ip : "*", port);
+
+    while ((sock = accept(listener, 0, 0)) != EIP_INVALID_SOCKET)
+    {
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
+                   (char *) &flag, sizeof(flag));
+        conn = (SimConnection *) calloc(1, sizeof(SimConnection));
+        if (! conn)
+        {
+            EIP_socket_close(sock);
+            continue;
+        }
+        conn->sock = sock;
+        conn->seed = (unsigned) time(0) + (unsigned) sock;
+        if (! epicsThreadCreate("EIPsim", epicsThreadPriorityMedium,
+                                epicsThreadGetStackSize(epicsThreadStackMedium),
+                                connection_task, conn))
+        {
+            EIP_socket_close(sock);
+            free(conn);
+        }
+    }
+    EIP_socket_close(listener);
+
+#ifdef _WIN32
+    /* Win32 socket shutdown */
+    WSACleanup( );
+#endif
+
+    return 0;
+}
+
+#endif /* EIP_SIM_LOOPBACK */
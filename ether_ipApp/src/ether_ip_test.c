@@ -11,6 +11,8 @@
 #include<stddef.h>
 #include<time.h>
 #include<stdlib.h>
+#include<epicsThread.h>
+#include<epicsEvent.h>
 #include"ether_ip.c"
 
 #ifdef DEFINE_CONNECTED_METHODS
@@ -228,68 +230,308 @@ void TestConnected(EIPConnection *c, const ParsedTag *tag[])
 #endif /* DEFINE_CONNECTED_METHODS */
 
 
-#if 0
-void stressC(EIPConnection *c, size_t count, const ParsedTag *tag[], size_t runs)
+/* Benchmark: Read tags with MultiRequests over one or more sessions */
+#define BENCH_MAX_TAGS 100
+
+typedef struct
+{
+    /* Configuration, same for all sessions */
+    const char      *ip;
+    unsigned short  port;
+    int             slot;
+    size_t          timeout_ms;
+    size_t          count;
+    ParsedTag       **tags;
+    size_t          elements;
+    double          seconds;        /* Run time or 0 */
+    size_t          iterations;     /* Reads of all tags or 0 */
+    /* Per session */
+    EIPConnection   *c;
+    epicsEventId    done;
+    eip_bool        ok;
+    size_t          requests;       /* MultiRequests sent */
+    size_t          tag_reads;      /* Tags read successfully */
+    size_t          errors;         /* Failed tag reads */
+    size_t          bytes;          /* Bytes sent and received */
+    double          duration;       /* Seconds from first to last request */
+    double          *latency;       /* Seconds per MultiRequest */
+    size_t          latency_count, latency_alloc;
+} BenchSession;
+
+/* Add latency of one MultiRequest to session */
+static void bench_add_latency(BenchSession *s, double secs)
 {
-    TimerValue t;
-    double secs;
-    size_t i;
+    double *more;
 
-    ForwardOpen (c);
-    TimerInit (&t);
-    TimerStart (&t);
-    for (i=0; i<runs; ++i)
+    if (s->latency_count >= s->latency_alloc)
     {
-        ReadConnected (c, count, tag);
+        s->latency_alloc = s->latency_alloc ? 2*s->latency_alloc : 1024;
+        more = (double *) realloc(s->latency,
+                                  s->latency_alloc * sizeof(double));
+        if (! more)
+            return;
+        s->latency = more;
     }
+    s->latency[s->latency_count++] = secs;
+}
 
-    secs = TimerStop (&t);
+/* Read tags [first, first+count) in one MultiRequest, update session stats */
+static eip_bool bench_read(BenchSession *s, size_t first, size_t count,
+                           size_t multi_size)
+{
+    EIPConnection   *c = s->c;
+    CN_USINT        *send_request, *multi_request, *request;
+    const CN_USINT  *response;
+    const CN_USINT  *replies[CIP_MultiRequest_max_count];
+    size_t          reply_sizes[CIP_MultiRequest_max_count];
+    EncapsulationRRData rr_data;
+    size_t          i, data_size;
+    epicsTimeStamp  start_time, end_time;
+    CN_UINT         length;
+    TransactionID   tid, rid;
+
+    generateTransactionId(&tid);
+    send_request = EIP_make_SendRRData(c, CM_Unconnected_Send_size(multi_size),
+                                       &tid);
+    if (! send_request)
+        return false;
+    multi_request = make_CM_Unconnected_Send(send_request, multi_size, c->slot);
+    if (! (multi_request && prepare_CIP_MultiRequest(multi_request, count)))
+        return false;
+    for (i=0; i<count; ++i)
+    {
+        request = CIP_MultiRequest_item(multi_request, i,
+                                        CIP_ReadData_size(s->tags[first+i]));
+        if (! (request &&
+               make_CIP_ReadData(request, s->tags[first+i], s->elements)))
+            return false;
+    }
+    unpack_UINT(c->buffer+2, &length);
+    s->bytes += sizeof_EncapsulationHeader + length;
 
-    if (secs != 0.0)
+    epicsTimeGetCurrent(&start_time);
+    if (! EIP_send_connection_buffer(c))
+    {
+        EIP_printf(1, "Benchmark: send failed\n");
+        return false;
+    }
+    if (! EIP_read_connection_buffer(c))
+    {
+        EIP_printf(1, "Benchmark: No response\n");
+        return false;
+    }
+    epicsTimeGetCurrent(&end_time);
+    bench_add_latency(s, epicsTimeDiffInSeconds(&end_time, &start_time));
+    ++s->requests;
+
+    response = EIP_unpack_RRData(c->buffer, &rr_data);
+    s->bytes += sizeof_EncapsulationHeader + rr_data.header.length;
+    extractTransactionId(&rr_data.header, &rid);
+    if (! compareTransactionIds(&tid, &rid))
     {
-        printf ("%6.2f runs/sec, %6.2f msec/run ->",
-                runs/secs, secs/runs*1000.0);
-        printf ("%8.2f values/sec, %6.2f msec/value\n",
-                runs*count/secs, secs/(runs*count)*1000.0);
+        EIP_printf(1, "Benchmark: Mismatch in transaction ID\n");
+        return false;
     }
-    else
-        printf ("Try more runs\n");
-    ForwardClose (c);
+    if (! check_CIP_MultiRequest_Response(response, rr_data.data_length))
+    {
+        if (EIP_verbosity >= 2)
+            dump_CIP_MultiRequest_Response_Error(response,
+                                                 rr_data.data_length);
+        s->errors += count;
+        return true;
+    }
+    if (get_CIP_MultiRequest_Responses(response, rr_data.data_length,
+                                       CIP_MultiRequest_max_count,
+                                       replies, reply_sizes) != count)
+    {
+        EIP_printf(1, "Benchmark: Invalid response\n");
+        s->errors += count;
+        return true;
+    }
+    for (i=0; i<count; ++i)
+    {
+        if (check_CIP_ReadData_Response(replies[i], reply_sizes[i],
+                                        &data_size))
+            ++s->tag_reads;
+        else
+            ++s->errors;
+    }
+    return true;
 }
 
-void stress(EIPConnection *c, size_t count, const ParsedTag *tags[], size_t runs)
+/* Thread for one benchmark session */
+static void bench_session(void *arg)
 {
-    TimerValue t;
-    double secs;
-    size_t i;
+    BenchSession    *s = (BenchSession *) arg;
+    size_t          response_size[BENCH_MAX_TAGS];
+    size_t          group_first[BENCH_MAX_TAGS], group_count[BENCH_MAX_TAGS];
+    size_t          group_size[BENCH_MAX_TAGS];
+    size_t          groups = 0, i, n, iteration, data_size;
+    size_t          requests_size, responses_size;
+    epicsTimeStamp  start_time, now;
+    eip_bool        running = true;
+
+    s->ok = false;
+    if (! EIP_startup(s->c, s->ip, s->port, s->slot, s->timeout_ms))
+    {
+        epicsEventSignal(s->done);
+        return;
+    }
+    /* Read each tag once to learn the response size */
+    for (i=0; i<s->count; ++i)
+    {
+        if (! EIP_read_tag(s->c, s->tags[i], s->elements, &data_size,
+                           0, &response_size[i]))
+        {
+            char buffer[EIP_MAX_TAG_LENGTH];
+            EIP_copy_ParsedTag(buffer, s->tags[i]);
+            EIP_printf(0, "Benchmark: Cannot read tag '%s'\n", buffer);
+            EIP_shutdown(s->c);
+            epicsEventSignal(s->done);
+            return;
+        }
+    }
+    /* Pack tags into MultiRequests that fit the buffer limit,
+     * at least one tag per request
+     */
+    for (i=0; i<s->count; i+=n)
+    {
+        requests_size = responses_size = 0;
+        for (n=0; i+n < s->count; ++n)
+        {
+            if (n > 0  &&
+                (CIP_MultiRequest_size(n+1, requests_size +
+                                       CIP_ReadData_size(s->tags[i+n]))
+                 > s->c->transfer_buffer_limit  ||
+                 CIP_MultiResponse_size(n+1, responses_size +
+                                        response_size[i+n])
+                 > s->c->transfer_buffer_limit))
+                break;
+            requests_size  += CIP_ReadData_size(s->tags[i+n]);
+            responses_size += response_size[i+n];
+        }
+        group_first[groups] = i;
+        group_count[groups] = n;
+        group_size[groups]  = CIP_MultiRequest_size(n, requests_size);
+        ++groups;
+    }
+    s->ok = true;
+    epicsTimeGetCurrent(&start_time);
+    now = start_time;
+    for (iteration=0; running; ++iteration)
+    {
+        if (s->iterations  &&  iteration >= s->iterations)
+            break;
+        for (i=0; running && i<groups; ++i)
+        {
+            if (! bench_read(s, group_first[i], group_count[i],
+                             group_size[i]))
+            {
+                s->ok = false;
+                running = false;
+            }
+            epicsTimeGetCurrent(&now);
+            if (s->seconds > 0  &&
+                epicsTimeDiffInSeconds(&now, &start_time) >= s->seconds)
+                running = false;
+        }
+    }
+    s->duration = epicsTimeDiffInSeconds(&now, &start_time);
+    EIP_shutdown(s->c);
+    epicsEventSignal(s->done);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+    return da < db ? -1 : (da > db ? 1 : 0);
+}
 
-    TimerInit (&t);
-    TimerStart (&t);
-    for (i=0; i<runs; ++i)
+/* Latency at quantile q (0..1) of sorted latencies, nearest rank */
+static double bench_quantile(const double *sorted, size_t n, double q)
+{
+    size_t rank = (size_t)(q * n + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    if (rank > n)
+        rank = n;
+    return sorted[rank-1];
+}
+
+static void benchmark(BenchSession *config, size_t sessions)
+{
+    BenchSession    *s = (BenchSession *) calloc(sessions, sizeof(BenchSession));
+    size_t          i, requests = 0, tag_reads = 0, errors = 0;
+    size_t          bytes = 0, count = 0;
+    double          duration = 0.0, *latency;
+    char            name[20];
+
+    if (! s)
+        return;
+    for (i=0; i<sessions; ++i)
     {
-        if (count == 1)
-            ReadTag (c, tags[0], 1);
-        else
-            ReadTags (c, count, tags);
+        s[i] = *config;
+        s[i].c = EIP_init();
+        s[i].done = epicsEventCreate(epicsEventEmpty);
+        sprintf(name, "EIPbench%u", (unsigned) i);
+        epicsThreadCreate(name, epicsThreadPriorityMedium,
+                          epicsThreadGetStackSize(epicsThreadStackMedium),
+                          bench_session, &s[i]);
+    }
+    for (i=0; i<sessions; ++i)
+    {
+        epicsEventWait(s[i].done);
+        if (! s[i].ok)
+            printf("Session %u failed\n", (unsigned) i);
+        requests  += s[i].requests;
+        tag_reads += s[i].tag_reads;
+        errors    += s[i].errors;
+        bytes     += s[i].bytes;
+        count     += s[i].latency_count;
+        if (s[i].duration > duration)
+            duration = s[i].duration;
+    }
+    latency = (double *) malloc((count ? count : 1) * sizeof(double));
+    for (count=0, i=0; latency && i<sessions; ++i)
+    {
+        if (s[i].latency_count)
+            memcpy(latency + count, s[i].latency,
+                   s[i].latency_count * sizeof(double));
+        count += s[i].latency_count;
+    }
+
+    printf("Benchmark: %u session(s), %u tag(s), buffer limit %u bytes\n",
+           (unsigned) sessions, (unsigned) config->count,
+           (unsigned) EIP_buffer_limit);
+    printf("%u MultiRequests, %u tag reads, %u errors in %.3f seconds\n",
+           (unsigned) requests, (unsigned) tag_reads, (unsigned) errors,
+           duration);
+    if (duration > 0)
+        printf("Throughput: %.1f tags/s, %.1f packets/s, %.1f bytes/s\n",
+               tag_reads/duration, 2*requests/duration, bytes/duration);
+    if (latency && count > 0)
+    {
+        qsort(latency, count, sizeof(double), compare_double);
+        printf("Latency: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+               1000.0*bench_quantile(latency, count, 0.50),
+               1000.0*bench_quantile(latency, count, 0.90),
+               1000.0*bench_quantile(latency, count, 0.99),
+               1000.0*latency[count-1]);
     }
-    secs = TimerStop (&t);
 
-    //count *= 40;
-    if (secs != 0.0)
+    free(latency);
+    for (i=0; i<sessions; ++i)
     {
-        printf ("%6.2f runs/sec, %6.2f msec/run ->",
-                runs/secs, secs/runs*1000.0);
-        printf ("%8.2f values/sec, %6.2f msec/value\n",
-                runs*count/secs, secs/(runs*count)*1000.0);
+        free(s[i].latency);
+        epicsEventDestroy(s[i].done);
+        EIP_dispose(s[i].c);
     }
-    else
-        printf ("Try more runs\n");
+    free(s);
 }
-#endif
 
 void usage(const char *progname)
 {
-    fprintf(stderr, "Usage: %s <Options> [tag]\n", progname);
+    fprintf(stderr, "Usage: %s <Options> [tag] [more tags for benchmark]\n", progname);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -l                                 List tags on PLC\n");
     fprintf(stderr, "  -d type ID                         Describe type using ID from list of tags\n");
@@ -304,6 +546,12 @@ void usage(const char *progname)
     fprintf(stderr, "  -W <64 bit value to write>         .. with larger data type\n");
 #endif
     fprintf(stderr, "  -T times-to-do-all-this            Default: 1\n");
+    fprintf(stderr, "  -b bytes                           Buffer limit for MultiRequests\n");
+    fprintf(stderr, "  -B seconds                         Benchmark: Read all tags in MultiRequests\n");
+    fprintf(stderr, "  -N iterations                      .. or read all tags this many times\n");
+    fprintf(stderr, "  -S sessions                        .. using parallel sessions, default: 1\n");
+    fprintf(stderr, "  -C file.pcap                       Capture all messages into pcap file\n");
+    fprintf(stderr, "  -R file.pcap                       Replay responses from pcap file instead of PLC\n");
     exit(-1);
 }
 
@@ -331,6 +579,14 @@ int main (int argc, const char *argv[])
     struct timeval  now;
 #endif
     double          start, end, duration;
+    ParsedTag       *tags[BENCH_MAX_TAGS];
+    size_t          tag_count = 0;
+    double          bench_seconds = 0.0;
+    size_t          bench_iterations = 0;
+    size_t          bench_sessions = 1;
+    BenchSession    bench_config;
+    const char      *capture = 0;
+    const char      *replay = 0;
 
 #ifdef _WIN32
     /* Win32 socket init. */
@@ -425,6 +681,38 @@ int main (int argc, const char *argv[])
                 }
                 else usage (argv[0]);
                 break;
+            case 'b':
+                GETARG
+                if (arg) EIP_buffer_limit = atoi(arg);
+                else usage (argv[0]);
+                break;
+            case 'B':
+                GETARG
+                if (arg) bench_seconds = strtod(arg, NULL);
+                else usage (argv[0]);
+                break;
+            case 'N':
+                GETARG
+                if (arg) bench_iterations = atol(arg);
+                else usage (argv[0]);
+                break;
+            case 'S':
+                GETARG
+                if (arg) bench_sessions = atol(arg);
+                else usage (argv[0]);
+                if (bench_sessions <= 0)
+                    bench_sessions = 1;
+                break;
+            case 'C':
+                GETARG
+                if (arg) capture = arg;
+                else usage (argv[0]);
+                break;
+            case 'R':
+                GETARG
+                if (arg) replay = arg;
+                else usage (argv[0]);
+                break;
             default:
                 usage (argv[0]);
 #undef          GETARG
@@ -433,9 +721,46 @@ int main (int argc, const char *argv[])
         else
         {
            tag = EIP_parse_tag(argv[i]);
+           if (! tag)
+               continue;
+           if (tag_count >= BENCH_MAX_TAGS)
+           {
+               fprintf(stderr, "At most %d tags\n", BENCH_MAX_TAGS);
+               exit(-1);
+           }
+           tags[tag_count++] = tag;
         }
     }
 
+    if ((capture  &&  !EIP_capture(capture))  ||
+        (replay   &&  !EIP_replay(replay)))
+        exit(-1);
+
+    if (bench_seconds > 0  ||  bench_iterations > 0)
+    {
+        if (tag_count <= 0)
+            usage (argv[0]);
+        memset(&bench_config, 0, sizeof(bench_config));
+        bench_config.ip         = ip;
+        bench_config.port       = port;
+        bench_config.slot       = slot;
+        bench_config.timeout_ms = timeout_ms;
+        bench_config.count      = tag_count;
+        bench_config.tags       = tags;
+        bench_config.elements   = elements;
+        bench_config.seconds    = bench_seconds;
+        bench_config.iterations = bench_iterations;
+        benchmark(&bench_config, bench_sessions);
+        for (i=0; i<tag_count; ++i)
+            EIP_free_ParsedTag (tags[i]);
+        EIP_capture(0);
+        EIP_dispose(c);
+#ifdef _WIN32
+        WSACleanup( );
+#endif
+        return 0;
+    }
+
     if (tag && EIP_verbosity >= 3)
     {
         char buffer[EIP_MAX_TAG_LENGTH];
@@ -483,7 +808,8 @@ int main (int argc, const char *argv[])
             EIP_shutdown (c);
         }
     }
-    EIP_free_ParsedTag (tag);
+    for (i=0; i<tag_count; ++i)
+        EIP_free_ParsedTag (tags[i]);
     tag = 0;
 #ifdef _WIN32
     end = (double) time(0);
@@ -497,6 +823,7 @@ int main (int argc, const char *argv[])
            duration,
            duration / test_runs * 1000.0);
 
+    EIP_capture(0);
     EIP_dispose(c);
 
 #ifdef _WIN32
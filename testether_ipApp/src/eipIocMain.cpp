@@ -68,7 +68,7 @@ static bool definePlc(const char *def)
     const char *ip = c+1;
 
     printf("drvEtherIP_define_PLC(\"%s\", \"%s\", %d);\n", plc, ip, slot);
-    drvEtherIP_define_PLC(plc, ip, slot);
+    drvEtherIP_define_PLC(plc, ip, slot, 1);
     free(copy);
 
     return true;